@@ -1,12 +1,34 @@
 #ifndef _AUDIO_H_
 #define _AUDIO_H_
 
-#define SAMPLE_FREQ         20000   // sampling rate
-#define AUDIO_BUFFER_LEN    4096    // audio buffer size
+#define SAMPLE_FREQ         20000   // default sampling rate
+#define SAMPLE_FREQ_MIN     8000    // audio_set_rate() limits
+#define SAMPLE_FREQ_MAX     48000
+#define AUDIO_TIM_CLOCK     1000000 // TIM6 counter clock, PSC set by enable_turbo()
+#define AUDIO_BUFFER_LEN    2048    // audio buffer size, halves rendered by the DMA interrupt
+#define AUDIO_RAMP_LEN      4096    // samples of the cosinus ramp between 0V and Vcc/2 bias
 #define AUDIO_TIMEOUT       150000  // max audio transmission (150sec)
+#define AUDIO_QUEUE_LEN     128     // render command queue length, power of 2, must hold more than AUDIO_BUFFER_LEN/2 samples of PSK1000 at 11025Hz
+#define AUDIO_LINE_SLOTS    8       // scanlines buffered for the render interrupt, power of 2
+#define AUDIO_SHAPE_LEN     1600    // longest cached envelope, PSK31 symbol at SAMPLE_FREQ_MAX; half of it is stored
+#define AUDIO_MIX_CHANNELS  1       // oscillator channels mixed to the main one, at least 1
+#define AUDIO_MIX_QUEUE_LEN 128     // command queue of a mixed channel, power of 2, more than AUDIO_BUFFER_LEN/2 samples of PSK1000 at SAMPLE_FREQ
+#define AUDIO_MIX_TEXT_LEN  128     // message of a mixed channel incl. trailing zero
+#define AUDIO_MIX_CHUNK     64      // samples of a mixed channel rendered at once
+#define AUDIO_GEN_STEP_MAX  33      // max commands of one encoder step, CW character of 8 elements
+#define CW_MIX_GUARD        200     // min distance in Hz of a mixed CW tone from the main signal band
+#define AUDIO_LINE_INTERP   0       // linear interpolation between pixels in SSTV lines
 #define AUDIO_VOLUME_SSTV   ((q15_t)(0.9 * 32767)) // peak volume in Q15
 #define AUDIO_VOLUME_PSK    ((q15_t)(0.4 * 32767)) // peak volume in Q15
 #define AUDIO_VOLUME_MORSE  ((q15_t)(0.9 * 32767)) // peak volume in Q15
+#define AUDIO_VOLUME_MIX    ((q15_t)(0.1 * 32767)) // peak volume of a mixed channel under SSTV at full volume
+
+#define AUDIO_US(__sec)     ((uint32_t)((__sec) * 1000000 + 0.5)) // SSTV segment duration in us
+#define AUDIO_VOX_US        AUDIO_US(1.200) // audio_play_vox_start() and audio_play_vox_stop() together
+#define AUDIO_VIS_US(__bits) (AUDIO_US(0.670) + (__bits) * AUDIO_US(0.030)) // audio_play_vis() or audio_play_vis16()
+
+#define NCO_LUT_BITS        10      // sine table size, 2^10 entries in sine.h
+#define NCO_INDEX(__phi)    ((((__phi) + (1UL << (30-NCO_LUT_BITS))) >> (31-NCO_LUT_BITS)) & ((1 << NCO_LUT_BITS) - 1)) // rounded sine table index
 
 #define AUDIO_RESET_IDX     0x01
 #define AUDIO_RESET_PHI     0x02
@@ -22,24 +44,68 @@
 #define IEGLEN              1   // Length of inter-element gap
 #define ICGLEN              3   // Length of inter-character gap
 #define IWGLEN              7   // Length of inter-word gap
+#define CW_SHAPING_US       10000   // CW rise/fall time
 
 #define CHROMA_R_Y          0   // Rgb
 #define CHROMA_B_Y          2   // rgB
 
+/* SSTV scanline segment, see SSTV_MODE */
+typedef enum {
+    SSTV_TONE,          // constant tone: sync, porch or separator
+    SSTV_LUMA,          // Y scan of the line
+    SSTV_R_Y,           // R-Y scan, averaged over the lines of the sequence
+    SSTV_B_Y,           // B-Y scan, averaged over the lines of the sequence
+    SSTV_RED,           // R scan of the line
+    SSTV_GREEN,         // G scan of the line
+    SSTV_BLUE,          // B scan of the line
+} SSTV_SCAN;
+
+typedef struct {
+    uint8_t scan;       // SSTV_SCAN
+    uint8_t line;       // line within the sequence for Y and RGB scans
+    uint16_t freq;      // tone frequency
+    uint32_t us;        // duration, zero terminates the sequence
+} SSTV_SEGMENT;
+
+/* SSTV mode descriptor, interpreted by audio_sstv_scan() */
+typedef struct {
+    uint8_t mode;       // mode number for sstv_play_jpeg()
+    const char *name;
+    uint16_t width;     // image width, IMG_WIDTH or IMG_WIDTH_MAX, IMG_WIDTH/2 for quick-look modes
+    uint16_t height;    // transmitted lines incl. header
+    uint16_t vis;       // VIS code incl. parity bit
+    uint8_t vis_bits;   // 8 or 16 bit VIS code
+    uint8_t lines;      // image lines per segment sequence
+    bool header;        // 256 lines: 16 lines of black header before the image
+    uint8_t ovl_header; // overlay block row for the header text
+    uint8_t ovl_large;  // first of three overlay block rows for the large text
+    uint32_t start_us;  // 1200Hz sync before the first line, zero if none
+    const SSTV_SEGMENT *seq; // segments of one sequence
+} SSTV_MODE;
+
 extern void audio_start();
 extern void audio_stop();
+extern uint16_t audio_set_rate(uint16_t rate);
+extern uint16_t audio_get_rate(void);
+extern bool audio_busy(void);
+extern uint32_t audio_get_queued(void);
+extern uint32_t audio_get_pending(void);
+extern void audio_idle_callback(void);
 
 extern void audio_psk(uint16_t speed, uint16_t freq, const char *s);
 extern void audio_morse(uint16_t wpm, uint16_t freq, const char *s);
+extern void audio_mix_psk(uint8_t channel, uint16_t speed, uint16_t freq, const char *s, int16_t volume);
+extern void audio_mix_morse(uint8_t channel, uint16_t wpm, uint16_t freq, const char *s, int16_t volume);
+extern bool audio_mix_cancel(void);
 
 extern void audio_play_vox_start();
 extern void audio_play_vox_stop();
 extern void audio_play_vis(uint8_t vis);
 extern void audio_play_vis16(uint16_t vis16);
 
-extern void audio_robot36_color(uint8_t *scanline);
-extern void audio_robot72_color(uint8_t *scanline);
-extern void audio_mp73(uint8_t *scanline);
-extern void audio_mp115(uint8_t *scanline);
+extern void audio_play_sync(uint32_t us);
+extern bool audio_sstv_ready(const SSTV_MODE *mode);
+extern void audio_sstv_scan(const SSTV_MODE *mode, uint8_t *scanline, uint8_t rows);
+extern void audio_sstv_scan_ycc(const SSTV_MODE *mode, uint8_t *strip, uint8_t line, uint8_t rows);
 
 #endif /* _AUDIO_H_ */
@@ -17,6 +17,7 @@
 #define PSK_RSP_SSTV_36     '3'
 #define PSK_RSP_SSTV_73     '7'
 #define PSK_RSP_TLM         't'
+#define PSK_RSP_SLOT        'w'     // followed by remaining TX slot in seconds, binary
 
 // temperature sensor calibration
 #define TS_CAL_1        *(uint16_t*)(0x1FFF7A2C)
@@ -29,6 +30,7 @@ typedef enum { SRC_CMD, SRC_UPLINK, SRC_AUTO, SRC_STARTUP } CMD_SOURCE;
 extern void cmd_handler(char *cmd, CMD_SOURCE src);
 extern void psk_uplink_handler(char cmd);
 extern void psk_auto_handler(char cmd);
+extern void psk_slot_handler(char cmd);
 
 extern void cmd_handler_const(const char *cmd, CMD_SOURCE src);
 extern bool psk_request(char c);
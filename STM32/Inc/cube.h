@@ -11,6 +11,7 @@
 #define ENABLE_PSK_COMM         0
 #define STARTUP_CMD_DELAY       25
 #define MIN_MULTI_DELAY         60
+#define HIRES_MAX_IMAGES        4       // flash images taken by one high resolution snapshot, 256kB of JPEG data
 #define DEFAULT_SSTV_MODE       36
 #define DISABLE_AUTH            1
 #define CW_WPM                  25
@@ -18,6 +19,10 @@
 #define PSK_SPEED               31
 #define PSK_FREQ                800
 #define PSK_TLM_FREQ            "280"
+#define PSK_SAMPLE_FREQ         11025   // audio sampling rate for PSK and CW
+#ifndef ENABLE_DAC_12BIT
+#define ENABLE_DAC_12BIT        0       // 12-bit DAC samples instead of 8-bit
+#endif
 
 #include <stdlib.h>
 #include <stdbool.h>
@@ -101,6 +101,7 @@ typedef struct {
     uint16_t agc_manual;
     uint16_t aec_manual;
     uint8_t awb;
+    uint8_t rotate;     // SSTV_ROTATE_xx, portrait mounted module
 } CONFIG_CAMERA;
 
 // nonvolatile system settings
@@ -123,6 +124,7 @@ typedef struct {
     } sstv_live;
     struct {
         uint8_t page;
+        uint16_t width; // 800 up to 1600 for high resolution snapshots streamed to flash
         uint16_t count;
         uint16_t delay_curr;
         uint16_t delay_next;
@@ -12,12 +12,18 @@
 
 #define M25P16_INIT_RETRY       3       // retry count for flash init
 
+#define FLASH_STREAM_BLOCK      512     // DMA block of streamed read, one block is read while the next one is received
+
 #define ADDR_JPEGIMAGE(__id)    (((__id) * 2 + 0) << 16)    // JPEG pages - odd - 0, 2, 4, ...
 #define ADDR_THUMBNAIL(__id)    (((__id) * 2 + 1) << 16)    // thumbnail pages - even - 1, 2, 3, ... from 0x0000
 #define ADDR_FLASHINFO(__id)    ((((__id) * 2 + 1) << 16) + 0x00004000) // flash info after thumbnails ... from 0x4000
+#define ADDR_JPEGDATA(__id, __pos)  (ADDR_JPEGIMAGE((__id) + ((__pos) >> 16)) + ((__pos) & 0xFFFF)) // JPEG over the JPEG pages of consecutive images, larger than 64kB
 
 extern bool flash_init(void);
 extern void flash_read(uint32_t addr, uint8_t *buffer, uint16_t length);
+extern void flash_stream_open(uint32_t addr);
+extern void flash_stream_read(uint8_t *buffer, uint16_t length);
+extern void flash_stream_close(void);
 extern bool flash_program_page(uint32_t addr, uint8_t *buffer);
 extern bool flash_program(uint32_t addr, uint8_t *buffer, uint16_t length);
 extern bool flash_erase_sector(uint32_t addr);
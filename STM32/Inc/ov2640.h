@@ -6,6 +6,8 @@
 #define SLAVE_ADDR          0x60    // I2C address
 #define SCCB_TIMEOUT        500     // camera I2C timeout [ms]
 #define SENSOR_TIMEOUT      800     // camera DCMI timeout [ms]
+#define SENSOR_TIMEOUT_STREAM 8000  // camera DCMI timeout of frame streamed to flash [ms]
+#define SENSOR_CLKRC_STREAM 0x07    // CLKRC divider of frames streamed to flash, JPEG data rate below flash programming rate
 #define SENSOR_INIT_RETRY   3       // init retry count
 
 #define AWB_AUTO            0
@@ -20,11 +22,12 @@
 extern bool ov2640_enable(bool en);
 extern bool ov2640_enable_safe(bool en);
 extern uint32_t ov2640_snapshot(uint8_t *buffer, uint32_t length);
+extern uint32_t ov2640_snapshot_stream(uint8_t *buffer, uint32_t length, uint32_t limit, bool (*drain)(uint8_t *data, uint32_t length));
 extern void ov2640_set_awb(uint8_t mode);
 extern uint16_t ov2640_get_current_agc(void);
 extern uint16_t ov2640_get_current_aec(void);
 extern void ov2640_set_register(uint8_t bank, uint8_t reg, uint8_t value);
 extern uint8_t ov2640_get_register(uint8_t bank, uint8_t reg);
-extern bool ov2640_hilevel_init(CONFIG_CAMERA cam) __attribute__ ((warn_unused_result));
+extern bool ov2640_hilevel_init(CONFIG_CAMERA cam, uint16_t width) __attribute__ ((warn_unused_result));
 
 #endif /* __OV2640_H__ */
@@ -0,0 +1,136 @@
+#ifdef INCLUDE_SINE
+
+// Full-wave sine table for the audio NCO, 1024 entries in Q15, round(32767*sin(2*pi*i/1024)).
+// Indexed by the 10 MSBs of the 31-bit phase accumulator (rounded), see audio_to_buffer().
+static const q15_t SINE_TABLE[1024] = {
+         0,    201,    402,    603,    804,   1005,   1206,   1407, // 0
+      1608,   1809,   2009,   2210,   2410,   2611,   2811,   3012, // 8
+      3212,   3412,   3612,   3811,   4011,   4210,   4410,   4609, // 16
+      4808,   5007,   5205,   5404,   5602,   5800,   5998,   6195, // 24
+      6393,   6590,   6786,   6983,   7179,   7375,   7571,   7767, // 32
+      7962,   8157,   8351,   8545,   8739,   8933,   9126,   9319, // 40
+      9512,   9704,   9896,  10087,  10278,  10469,  10659,  10849, // 48
+     11039,  11228,  11417,  11605,  11793,  11980,  12167,  12353, // 56
+     12539,  12725,  12910,  13094,  13279,  13462,  13645,  13828, // 64
+     14010,  14191,  14372,  14553,  14732,  14912,  15090,  15269, // 72
+     15446,  15623,  15800,  15976,  16151,  16325,  16499,  16673, // 80
+     16846,  17018,  17189,  17360,  17530,  17700,  17869,  18037, // 88
+     18204,  18371,  18537,  18703,  18868,  19032,  19195,  19357, // 96
+     19519,  19680,  19841,  20000,  20159,  20317,  20475,  20631, // 104
+     20787,  20942,  21096,  21250,  21403,  21554,  21705,  21856, // 112
+     22005,  22154,  22301,  22448,  22594,  22739,  22884,  23027, // 120
+     23170,  23311,  23452,  23592,  23731,  23870,  24007,  24143, // 128
+     24279,  24413,  24547,  24680,  24811,  24942,  25072,  25201, // 136
+     25329,  25456,  25582,  25708,  25832,  25955,  26077,  26198, // 144
+     26319,  26438,  26556,  26674,  26790,  26905,  27019,  27133, // 152
+     27245,  27356,  27466,  27575,  27683,  27790,  27896,  28001, // 160
+     28105,  28208,  28310,  28411,  28510,  28609,  28706,  28803, // 168
+     28898,  28992,  29085,  29177,  29268,  29358,  29447,  29534, // 176
+     29621,  29706,  29791,  29874,  29956,  30037,  30117,  30195, // 184
+     30273,  30349,  30424,  30498,  30571,  30643,  30714,  30783, // 192
+     30852,  30919,  30985,  31050,  31113,  31176,  31237,  31297, // 200
+     31356,  31414,  31470,  31526,  31580,  31633,  31685,  31736, // 208
+     31785,  31833,  31880,  31926,  31971,  32014,  32057,  32098, // 216
+     32137,  32176,  32213,  32250,  32285,  32318,  32351,  32382, // 224
+     32412,  32441,  32469,  32495,  32521,  32545,  32567,  32589, // 232
+     32609,  32628,  32646,  32663,  32678,  32692,  32705,  32717, // 240
+     32728,  32737,  32745,  32752,  32757,  32761,  32765,  32766, // 248
+     32767,  32766,  32765,  32761,  32757,  32752,  32745,  32737, // 256
+     32728,  32717,  32705,  32692,  32678,  32663,  32646,  32628, // 264
+     32609,  32589,  32567,  32545,  32521,  32495,  32469,  32441, // 272
+     32412,  32382,  32351,  32318,  32285,  32250,  32213,  32176, // 280
+     32137,  32098,  32057,  32014,  31971,  31926,  31880,  31833, // 288
+     31785,  31736,  31685,  31633,  31580,  31526,  31470,  31414, // 296
+     31356,  31297,  31237,  31176,  31113,  31050,  30985,  30919, // 304
+     30852,  30783,  30714,  30643,  30571,  30498,  30424,  30349, // 312
+     30273,  30195,  30117,  30037,  29956,  29874,  29791,  29706, // 320
+     29621,  29534,  29447,  29358,  29268,  29177,  29085,  28992, // 328
+     28898,  28803,  28706,  28609,  28510,  28411,  28310,  28208, // 336
+     28105,  28001,  27896,  27790,  27683,  27575,  27466,  27356, // 344
+     27245,  27133,  27019,  26905,  26790,  26674,  26556,  26438, // 352
+     26319,  26198,  26077,  25955,  25832,  25708,  25582,  25456, // 360
+     25329,  25201,  25072,  24942,  24811,  24680,  24547,  24413, // 368
+     24279,  24143,  24007,  23870,  23731,  23592,  23452,  23311, // 376
+     23170,  23027,  22884,  22739,  22594,  22448,  22301,  22154, // 384
+     22005,  21856,  21705,  21554,  21403,  21250,  21096,  20942, // 392
+     20787,  20631,  20475,  20317,  20159,  20000,  19841,  19680, // 400
+     19519,  19357,  19195,  19032,  18868,  18703,  18537,  18371, // 408
+     18204,  18037,  17869,  17700,  17530,  17360,  17189,  17018, // 416
+     16846,  16673,  16499,  16325,  16151,  15976,  15800,  15623, // 424
+     15446,  15269,  15090,  14912,  14732,  14553,  14372,  14191, // 432
+     14010,  13828,  13645,  13462,  13279,  13094,  12910,  12725, // 440
+     12539,  12353,  12167,  11980,  11793,  11605,  11417,  11228, // 448
+     11039,  10849,  10659,  10469,  10278,  10087,   9896,   9704, // 456
+      9512,   9319,   9126,   8933,   8739,   8545,   8351,   8157, // 464
+      7962,   7767,   7571,   7375,   7179,   6983,   6786,   6590, // 472
+      6393,   6195,   5998,   5800,   5602,   5404,   5205,   5007, // 480
+      4808,   4609,   4410,   4210,   4011,   3811,   3612,   3412, // 488
+      3212,   3012,   2811,   2611,   2410,   2210,   2009,   1809, // 496
+      1608,   1407,   1206,   1005,    804,    603,    402,    201, // 504
+         0,   -201,   -402,   -603,   -804,  -1005,  -1206,  -1407, // 512
+     -1608,  -1809,  -2009,  -2210,  -2410,  -2611,  -2811,  -3012, // 520
+     -3212,  -3412,  -3612,  -3811,  -4011,  -4210,  -4410,  -4609, // 528
+     -4808,  -5007,  -5205,  -5404,  -5602,  -5800,  -5998,  -6195, // 536
+     -6393,  -6590,  -6786,  -6983,  -7179,  -7375,  -7571,  -7767, // 544
+     -7962,  -8157,  -8351,  -8545,  -8739,  -8933,  -9126,  -9319, // 552
+     -9512,  -9704,  -9896, -10087, -10278, -10469, -10659, -10849, // 560
+    -11039, -11228, -11417, -11605, -11793, -11980, -12167, -12353, // 568
+    -12539, -12725, -12910, -13094, -13279, -13462, -13645, -13828, // 576
+    -14010, -14191, -14372, -14553, -14732, -14912, -15090, -15269, // 584
+    -15446, -15623, -15800, -15976, -16151, -16325, -16499, -16673, // 592
+    -16846, -17018, -17189, -17360, -17530, -17700, -17869, -18037, // 600
+    -18204, -18371, -18537, -18703, -18868, -19032, -19195, -19357, // 608
+    -19519, -19680, -19841, -20000, -20159, -20317, -20475, -20631, // 616
+    -20787, -20942, -21096, -21250, -21403, -21554, -21705, -21856, // 624
+    -22005, -22154, -22301, -22448, -22594, -22739, -22884, -23027, // 632
+    -23170, -23311, -23452, -23592, -23731, -23870, -24007, -24143, // 640
+    -24279, -24413, -24547, -24680, -24811, -24942, -25072, -25201, // 648
+    -25329, -25456, -25582, -25708, -25832, -25955, -26077, -26198, // 656
+    -26319, -26438, -26556, -26674, -26790, -26905, -27019, -27133, // 664
+    -27245, -27356, -27466, -27575, -27683, -27790, -27896, -28001, // 672
+    -28105, -28208, -28310, -28411, -28510, -28609, -28706, -28803, // 680
+    -28898, -28992, -29085, -29177, -29268, -29358, -29447, -29534, // 688
+    -29621, -29706, -29791, -29874, -29956, -30037, -30117, -30195, // 696
+    -30273, -30349, -30424, -30498, -30571, -30643, -30714, -30783, // 704
+    -30852, -30919, -30985, -31050, -31113, -31176, -31237, -31297, // 712
+    -31356, -31414, -31470, -31526, -31580, -31633, -31685, -31736, // 720
+    -31785, -31833, -31880, -31926, -31971, -32014, -32057, -32098, // 728
+    -32137, -32176, -32213, -32250, -32285, -32318, -32351, -32382, // 736
+    -32412, -32441, -32469, -32495, -32521, -32545, -32567, -32589, // 744
+    -32609, -32628, -32646, -32663, -32678, -32692, -32705, -32717, // 752
+    -32728, -32737, -32745, -32752, -32757, -32761, -32765, -32766, // 760
+    -32767, -32766, -32765, -32761, -32757, -32752, -32745, -32737, // 768
+    -32728, -32717, -32705, -32692, -32678, -32663, -32646, -32628, // 776
+    -32609, -32589, -32567, -32545, -32521, -32495, -32469, -32441, // 784
+    -32412, -32382, -32351, -32318, -32285, -32250, -32213, -32176, // 792
+    -32137, -32098, -32057, -32014, -31971, -31926, -31880, -31833, // 800
+    -31785, -31736, -31685, -31633, -31580, -31526, -31470, -31414, // 808
+    -31356, -31297, -31237, -31176, -31113, -31050, -30985, -30919, // 816
+    -30852, -30783, -30714, -30643, -30571, -30498, -30424, -30349, // 824
+    -30273, -30195, -30117, -30037, -29956, -29874, -29791, -29706, // 832
+    -29621, -29534, -29447, -29358, -29268, -29177, -29085, -28992, // 840
+    -28898, -28803, -28706, -28609, -28510, -28411, -28310, -28208, // 848
+    -28105, -28001, -27896, -27790, -27683, -27575, -27466, -27356, // 856
+    -27245, -27133, -27019, -26905, -26790, -26674, -26556, -26438, // 864
+    -26319, -26198, -26077, -25955, -25832, -25708, -25582, -25456, // 872
+    -25329, -25201, -25072, -24942, -24811, -24680, -24547, -24413, // 880
+    -24279, -24143, -24007, -23870, -23731, -23592, -23452, -23311, // 888
+    -23170, -23027, -22884, -22739, -22594, -22448, -22301, -22154, // 896
+    -22005, -21856, -21705, -21554, -21403, -21250, -21096, -20942, // 904
+    -20787, -20631, -20475, -20317, -20159, -20000, -19841, -19680, // 912
+    -19519, -19357, -19195, -19032, -18868, -18703, -18537, -18371, // 920
+    -18204, -18037, -17869, -17700, -17530, -17360, -17189, -17018, // 928
+    -16846, -16673, -16499, -16325, -16151, -15976, -15800, -15623, // 936
+    -15446, -15269, -15090, -14912, -14732, -14553, -14372, -14191, // 944
+    -14010, -13828, -13645, -13462, -13279, -13094, -12910, -12725, // 952
+    -12539, -12353, -12167, -11980, -11793, -11605, -11417, -11228, // 960
+    -11039, -10849, -10659, -10469, -10278, -10087,  -9896,  -9704, // 968
+     -9512,  -9319,  -9126,  -8933,  -8739,  -8545,  -8351,  -8157, // 976
+     -7962,  -7767,  -7571,  -7375,  -7179,  -6983,  -6786,  -6590, // 984
+     -6393,  -6195,  -5998,  -5800,  -5602,  -5404,  -5205,  -5007, // 992
+     -4808,  -4609,  -4410,  -4210,  -4011,  -3811,  -3612,  -3412, // 1000
+     -3212,  -3012,  -2811,  -2611,  -2410,  -2210,  -2009,  -1809, // 1008
+     -1608,  -1407,  -1206,  -1005,   -804,   -603,   -402,   -201, // 1016
+};
+
+#endif
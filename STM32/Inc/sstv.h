@@ -2,9 +2,13 @@
 #define _SSTV_H_
 
 #define IMG_BUFFER_SIZE 65536 // default size of JPEG buffer
+#define IMG_WORKSPACE   3600  // JPEG decoder memory pool: ~2.5kB of tables and buffers, two 512B Huffman lookup tables
 
-#define IMG_WIDTH       320 // total image width
+#define IMG_WIDTH       320 // default image width, thumbnails and saved images
+#define IMG_WIDTH_MAX   640 // widest image, PD120 and PD180 modes
 #define IMG_HEIGHT      16  // height of decompressed JPEG block
+#define IMG_STRIP_RGB(__w)  ((__w) * IMG_HEIGHT * 3)     // RGB888 strip of IMG_HEIGHT rows
+#define IMG_STRIP_YCC(__w)  ((__w) * IMG_HEIGHT * 3 / 2) // YCbCr strip: Y plane w*IMG_HEIGHT, Cb and Cr planes w/2*IMG_HEIGHT/2
 
 // sizes for text overlay
 #define TEXT_Z1_WIDTH   39  /* IMG_WIDTH/8  - 1 */
@@ -17,12 +21,25 @@
 #define OVERLAY_LARGE   2
 #define OVERLAY_FROM    3
 
+#define SSTV_ROTATE_NONE    0
+#define SSTV_ROTATE_CW      1   // 90 degrees clockwise, portrait modules
+#define SSTV_ROTATE_CCW     2   // 90 degrees counterclockwise
+
 extern bool jpeg_thumbnail(uint8_t *jpeg, uint8_t **thumbnail);
 extern bool jpeg_decompress(uint8_t *jpeg);
 extern bool jpeg_test(uint8_t *jpeg, uint32_t length);
+extern uint32_t jpeg_benchmark(uint8_t *jpeg, uint8_t scale);
+extern uint32_t jpeg_benchmark_rotate(uint8_t *jpeg, uint8_t mode, bool index, uint16_t *passes);
 
+extern const SSTV_MODE *sstv_get_mode(uint8_t mode);
+extern uint32_t sstv_get_duration(uint8_t mode);
+extern uint8_t sstv_fit_mode(uint8_t mode, uint32_t slot_ms);
 extern bool sstv_play_jpeg(uint8_t* jpeg, uint8_t mode);
+extern bool sstv_play_flash(uint8_t sector, uint32_t length, uint8_t mode);
 extern bool sstv_play_thumbnail(uint8_t mode);
+extern uint16_t sstv_get_slack(void);
+extern void sstv_set_zoom(uint8_t zoom, uint8_t x, uint8_t y);
+extern void sstv_set_rotate(uint8_t rotate);
 extern void sstv_set_overlay(uint8_t line, const char *overlay);
 
 #endif /* _SSTV_H_ */
@@ -10,6 +10,13 @@
 #define JD_FORMAT		0	/* Output pixel format 0:RGB888 (3 BYTE/pix), 1:RGB565 (1 WORD/pix) */
 #define	JD_USE_SCALE	1	/* Use descaling feature for output */
 #define JD_TBLCLIP		1	/* Use table for saturation (might be a bit faster but increases 1K bytes of code size) */
+#define JD_USE_YCC		1	/* Enable planar YCbCr 4:2:0 output selected by JDEC.ycc (JD_FORMAT does not apply to it) */
+#define JD_CONCEAL		1	/* Continue after data errors at the next RSTn marker, lost MCUs are output with a null bitmap */
+#define JD_USE_CROP		1	/* Decode only the MCUs of JDEC.crop, the others are huffman decoded and dropped */
+#define JD_USE_INDEX	1	/* Save the decoder states of the MCUs in JDEC.index, the next jd_decomp() resumes each row left of JDEC.crop */
+#ifndef JD_HUFFLUT
+#define JD_HUFFLUT		9	/* Bits of huffman fast lookup tables, 0:disable or 2..9 (2^N bytes per table taken from the work pool if available) */
+#endif
 
 /*---------------------------------------------------------------------------*/
 
@@ -42,22 +49,42 @@ typedef struct {
 
 
 
+/* Decoder state at an MCU of the stream (JD_USE_INDEX) */
+typedef struct {
+	DWORD ofs;				/* Stream offset of the next input byte from the start of jd_decomp(), 0:not saved */
+	DWORD wreg;				/* Bit stream shift register */
+	SHORT dcv[3];			/* Previous DC element of each component */
+	WORD rst, rsc;			/* Restart interval counters */
+	BYTE dbit, marker;		/* Number of bits in the shift register, marker found */
+} JSTATE;
+
+
+
 /* Decompressor object structure */
 typedef struct JDEC JDEC;
 struct JDEC {
 	UINT dctr;				/* Number of bytes available in the input buffer */
 	BYTE* dptr;				/* Current data read ptr */
 	BYTE* inbuf;			/* Bit stream input buffer */
-	BYTE dmsk;				/* Current bit in the current read byte */
+	DWORD wreg;				/* Bit stream shift register, MSB aligned */
+	BYTE dbit;				/* Number of bits available in the shift register */
+	BYTE marker;			/* Marker found in the bit stream (0:none), the register is not filled beyond it */
 	BYTE scale;				/* Output scaling ratio */
+	BYTE ycc;				/* Output format, 0:JD_FORMAT, 1:Y plane, Cb and Cr planes of half width and height (set after jd_prepare) */
 	BYTE msx, msy;			/* MCU size in unit of block (width, height) */
 	BYTE qtid[3];			/* Quantization table ID of each component */
 	SHORT dcv[3];			/* Previous DC element of each component */
 	WORD nrst;				/* Restart inverval */
+	UINT nlost;				/* Number of MCUs lost by data errors in the last jd_decomp() (JD_CONCEAL) */
 	UINT width, height;		/* Size of the input image (pixel) */
+	JRECT crop;				/* Window of the input image to decompress (pixel), MCUs outside are not output (set after jd_prepare, JD_USE_CROP) */
+	JSTATE* index;			/* Decoder states at every istep-th MCU of each row, zeroed before the first jd_decomp() (set after jd_prepare, JD_USE_INDEX) */
+	WORD istep;				/* Number of MCUs between the decoder states of a row in the index */
+	DWORD nread;			/* Number of bytes read from the stream since the start of jd_decomp() */
 	BYTE* huffbits[2][2];	/* Huffman bit distribution tables [id][dcac] */
 	WORD* huffcode[2][2];	/* Huffman code word tables [id][dcac] */
 	BYTE* huffdata[2][2];	/* Huffman decoded data tables [id][dcac] */
+	BYTE* hufflut[2][2];	/* Huffman fast lookup tables [id][dcac], null if not allocated */
 	LONG* qttbl[4];			/* Dequaitizer tables [id] */
 	void* workbuf;			/* Working buffer for IDCT and RGB output */
 	BYTE* mcubuf;			/* Working buffer for the MCU */
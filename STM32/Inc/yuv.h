@@ -0,0 +1,364 @@
+#ifndef _YUV_H_
+#define _YUV_H_
+
+#ifdef INCLUDE_YUV
+
+/*
+ * Luma and chroma of RGB888 scanlines for the SSTV encoders:
+ *   Y = (30R + 59G + 11B) / 100
+ *   C = (c - Y + 255) / 2, c is R or B; 2-line variants average both lines first
+ *
+ * All variants produce identical bytes:
+ *   _ref  portable scalar reference
+ *   _dsp  Cortex-M4 DSP instructions (SMLAD, UHADD8), 4 pixels per iteration
+ *   _sse2 / _neon  host build, 16 pixels per iteration
+ * The division by 100 is an exact multiply-shift, (s * 5243) >> 19 for s <= 25500.
+ * (c - Y + 255) / 2 equals floor((c + ~Y) / 2), which is one UHADD8 for 4 pixels.
+ *
+ * Cortex-M4 instruction count per 16-line strip (5120 pixels) at 320px:
+ *   luma           ref ~12 cycles/px (3x LDRB, MUL, 2x MLA, UMULL, STRB)   61k -> dsp ~9.5 cycles/px  49k
+ *   chroma 2 lines ref ~14 cycles/px (6x LDRB, 3x ADD/LSR, SUB, STRB)      36k -> dsp ~5.5 cycles/px  14k
+ * Robot36 needs luma once and chroma twice per line pair, ~130k -> ~77k cycles per strip.
+ */
+
+#define YUV_DIV100(__s)     (((__s) * 5243UL) >> 19)
+
+
+static inline void yuv_luma_ref(const uint8_t *rgb, uint8_t *luma, uint16_t n)
+{
+    for (uint16_t i = 0; i < n; i++) {
+        uint16_t y = 0;
+        y += (uint16_t)rgb[i*3+0] * 30;
+        y += (uint16_t)rgb[i*3+1] * 59;
+        y += (uint16_t)rgb[i*3+2] * 11;
+        luma[i] = y / 100;
+    }
+}
+
+
+static inline void yuv_chroma_ref(const uint8_t *rgb, const uint8_t *luma, uint8_t *chroma, uint8_t ofs, uint16_t n)
+{
+    for (uint16_t i = 0; i < n; i++) {
+        uint16_t y = luma[i];
+        uint16_t c = rgb[i*3+ofs];
+        chroma[i] = (c-y + 255) / 2;
+    }
+}
+
+
+/* Second line of rgb and luma follows the first one, width n */
+static inline void yuv_chroma_2lines_ref(const uint8_t *rgb, const uint8_t *luma, uint8_t *chroma, uint8_t ofs, uint16_t n)
+{
+    for (uint16_t i = 0; i < n; i++) {
+        uint16_t y = ((uint16_t)luma[i] + luma[i+n])/2;
+        uint16_t c = ((uint16_t)rgb[i*3+ofs] + rgb[i*3+ofs+n*3])/2;
+        chroma[i] = (c-y + 255) / 2;
+    }
+}
+
+
+#if defined(__ARM_FEATURE_DSP) || defined(HOST_DSP_INTRINSICS)
+
+static inline uint32_t yuv_load32(const uint8_t *p)
+{
+    uint32_t w;
+    memcpy(&w, p, 4); // unaligned LDR on Cortex-M4
+    return w;
+}
+
+
+/* Bytes ofs, ofs+3, ofs+6, ofs+9 of 4 RGB pixels in w[0..2] */
+static inline uint32_t yuv_gather(const uint32_t *w, uint8_t ofs)
+{
+    if (ofs == 0) return (w[0] & 0xFF) | ((w[0] >> 24) << 8) | (w[1] & 0x00FF0000) | ((w[2] & 0x0000FF00) << 16);
+    if (ofs == 1) return ((w[0] >> 8) & 0xFF) | ((w[1] & 0xFF) << 8) | ((w[1] >> 24) << 16) | ((w[2] & 0x00FF0000) << 8);
+    return ((w[0] >> 16) & 0xFF) | (w[1] & 0x0000FF00) | ((w[2] & 0xFF) << 16) | (w[2] & 0xFF000000);
+}
+
+
+static inline void yuv_luma_dsp(const uint8_t *rgb, uint8_t *luma, uint16_t n)
+{
+    const uint32_t c_rb = 30 | (11 << 16); // R in bottom, B in top halfword
+    const uint32_t c_br = 11 | (30 << 16);
+    uint16_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        /* R0 G0 B0 R1 | G1 B1 R2 G2 | B2 R3 G3 B3 */
+        uint32_t w0 = yuv_load32(rgb), w1 = yuv_load32(rgb+4), w2 = yuv_load32(rgb+8);
+        uint32_t a0 = __UXTB16(w0), b0 = __UXTB16(w0 >> 8); // R0 B0, G0 R1
+        uint32_t a1 = __UXTB16(w1), b1 = __UXTB16(w1 >> 8); // G1 R2, B1 G2
+        uint32_t a2 = __UXTB16(w2), b2 = __UXTB16(w2 >> 8); // B2 G3, R3 B3
+
+        uint32_t y0 = __SMLAD(a0, c_rb, (b0 & 0xFFFF) * 59);
+        uint32_t y1 = __SMLAD(__PKHTB(b0, b1, 0), c_br, (a1 & 0xFFFF) * 59);
+        uint32_t y2 = __SMLAD(__PKHTB(a1, a2, 0), c_br, (b1 >> 16) * 59);
+        uint32_t y3 = __SMLAD(b2, c_rb, (a2 >> 16) * 59);
+
+        uint32_t y = YUV_DIV100(y0) | (YUV_DIV100(y1) << 8) | (YUV_DIV100(y2) << 16) | (YUV_DIV100(y3) << 24);
+        memcpy(luma, &y, 4);
+        rgb += 12;
+        luma += 4;
+    }
+    yuv_luma_ref(rgb, luma, n - i);
+}
+
+
+static inline void yuv_chroma_dsp(const uint8_t *rgb, const uint8_t *luma, uint8_t *chroma, uint8_t ofs, uint16_t n)
+{
+    uint16_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        uint32_t w[3] = { yuv_load32(rgb), yuv_load32(rgb+4), yuv_load32(rgb+8) };
+        uint32_t c = __UHADD8(yuv_gather(w, ofs), ~yuv_load32(luma));
+        memcpy(chroma, &c, 4);
+        rgb += 12;
+        luma += 4;
+        chroma += 4;
+    }
+    yuv_chroma_ref(rgb, luma, chroma, ofs, n - i);
+}
+
+
+static inline void yuv_chroma_2lines_dsp(const uint8_t *rgb, const uint8_t *luma, uint8_t *chroma, uint8_t ofs, uint16_t n)
+{
+    uint16_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        uint32_t w[3];
+        for (uint8_t k = 0; k < 3; k++) w[k] = __UHADD8(yuv_load32(rgb + 4*k), yuv_load32(rgb + 4*k + n*3));
+        uint32_t y = __UHADD8(yuv_load32(luma), yuv_load32(luma + n));
+        uint32_t c = __UHADD8(yuv_gather(w, ofs), ~y);
+        memcpy(chroma, &c, 4);
+        rgb += 12;
+        luma += 4;
+        chroma += 4;
+    }
+    /* tail: both lines are addressed relative to the first one */
+    for (; i < n; i++, rgb += 3, luma++, chroma++) {
+        uint16_t y = ((uint16_t)luma[0] + luma[n])/2;
+        uint16_t c = ((uint16_t)rgb[ofs] + rgb[ofs+n*3])/2;
+        *chroma = (c-y + 255) / 2;
+    }
+}
+
+#endif /* DSP */
+
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+/* Deinterleave 16 RGB pixels to planes */
+static inline void yuv_load_rgb_sse2(const uint8_t *p, __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i t00 = _mm_loadu_si128((const __m128i*)p);
+    __m128i t01 = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i t02 = _mm_loadu_si128((const __m128i*)(p + 32));
+
+    __m128i t10 = _mm_unpacklo_epi8(t00, _mm_unpackhi_epi64(t01, t01));
+    __m128i t11 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t00, t00), t02);
+    __m128i t12 = _mm_unpacklo_epi8(t01, _mm_unpackhi_epi64(t02, t02));
+
+    __m128i t20 = _mm_unpacklo_epi8(t10, _mm_unpackhi_epi64(t11, t11));
+    __m128i t21 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t10, t10), t12);
+    __m128i t22 = _mm_unpacklo_epi8(t11, _mm_unpackhi_epi64(t12, t12));
+
+    __m128i t30 = _mm_unpacklo_epi8(t20, _mm_unpackhi_epi64(t21, t21));
+    __m128i t31 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t20, t20), t22);
+    __m128i t32 = _mm_unpacklo_epi8(t21, _mm_unpackhi_epi64(t22, t22));
+
+    *r = _mm_unpacklo_epi8(t30, _mm_unpackhi_epi64(t31, t31));
+    *g = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t30, t30), t32);
+    *b = _mm_unpacklo_epi8(t31, _mm_unpackhi_epi64(t32, t32));
+}
+
+
+/* floor((a + b) / 2), PAVGB rounds up */
+static inline __m128i yuv_hadd_sse2(__m128i a, __m128i b)
+{
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+
+static inline __m128i yuv_luma16_sse2(__m128i r, __m128i g, __m128i b, __m128i z)
+{
+    __m128i s;
+    s = _mm_mullo_epi16(_mm_unpacklo_epi8(r, z), _mm_set1_epi16(30));
+    s = _mm_add_epi16(s, _mm_mullo_epi16(_mm_unpacklo_epi8(g, z), _mm_set1_epi16(59)));
+    s = _mm_add_epi16(s, _mm_mullo_epi16(_mm_unpacklo_epi8(b, z), _mm_set1_epi16(11)));
+    __m128i lo = _mm_srli_epi16(_mm_mulhi_epu16(s, _mm_set1_epi16(5243)), 3);
+    s = _mm_mullo_epi16(_mm_unpackhi_epi8(r, z), _mm_set1_epi16(30));
+    s = _mm_add_epi16(s, _mm_mullo_epi16(_mm_unpackhi_epi8(g, z), _mm_set1_epi16(59)));
+    s = _mm_add_epi16(s, _mm_mullo_epi16(_mm_unpackhi_epi8(b, z), _mm_set1_epi16(11)));
+    __m128i hi = _mm_srli_epi16(_mm_mulhi_epu16(s, _mm_set1_epi16(5243)), 3);
+    return _mm_packus_epi16(lo, hi);
+}
+
+
+static inline void yuv_luma_sse2(const uint8_t *rgb, uint8_t *luma, uint16_t n)
+{
+    const __m128i z = _mm_setzero_si128();
+    uint16_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i r, g, b;
+        yuv_load_rgb_sse2(rgb, &r, &g, &b);
+        _mm_storeu_si128((__m128i*)luma, yuv_luma16_sse2(r, g, b, z));
+        rgb += 48;
+        luma += 16;
+    }
+    yuv_luma_ref(rgb, luma, n - i);
+}
+
+
+static inline void yuv_chroma_sse2(const uint8_t *rgb, const uint8_t *luma, uint8_t *chroma, uint8_t ofs, uint16_t n)
+{
+    uint16_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i p[3];
+        yuv_load_rgb_sse2(rgb, &p[0], &p[1], &p[2]);
+        __m128i y = _mm_loadu_si128((const __m128i*)luma);
+        __m128i c = yuv_hadd_sse2(p[ofs], _mm_xor_si128(y, _mm_set1_epi8(-1)));
+        _mm_storeu_si128((__m128i*)chroma, c);
+        rgb += 48;
+        luma += 16;
+        chroma += 16;
+    }
+    yuv_chroma_ref(rgb, luma, chroma, ofs, n - i);
+}
+
+
+static inline void yuv_chroma_2lines_sse2(const uint8_t *rgb, const uint8_t *luma, uint8_t *chroma, uint8_t ofs, uint16_t n)
+{
+    uint16_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i p[3], q[3];
+        yuv_load_rgb_sse2(rgb, &p[0], &p[1], &p[2]);
+        yuv_load_rgb_sse2(rgb + n*3, &q[0], &q[1], &q[2]);
+        __m128i y = yuv_hadd_sse2(_mm_loadu_si128((const __m128i*)luma), _mm_loadu_si128((const __m128i*)(luma + n)));
+        __m128i c = yuv_hadd_sse2(yuv_hadd_sse2(p[ofs], q[ofs]), _mm_xor_si128(y, _mm_set1_epi8(-1)));
+        _mm_storeu_si128((__m128i*)chroma, c);
+        rgb += 48;
+        luma += 16;
+        chroma += 16;
+    }
+    for (; i < n; i++, rgb += 3, luma++, chroma++) {
+        uint16_t y = ((uint16_t)luma[0] + luma[n])/2;
+        uint16_t c = ((uint16_t)rgb[ofs] + rgb[ofs+n*3])/2;
+        *chroma = (c-y + 255) / 2;
+    }
+}
+
+#endif /* __SSE2__ */
+
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static inline uint8x8_t yuv_luma8_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+    uint16x8_t s = vmull_u8(r, vdup_n_u8(30));
+    s = vmlal_u8(s, g, vdup_n_u8(59));
+    s = vmlal_u8(s, b, vdup_n_u8(11));
+    uint32x4_t lo = vshrq_n_u32(vmull_n_u16(vget_low_u16(s), 5243), 19);
+    uint32x4_t hi = vshrq_n_u32(vmull_n_u16(vget_high_u16(s), 5243), 19);
+    return vmovn_u16(vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)));
+}
+
+
+static inline void yuv_luma_neon(const uint8_t *rgb, uint8_t *luma, uint16_t n)
+{
+    uint16_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        uint8x16x3_t p = vld3q_u8(rgb);
+        uint8x8_t lo = yuv_luma8_neon(vget_low_u8(p.val[0]), vget_low_u8(p.val[1]), vget_low_u8(p.val[2]));
+        uint8x8_t hi = yuv_luma8_neon(vget_high_u8(p.val[0]), vget_high_u8(p.val[1]), vget_high_u8(p.val[2]));
+        vst1q_u8(luma, vcombine_u8(lo, hi));
+        rgb += 48;
+        luma += 16;
+    }
+    yuv_luma_ref(rgb, luma, n - i);
+}
+
+
+static inline void yuv_chroma_neon(const uint8_t *rgb, const uint8_t *luma, uint8_t *chroma, uint8_t ofs, uint16_t n)
+{
+    uint16_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        uint8x16x3_t p = vld3q_u8(rgb);
+        vst1q_u8(chroma, vhaddq_u8(p.val[ofs], vmvnq_u8(vld1q_u8(luma))));
+        rgb += 48;
+        luma += 16;
+        chroma += 16;
+    }
+    yuv_chroma_ref(rgb, luma, chroma, ofs, n - i);
+}
+
+
+static inline void yuv_chroma_2lines_neon(const uint8_t *rgb, const uint8_t *luma, uint8_t *chroma, uint8_t ofs, uint16_t n)
+{
+    uint16_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        uint8x16x3_t p = vld3q_u8(rgb);
+        uint8x16x3_t q = vld3q_u8(rgb + n*3);
+        uint8x16_t y = vhaddq_u8(vld1q_u8(luma), vld1q_u8(luma + n));
+        vst1q_u8(chroma, vhaddq_u8(vhaddq_u8(p.val[ofs], q.val[ofs]), vmvnq_u8(y)));
+        rgb += 48;
+        luma += 16;
+        chroma += 16;
+    }
+    for (; i < n; i++, rgb += 3, luma++, chroma++) {
+        uint16_t y = ((uint16_t)luma[0] + luma[n])/2;
+        uint16_t c = ((uint16_t)rgb[ofs] + rgb[ofs+n*3])/2;
+        *chroma = (c-y + 255) / 2;
+    }
+}
+
+#endif /* __ARM_NEON */
+
+
+/*
+ * SSTV chroma of decoded JPEG Cb/Cr samples, the YCbCr strips skip RGB in both directions:
+ *   R - Y = 1.402 (Cr - 128), B - Y = 1.772 (Cb - 128)
+ *   C = (c - Y + 255) / 2 = gain * (Cr|Cb - 128) + 127.5, gain 0.701 or 0.886 in Q10
+ * The result stays in 15..240, no saturation is needed.
+ */
+
+#define YUV_GAIN_CR         718
+#define YUV_GAIN_CB         907
+
+
+static inline void yuv_sstv_chroma(const uint8_t *c, uint8_t *chroma, uint16_t gain, uint16_t n)
+{
+    for (uint16_t i = 0; i < n; i++) {
+        chroma[i] = ((int32_t)(c[i] - 128) * gain + (255 << 9)) >> 10;
+    }
+}
+
+
+/* variant used by the encoders */
+#if defined(__ARM_FEATURE_DSP)
+#define yuv_luma            yuv_luma_dsp
+#define yuv_chroma          yuv_chroma_dsp
+#define yuv_chroma_2lines   yuv_chroma_2lines_dsp
+#elif defined(__SSE2__)
+#define yuv_luma            yuv_luma_sse2
+#define yuv_chroma          yuv_chroma_sse2
+#define yuv_chroma_2lines   yuv_chroma_2lines_sse2
+#elif defined(__ARM_NEON)
+#define yuv_luma            yuv_luma_neon
+#define yuv_chroma          yuv_chroma_neon
+#define yuv_chroma_2lines   yuv_chroma_2lines_neon
+#else
+#define yuv_luma            yuv_luma_ref
+#define yuv_chroma          yuv_chroma_ref
+#define yuv_chroma_2lines   yuv_chroma_2lines_ref
+#endif
+
+#endif /* INCLUDE_YUV */
+
+#endif /* _YUV_H_ */
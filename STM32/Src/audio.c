@@ -10,9 +10,9 @@
 
 #include "cube.h"
 #include <arm_math.h>
-#include "sstv.h"
 #include "eeprom.h"
 #include "audio.h"
+#include "sstv.h"
 
 #define INCLUDE_VARICODE
 #include "varicode.h"
@@ -20,428 +20,974 @@
 #define INCLUDE_MORSE
 #include "morse.h"
 
-static uint8_t audio_buffer[AUDIO_BUFFER_LEN];
-static volatile uint8_t audio_current_buffer = 0;
-static uint16_t idx;
-static q31_t phi;
+#define INCLUDE_SINE
+#include "sine.h"
+
+#define INCLUDE_YUV
+#include "yuv.h"
+
+#if ENABLE_DAC_12BIT
+typedef uint16_t audio_sample_t;
+#define AUDIO_DAC_BITS      12
+#define AUDIO_DAC_ALIGN     DAC_ALIGN_12B_R
+#else
+typedef uint8_t audio_sample_t;
+#define AUDIO_DAC_BITS      8
+#define AUDIO_DAC_ALIGN     DAC_ALIGN_8B_R
+#endif
+#define AUDIO_BIAS          (1 << (AUDIO_DAC_BITS - 1)) // Vcc/2
+
+/* render command queue, filled by the encoders and consumed by the DAC DMA interrupt */
+typedef enum {
+    AUDIO_CMD_SILENCE,  // constant output level
+    AUDIO_CMD_RAMP,     // cosinus ramp between 0V and Vcc/2 bias
+    AUDIO_CMD_TONE,     // constant frequency
+    AUDIO_CMD_SYMBOL,   // PSK symbol with raised cosine envelope
+    AUDIO_CMD_LINE,     // SSTV scanline from the line pool
+} AUDIO_CMD_TYPE;
+
+typedef struct {
+    uint8_t type;       // AUDIO_CMD_TYPE
+    uint8_t flags;      // AUDIO_RESET_PHI
+    q15_t ampl;         // amplitude incl. PSK phase; output level for SILENCE; theta offset for RAMP
+    uint32_t samples;   // command length
+    q31_t inc;          // NCO phase increment (TONE, SYMBOL)
+    union {
+        uint16_t width; // line width (LINE)
+        uint16_t start; // first sample of the envelope (SYMBOL)
+    };
+    uint16_t period;    // symbol length (SYMBOL)
+} AUDIO_CMD;
+
+/* background encoder of a channel, one PSK symbol or character per step */
+typedef enum {
+    AUDIO_GEN_IDLE,
+    AUDIO_GEN_PSK,
+    AUDIO_GEN_MORSE,
+} AUDIO_GEN_TYPE;
+
+typedef enum {
+    GEN_DONE,           // message complete or not started
+    GEN_START,          // PSK start symbol
+    GEN_SYNC,           // PSK zeros before the message
+    GEN_LEAD_CR,        // PSK CR before the text
+    GEN_TEXT,           // characters of the text
+    GEN_TRAIL_CR,       // PSK CR and space after the text
+    GEN_TRAIL_SPACE,
+    GEN_IDLE,           // PSK ones after the message
+    GEN_STOP,           // PSK stop symbol
+} AUDIO_GEN_STATE;
+
+typedef struct {
+    uint8_t type;       // AUDIO_GEN_TYPE
+    uint8_t state;      // AUDIO_GEN_STATE
+    uint16_t speed;     // PSK speed or CW wpm
+    uint16_t freq;
+    q15_t volume;
+    uint16_t samples;   // samples per PSK symbol or CW unit
+    uint16_t sync;      // PSK symbols per second, length of sync and idle
+    uint16_t count;     // PSK sync or idle symbols left
+    int16_t invert;     // PSK phase of the next reversal
+    uint16_t shaping;   // CW fall time of the last element, gap is shortened by it
+    uint32_t tickstart;
+    const char *s;      // next character
+} AUDIO_GEN;
+
+/* mixer channel: command queue, oscillator and encoder; channel 0 is the main one */
+typedef struct {
+    AUDIO_CMD *queue;
+    uint16_t len;       // queue length, power of 2
+    volatile uint16_t head, tail; // free-running, head written by encoders, tail by interrupt
+    uint32_t pos;       // samples of the current command already rendered
+    q31_t phi;          // NCO phase accumulator
+    audio_sample_t level; // output level held on queue underrun
+    AUDIO_GEN gen;
+} AUDIO_CHANNEL;
+
+/* scanline rendering state, kept across audio buffer blocks */
+typedef struct {
+    const uint8_t *line;
+    uint16_t width;
+    uint16_t t;
+    uint16_t x;     // current pixel
+    uint16_t err;   // DDA error term
+    uint32_t pos;   // DDA position, 16.16 fixed point (interpolation only)
+    uint32_t step;  // DDA step, 16.16 fixed point (interpolation only)
+} AUDIO_LINE;
+
+static audio_sample_t audio_buffer[AUDIO_BUFFER_LEN];
+static uint16_t sample_period = AUDIO_TIM_CLOCK / SAMPLE_FREQ; // TIM6 ticks (us) per sample
+static q31_t nco_inc_hz; // NCO phase increment for 1Hz
+static uint32_t time_frac; // remainder of SSTV segments in us, carried to the next segment
+static q31_t pixel_inc[256]; // pixel value to NCO phase increment, 1500-2300Hz range
+static q15_t shape_env[AUDIO_SHAPE_LEN/2 + 1]; // raised cosine envelope of the first half of one symbol, the second half is its negative mirror
+static volatile uint16_t shape_period; // symbol length of the cached envelope, 0 if none
+
+static AUDIO_CMD audio_queue[AUDIO_QUEUE_LEN];
+static AUDIO_CMD mix_queue[AUDIO_MIX_CHANNELS][AUDIO_MIX_QUEUE_LEN];
+static char mix_text[AUDIO_MIX_CHANNELS][AUDIO_MIX_TEXT_LEN];
+static audio_sample_t mix_buffer[AUDIO_MIX_CHUNK];
+static AUDIO_CHANNEL channels[1 + AUDIO_MIX_CHANNELS];
+static AUDIO_CHANNEL * const main_ch = &channels[0];
+static uint8_t line_pool[AUDIO_LINE_SLOTS][IMG_WIDTH_MAX];
+static volatile uint8_t line_head, line_tail; // free-running, slots are released in FIFO order
+static uint8_t scan_luma[IMG_WIDTH_MAX*2], scan_chroma[IMG_WIDTH_MAX]; // scanline engines, copied to the line pool
+
+static volatile bool audio_running = false;
+static volatile uint32_t audio_blocks; // rendered buffer halves
+static AUDIO_LINE cmd_line;
+static uint32_t audio_queued; // samples queued since audio_start()
+static volatile uint32_t audio_rendered; // main channel samples rendered from the queue since audio_start()
+
+
+/* NCO output: the sine LUT replaces arm_sin_q15() interpolation, the result is within
+   +/-1 LSB of the former arm_sin_q15() output after conversion to 8 bits (~11% samples differ, satcam-render nco) */
+static inline audio_sample_t audio_nco(q31_t *p, q31_t inc, q15_t ampl)
+{
+    *p = (*p + inc) & 0x7fffffff; // phase accumulator
+    int32_t y = (SINE_TABLE[NCO_INDEX(*p)] * ampl) >> (31 - AUDIO_DAC_BITS); // sinus(phi) * amplitude, convert to DAC bits
+    return y + AUDIO_BIAS; // bias to Vcc/2
+}
 
 
-void HAL_DACEx_ConvCpltCallbackCh2(DAC_HandleTypeDef* hdac)
+static void audio_render_tone(audio_sample_t *dst, uint16_t n, q31_t *phi, q31_t inc, q15_t ampl)
 {
-    /* DMA reached the end of buffer */
-    audio_current_buffer = 0;
-    HAL_PWR_DisableSleepOnExit();
+    q31_t p = *phi;
+    while (n--) *dst++ = audio_nco(&p, inc, ampl);
+    *phi = p;
 }
 
 
-void HAL_DACEx_ConvHalfCpltCallbackCh2(DAC_HandleTypeDef* hdac)
+static void audio_render_line(audio_sample_t *dst, uint16_t n, q31_t *phi, AUDIO_LINE *l, q15_t ampl)
 {
-    /* DMA at the half of buffer */
-    audio_current_buffer = 1;
-    HAL_PWR_DisableSleepOnExit();
+    q31_t p = *phi;
+#if AUDIO_LINE_INTERP
+    /* 16.16 fixed-point DDA, linear interpolation of phase increment between neighbouring pixels */
+    while (n--) {
+        uint16_t x = l->pos >> 16;
+        q31_t a = pixel_inc[l->line[x]];
+        q31_t b = (x + 1 < l->width) ? pixel_inc[l->line[x + 1]] : a;
+        *dst++ = audio_nco(&p, a + ((b - a) >> 8) * (q31_t)((l->pos & 0xFFFF) >> 8), ampl);
+        l->pos += l->step;
+    }
+#else
+    /* integer DDA, selects the same pixel as i * width / t without division */
+    uint16_t x = l->x;
+    uint16_t err = l->err;
+    while (n--) {
+        *dst++ = audio_nco(&p, pixel_inc[l->line[x]], ampl);
+        err += l->width;
+        if (err >= l->t) { // width < t, at most one pixel per sample
+            err -= l->t;
+            x++;
+        }
+    }
+    l->x = x;
+    l->err = err;
+#endif
+    *phi = p;
 }
 
 
-static void sample_to_buffer(uint8_t value)
+/* Raised cosine envelope, samples i..i+n of the symbol; table lookup when the envelope is cached */
+static void audio_render_shaped(audio_sample_t *dst, uint16_t n, q31_t *phi, q31_t inc, uint16_t i, uint16_t samples, q15_t volume)
 {
-    audio_buffer[idx++] = value;
-    if (hdma_dac2.State == HAL_DMA_STATE_READY && idx == AUDIO_BUFFER_LEN/2) {
-        /* buffer filled to 1st half, DMA idle -> start audio output */
-        HAL_TIM_Base_Start(&htim6);
-        HAL_DAC_Start_DMA(&hdac, DAC_CHANNEL_2, (uint32_t*)audio_buffer, AUDIO_BUFFER_LEN, DAC_ALIGN_8B_R);
-        audio_current_buffer = 0;
+    q31_t p = *phi;
+    if (samples == shape_period) {
+        for (; n && i <= samples/2; n--) *dst++ = audio_nco(&p, inc, ((q31_t)(volume) * shape_env[i++]) >> (16-1));
+        const q15_t *env = &shape_env[samples - i];
+        while (n--) *dst++ = audio_nco(&p, inc, ((q31_t)(volume) * -*env--) >> (16-1));
+    } else {
+        while (n--) {
+            q15_t ampl = ((q31_t)(volume) * arm_cos_q15((0x4000 * i++) / samples)) >> (16-1);
+            *dst++ = audio_nco(&p, inc, ampl);
+        }
     }
-    else if (idx == AUDIO_BUFFER_LEN/2) {
-        /* buffer filled to 1st half, transmit 2nd half and sleep until the transmission of 1st half begins */
-        HAL_PWR_EnableSleepOnExit();
-        while (audio_current_buffer == 1) {}
+    *phi = p;
+}
+
+
+/* Cosinus ramp between 0V and Vcc/2 bias, samples i..i+n of AUDIO_RAMP_LEN */
+static void audio_render_ramp(audio_sample_t *dst, uint16_t n, uint16_t i, q15_t offset)
+{
+    while (n--) {
+        q15_t theta = i++ * (0x4000 / AUDIO_RAMP_LEN);
+        q15_t ramp = (arm_cos_q15(theta + offset) / 2) + 0x4000;
+        *dst++ = ramp >> (16 - AUDIO_DAC_BITS); // full scale q15 ramp is Vcc/2
     }
-    else if (idx == AUDIO_BUFFER_LEN) {
-        /* buffer filled to 2nd half, transmit 1st half and sleep until the transmission of 2nd half begins */
-        HAL_PWR_EnableSleepOnExit();
-        while (audio_current_buffer == 0) {}
-        idx = 0;
-        HAL_IWDG_Refresh(&hiwdg); // 200ms period (AUDIO_BUFFER_LEN/SAMPLE_FREQ)
+}
+
+
+static void audio_render_level(audio_sample_t *dst, uint16_t n, audio_sample_t level)
+{
+    while (n--) *dst++ = level;
+}
+
+
+/* Render n samples from the command queue of the channel */
+static void audio_render_channel(AUDIO_CHANNEL *ch, audio_sample_t *dst, uint16_t n)
+{
+    while (n) {
+        if (ch->tail == ch->head) {
+            /* queue underrun - hold the output level */
+            audio_render_level(dst, n, ch->level);
+            return;
+        }
+
+        AUDIO_CMD *cmd = &ch->queue[ch->tail % ch->len];
+        if (ch->pos == 0) {
+            /* command start */
+            if (cmd->flags & AUDIO_RESET_PHI) ch->phi = 0;
+            if (cmd->type == AUDIO_CMD_LINE) {
+                cmd_line = (AUDIO_LINE){
+                    .line = line_pool[line_tail % AUDIO_LINE_SLOTS],
+                    .width = cmd->width,
+                    .t = cmd->samples,
+                    .step = ((uint32_t)cmd->width << 16) / cmd->samples,
+                };
+            }
+        }
+
+        uint16_t k = (cmd->samples - ch->pos < n) ? cmd->samples - ch->pos : n;
+        switch (cmd->type) {
+            case AUDIO_CMD_SILENCE: audio_render_level(dst, k, cmd->ampl); break;
+            case AUDIO_CMD_RAMP: audio_render_ramp(dst, k, ch->pos, cmd->ampl); break;
+            case AUDIO_CMD_TONE: audio_render_tone(dst, k, &ch->phi, cmd->inc, cmd->ampl); break;
+            case AUDIO_CMD_SYMBOL: audio_render_shaped(dst, k, &ch->phi, cmd->inc, cmd->start + ch->pos, cmd->period, cmd->ampl); break;
+            case AUDIO_CMD_LINE: audio_render_line(dst, k, &ch->phi, &cmd_line, cmd->ampl); break;
+        }
+        dst += k;
+        n -= k;
+        if (ch == main_ch) {
+            ch->level = dst[-1]; // mixed channels stay at bias on underrun
+            audio_rendered += k;
+        }
+
+        ch->pos += k;
+        if (ch->pos == cmd->samples) {
+            /* command done, release queue entry and line slot */
+            if (cmd->type == AUDIO_CMD_LINE) line_tail++;
+            ch->tail++;
+            ch->pos = 0;
+        }
     }
 }
 
 
-static void audio_to_buffer(uint16_t freq, q15_t ampl)
+static bool audio_channel_busy(AUDIO_CHANNEL *ch)
 {
-    phi += (q31_t)((1ULL << 31) / SAMPLE_FREQ) * freq; // phase accumulator
-    phi &= 0x7fffffff;
-    int8_t y = (arm_sin_q15(phi >> 16) * ampl) >> (24-1); // sinus(phi) * amplitude, convert to q7_t
-    y ^= 0x80; // bias to Vcc/2
-    sample_to_buffer(y);
+    return ch->gen.state != GEN_DONE || ch->head != ch->tail;
 }
 
 
-static void audio_play_tone(uint32_t samples, uint16_t freq, q15_t volume)
+/* Render n samples of all channels, called from DMA interrupt. The main channel is rendered
+   directly to the DAC buffer, active mixed channels are added to it with saturation. */
+static void audio_render(audio_sample_t *dst, uint16_t n)
 {
-    while (samples--) audio_to_buffer(freq, volume);
+    audio_render_channel(main_ch, dst, n);
+
+    for (uint8_t c = 1; c <= AUDIO_MIX_CHANNELS; c++) {
+        AUDIO_CHANNEL *ch = &channels[c];
+        if (!audio_channel_busy(ch)) continue;
+        for (uint16_t i = 0; i < n; i += AUDIO_MIX_CHUNK) {
+            uint16_t k = (n - i < AUDIO_MIX_CHUNK) ? n - i : AUDIO_MIX_CHUNK;
+            audio_render_channel(ch, mix_buffer, k);
+            for (uint16_t j = 0; j < k; j++) {
+                int32_t y = dst[i + j] + mix_buffer[j] - AUDIO_BIAS;
+                dst[i + j] = (y < 0) ? 0 : (y > (1 << AUDIO_DAC_BITS) - 1) ? (1 << AUDIO_DAC_BITS) - 1 : y;
+            }
+        }
+    }
 }
 
 
-static void audio_play_line(uint16_t t, uint16_t width, uint8_t *line, q15_t volume)
+void HAL_DACEx_ConvCpltCallbackCh2(DAC_HandleTypeDef* hdac)
+{
+    /* DMA reached the end of buffer, 2nd half is free */
+    audio_render(&audio_buffer[AUDIO_BUFFER_LEN/2], AUDIO_BUFFER_LEN/2);
+    audio_blocks++;
+}
+
+
+void HAL_DACEx_ConvHalfCpltCallbackCh2(DAC_HandleTypeDef* hdac)
+{
+    /* DMA at the half of buffer, 1st half is free */
+    audio_render(&audio_buffer[0], AUDIO_BUFFER_LEN/2);
+    audio_blocks++;
+}
+
+
+__weak void audio_idle_callback(void)
+{
+    /* NOTE: This function should not be modified, when the callback is needed,
+       the audio_idle_callback could be implemented in the user file */
+}
+
+
+static void audio_mix_task(void);
+
+
+/* Wait for the audio interrupt; the mixed channels are refilled and the main loop tasks run meanwhile */
+static void audio_wait(void)
+{
+    HAL_IWDG_Refresh(&hiwdg);
+    audio_mix_task();
+    audio_idle_callback();
+    HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+}
+
+
+static AUDIO_CMD *audio_cmd_alloc(AUDIO_CHANNEL *ch)
+{
+    while ((uint16_t)(ch->head - ch->tail) >= ch->len) audio_wait();
+    AUDIO_CMD *cmd = &ch->queue[ch->head % ch->len];
+    memset(cmd, 0, sizeof(AUDIO_CMD));
+    return cmd;
+}
+
+
+static void audio_cmd_push(AUDIO_CHANNEL *ch)
+{
+    if (ch == main_ch) audio_queued += ch->queue[ch->head % ch->len].samples;
+    __DMB(); // command must be complete before the interrupt can see it
+    ch->head++;
+}
+
+
+/* Select sample rate for the next audio_start(), rounded to whole TIM6 ticks; returns actual rate */
+uint16_t audio_set_rate(uint16_t rate)
+{
+    if (rate < SAMPLE_FREQ_MIN) rate = SAMPLE_FREQ_MIN;
+    if (rate > SAMPLE_FREQ_MAX) rate = SAMPLE_FREQ_MAX;
+    if (!audio_running) sample_period = (AUDIO_TIM_CLOCK + rate/2) / rate;
+    return audio_get_rate();
+}
+
+
+uint16_t audio_get_rate(void)
+{
+    return (AUDIO_TIM_CLOCK + sample_period/2) / sample_period;
+}
+
+
+bool audio_busy(void)
+{
+    return audio_running;
+}
+
+
+uint32_t audio_get_queued(void)
+{
+    return audio_queued;
+}
+
+
+/* Queued audio of the main channel not rendered yet in ms, the margin before an underrun */
+uint32_t audio_get_pending(void)
 {
-    for (int i = 0; i < t; i++) {
-        int idx = i * width / t;
-        int freq = 1500 + (2300-1500) * line[idx] / 255; // convert uint8_t to 1500-2300Hz range
-        audio_to_buffer(freq, volume);
+    return (uint64_t)(audio_queued - audio_rendered) * sample_period / 1000;
+}
+
+
+static void audio_play_tone(AUDIO_CHANNEL *ch, uint32_t samples, uint16_t freq, q15_t volume)
+{
+    if (samples == 0) return;
+    AUDIO_CMD *cmd = audio_cmd_alloc(ch);
+    cmd->type = AUDIO_CMD_TONE;
+    cmd->samples = samples;
+    cmd->inc = nco_inc_hz * freq;
+    cmd->ampl = volume;
+    audio_cmd_push(ch);
+}
+
+
+static void audio_play_silence(AUDIO_CHANNEL *ch, uint32_t samples, audio_sample_t level, uint8_t flags)
+{
+    if (samples == 0) return;
+    AUDIO_CMD *cmd = audio_cmd_alloc(ch);
+    cmd->type = AUDIO_CMD_SILENCE;
+    cmd->flags = flags;
+    cmd->samples = samples;
+    cmd->ampl = level;
+    audio_cmd_push(ch);
+}
+
+
+static void audio_prepare_pixels(void)
+{
+    for (uint16_t v = 0; v < 256; v++) {
+        pixel_inc[v] = nco_inc_hz * (1500 + (2300-1500) * v / 255); // convert uint8_t to 1500-2300Hz range
+    }
+}
+
+
+/* Envelope of the shaped symbols for the speed and sample rate of the transmission. The render
+   interrupt computes the envelope itself while the cache is invalid or holds another length. */
+static void audio_prepare_shape(uint16_t samples)
+{
+    if (samples == shape_period) return;
+    shape_period = 0;
+    if (samples > AUDIO_SHAPE_LEN) return;
+    for (uint16_t i = 0; i <= samples/2; i++) {
+        shape_env[i] = arm_cos_q15((0x4000 * i) / samples);
     }
+    __DMB(); // envelope must be complete before the interrupt can use it
+    shape_period = samples;
+}
+
+
+/* The line is copied to the line pool, the caller may reuse its buffer immediately */
+static void audio_play_line(uint16_t t, uint16_t width, uint8_t *line, q15_t volume)
+{
+    while ((uint8_t)(line_head - line_tail) >= AUDIO_LINE_SLOTS) audio_wait();
+    memcpy(line_pool[line_head % AUDIO_LINE_SLOTS], line, width);
+    line_head++;
+
+    AUDIO_CMD *cmd = audio_cmd_alloc(main_ch);
+    cmd->type = AUDIO_CMD_LINE;
+    cmd->samples = t;
+    cmd->width = width;
+    cmd->ampl = volume;
+    audio_cmd_push(main_ch);
+}
+
+
+/* Convert duration to samples; the remainder is carried to the next segment, so the line
+   period stays exact in average and the image length is within one sample of nominal.
+   Sample period is a whole number of 1us TIM6 ticks, so the conversion is exact at any rate. */
+static uint32_t audio_samples(uint32_t us)
+{
+    uint32_t t = us + time_frac;
+    time_frac = t % sample_period;
+    return t / sample_period;
 }
 
 
-static void audio_play_psk(uint16_t samples, uint16_t freq, uint8_t symbol, q15_t volume)
+static void audio_sstv_tone(uint32_t us, uint16_t freq)
 {
-    static int16_t invert = 1;
+    audio_play_tone(main_ch, audio_samples(us), freq, AUDIO_VOLUME_SSTV);
+}
+
+
+static void audio_sstv_line(uint32_t us, uint16_t width, uint8_t *line)
+{
+    audio_play_line(audio_samples(us), width, line, AUDIO_VOLUME_SSTV);
+}
+
+
+/* PSK symbol or CW element edge at the frequency and volume of the channel encoder */
+static void audio_play_psk(AUDIO_CHANNEL *ch, uint16_t samples, uint8_t symbol)
+{
+    AUDIO_GEN *g = &ch->gen;
 
     if (symbol == PSK_SYM_1) {
         /* symbol 1 - keep phase */
-        q15_t ampl = volume;
-        ampl *= invert;
-        for (uint16_t i = 0; i < samples; i++) {
-            audio_to_buffer(freq, ampl);
-        }
+        audio_play_tone(ch, samples, g->freq, g->volume * g->invert);
     } else {
         /* symbol 0 - reverse phase; START/STOP - half of the symbol */
-        if (symbol == PSK_SYM_START) invert = 1;
+        if (symbol == PSK_SYM_START) g->invert = 1;
         uint16_t start = (symbol == PSK_SYM_START) ? samples/2 : 0;
         uint16_t stop = (symbol == PSK_SYM_STOP) ? samples/2 : samples;
-        for (uint16_t i = start; i < stop; i++) {
-            q15_t ampl = ((q31_t)(volume) * arm_cos_q15((0x4000 * i) / samples)) >> (16-1);
-            ampl *= invert;
-            audio_to_buffer(freq, ampl);
-        }
-        invert *= -1;
+        AUDIO_CMD *cmd = audio_cmd_alloc(ch);
+        cmd->type = AUDIO_CMD_SYMBOL;
+        cmd->samples = stop - start;
+        cmd->inc = nco_inc_hz * g->freq;
+        cmd->ampl = g->volume * g->invert;
+        cmd->start = start;
+        cmd->period = samples;
+        audio_cmd_push(ch);
+        g->invert *= -1;
     }
 }
 
 
-static void audio_psk_char(uint16_t rate, uint16_t freq, char c)
+static void audio_psk_char(AUDIO_CHANNEL *ch, char c)
 {
     uint16_t varicode = VARICODE_TABLE[c & 0x7f] >> 2;
     while (varicode) {
-        audio_play_psk(rate, freq, varicode & 0x8000 ? PSK_SYM_1 : PSK_SYM_0, AUDIO_VOLUME_PSK);
+        audio_play_psk(ch, ch->gen.samples, varicode & 0x8000 ? PSK_SYM_1 : PSK_SYM_0);
         varicode <<= 1;
     }
 }
 
 
-void audio_start()
+/* Cosinus ramp between 0V and Vcc/2 bias, AUDIO_RAMP_LEN samples */
+static void audio_play_ramp(q15_t offset)
 {
-    // reset buffer index and phase accumulator
-    syslog_event(LOG_AUDIO_START);
-    idx = 0;
-    phi = 0;
-    // cosinus ramp up from 0V to Vcc/2 bias
-    for (uint16_t i = 0; i < AUDIO_BUFFER_LEN; i++) {
-        q15_t theta = i * (0x4000 / AUDIO_BUFFER_LEN);
-        q15_t ramp = (arm_cos_q15(theta + 0x4000) / 2) + 0x4000;
-        sample_to_buffer(ramp >> 8);
-    }
+    AUDIO_CMD *cmd = audio_cmd_alloc(main_ch);
+    cmd->type = AUDIO_CMD_RAMP;
+    cmd->samples = AUDIO_RAMP_LEN;
+    cmd->ampl = offset;
+    audio_cmd_push(main_ch);
 }
 
 
-void audio_stop()
+/* Symbol length in us */
+static uint16_t audio_psk_get_symbol(uint16_t speed)
 {
-    // cosinus ramp down from Vcc/2 bias to 0V
-    for (uint16_t i = 0; i < AUDIO_BUFFER_LEN; i++) {
-        q15_t theta = i * (0x4000 / AUDIO_BUFFER_LEN);
-        q15_t ramp = (arm_cos_q15(theta) / 2) + 0x4000;
-        sample_to_buffer(ramp >> 8);
+    switch (speed) {
+        case 31: return (1000000 / 31.25);
+        case 63: return (1000000 / 62.5);
+        case 125: default: return (1000000 / 125);
+        case 250: return (1000000 / 250);
+        case 500: return (1000000 / 500);
+        case 1000: return (1000000 / 1000);
     }
-    for (uint16_t i = 0; i < AUDIO_BUFFER_LEN; i++) sample_to_buffer(0); // fill buffer with zero samples
-    HAL_DAC_Stop_DMA(&hdac, DAC_CHANNEL_2); // stop audio output -> ca. half buffer will be lost
-    HAL_TIM_Base_Stop(&htim6);
-    syslog_event(LOG_AUDIO_STOP);
 }
 
 
-static uint16_t audio_psk_get_rate(uint16_t speed)
+static void audio_gen_init(AUDIO_CHANNEL *ch, uint8_t type, uint16_t speed, uint16_t freq, const char *s, q15_t volume)
 {
-    switch (speed) {
-        case 31: return (SAMPLE_FREQ / 31.25);
-        case 63: return (SAMPLE_FREQ / 62.5);
-        case 125: default: return (SAMPLE_FREQ / 125);
-        case 250: return (SAMPLE_FREQ / 250);
-        case 500: return (SAMPLE_FREQ / 500);
-        case 1000: return (SAMPLE_FREQ / 1000);
+    AUDIO_GEN *g = &ch->gen;
+
+    if (type == AUDIO_GEN_MORSE) {
+        if (speed < 5) speed = 5;
+        if (speed > 40) speed = 40;
+        if (freq < 100 || freq > 5000) freq = CW_FREQ;
+    } else {
+        if (freq < 100 || freq > 5000) freq = PSK_FREQ;
     }
+
+    memset(g, 0, sizeof(AUDIO_GEN));
+    g->type = type;
+    g->speed = speed;
+    g->freq = freq;
+    g->volume = volume;
+    g->invert = 1;
+    g->s = s;
 }
 
 
-void audio_psk(uint16_t speed, uint16_t freq, const char *s)
+/* Start the encoder at the current sample rate, a tone not below half of the rate would alias and is not sent */
+static void audio_gen_begin(AUDIO_CHANNEL *ch)
 {
-    if (freq < 100) freq = PSK_FREQ;
-    if (freq > 5000) freq = PSK_FREQ;
-
-    uint32_t tickstart = HAL_GetTick();
-    uint16_t rate = audio_psk_get_rate(speed);
+    AUDIO_GEN *g = &ch->gen;
 
-    audio_play_psk(rate, freq, PSK_SYM_START, AUDIO_VOLUME_PSK); // start
-    for (uint16_t i = 0; i < (SAMPLE_FREQ / rate); i++) audio_play_psk(rate, freq, PSK_SYM_0, AUDIO_VOLUME_PSK); // 1sec of zeros - sync
-    audio_psk_char(rate, freq, '\r'); // CR
-    while (*s && (HAL_GetTick() - tickstart < AUDIO_TIMEOUT)) {
-        audio_psk_char(rate, freq, *s++); // data
+    g->tickstart = HAL_GetTick();
+    if (2 * (uint32_t)g->freq >= audio_get_rate()) {
+        g->state = GEN_DONE;
+        return;
+    }
+    if (g->type == AUDIO_GEN_PSK) {
+        uint16_t symbol = audio_psk_get_symbol(g->speed);
+        g->samples = (symbol + sample_period/2) / sample_period; // samples per symbol
+        g->sync = 1000000 / symbol;
+        g->state = GEN_START;
+        audio_prepare_shape(g->samples);
+    } else {
+        g->samples = (1200000 / g->speed) / sample_period; // u = 1.2/c for PARIS
+        g->state = GEN_TEXT;
+        audio_prepare_shape(CW_SHAPING_US / sample_period);
     }
-    audio_psk_char(rate, freq, '\r'); // CR
-    audio_psk_char(rate, freq, ' '); // space to fix last CR
-    for (uint16_t i = 0; i < (SAMPLE_FREQ / rate); i++) audio_play_psk(rate, freq, PSK_SYM_1, AUDIO_VOLUME_PSK); // 1sec of ones - no data
-    audio_play_psk(rate, freq, PSK_SYM_STOP, AUDIO_VOLUME_PSK); // stop
 }
 
 
-static void audio_play_morse(uint16_t samples, uint16_t freq, bool key)
+static void audio_play_morse(AUDIO_CHANNEL *ch, uint16_t samples, bool key)
 {
-    static uint16_t shaping = 0;
+    AUDIO_GEN *g = &ch->gen;
 
     if (key) {
-        shaping = 0.010*SAMPLE_FREQ; // 10ms rise/fall time for CW
-        audio_play_psk(shaping, freq, PSK_SYM_START, AUDIO_VOLUME_MORSE);
-        audio_play_psk(samples - shaping, freq, PSK_SYM_1, AUDIO_VOLUME_MORSE);
-        audio_play_psk(shaping, freq, PSK_SYM_STOP, AUDIO_VOLUME_MORSE);
-        phi = 0; // reset phase accumulator to keep DAC at bias during gap (CW is not coherent)
+        g->shaping = CW_SHAPING_US / sample_period;
+        audio_play_psk(ch, g->shaping, PSK_SYM_START);
+        audio_play_psk(ch, samples - g->shaping, PSK_SYM_1);
+        audio_play_psk(ch, g->shaping, PSK_SYM_STOP);
     } else {
-        audio_play_tone(samples - shaping, 0, AUDIO_VOLUME_MORSE);
-        shaping = 0;
+        // reset phase accumulator and keep DAC at bias during gap (CW is not coherent)
+        audio_play_silence(ch, samples - g->shaping, AUDIO_BIAS, AUDIO_RESET_PHI);
+        g->shaping = 0;
     }
 }
 
 
-void audio_morse(uint16_t wpm, uint16_t freq, const char *s)
+static void audio_morse_char(AUDIO_CHANNEL *ch, char chr)
 {
-    if (wpm < 5) wpm = 5;
-    if (wpm > 40) wpm = 40;
-    if (freq < 100) freq = CW_FREQ;
-    if (freq > 5000) freq = CW_FREQ;
-
-    uint32_t tickstart = HAL_GetTick();
-    uint16_t samples = (SAMPLE_FREQ * 6) / (5 * wpm); // u = 1.2/c for PARIS
-
-    while (*s && (HAL_GetTick() - tickstart < AUDIO_TIMEOUT)) {
-        char chr = *s++;
-        uint8_t code = 0x80;
+    uint16_t samples = ch->gen.samples;
+    uint8_t code = 0x80;
+
+    if (chr >= '0' && chr <= '9') code = morse[chr - '0' + 0];
+    else if (chr >= 'A' && chr <= 'Z') code = morse[chr - 'A' + 10];
+    else if (chr >= 'a' && chr <= 'z') code = morse[chr - 'a' + 10];
+    else {
+        for (uint8_t i = 0; i < sizeof(spechar); i++) // Read through the array
+            if (chr == spechar[i]) code = morse[i+36]; // Map it to morse code
+    }
 
-        if (chr >= '0' && chr <= '9') code = morse[chr - '0' + 0];
-        else if (chr >= 'A' && chr <= 'Z') code = morse[chr - 'A' + 10];
-        else if (chr >= 'a' && chr <= 'z') code = morse[chr - 'a' + 10];
-        else {
-            for (uint8_t i = 0; i < sizeof(spechar); i++) // Read through the array
-                if (chr == spechar[i]) code = morse[i+36]; // Map it to morse code
+    if (chr == ' ') {
+        audio_play_morse(ch, (IWGLEN - ICGLEN) * samples, false); // ICG was already played after previous char
+    } else {
+        while (code != 0x80) {
+            if (code & 0x80) audio_play_morse(ch, DAHLEN * samples, true); // Play a dash
+            else audio_play_morse(ch, DITLEN * samples, true); // Play a dot
+            audio_play_morse(ch, IEGLEN * samples, false); // Inter Element gap
+            code <<= 1;
         }
+        audio_play_morse(ch, (ICGLEN - IEGLEN) * samples, false); // IEG was already played after element
+    }
+}
+
 
-        if (chr == ' ') {
-            audio_play_morse((IWGLEN - ICGLEN) * samples, freq, false); // ICG was already played after previous char
-        } else {
-            while (code != 0x80) {
-                if (code & 0x80) audio_play_morse(DAHLEN * samples, freq, true); // Play a dash
-                else audio_play_morse(DITLEN * samples, freq, true); // Play a dot
-                audio_play_morse(IEGLEN * samples, freq, false); // Inter Element gap
-                code <<= 1;
+/* Encode the next PSK symbol or character of the message, at most AUDIO_GEN_STEP_MAX commands */
+static void audio_gen_step(AUDIO_CHANNEL *ch)
+{
+    AUDIO_GEN *g = &ch->gen;
+    bool text = *g->s && (HAL_GetTick() - g->tickstart < AUDIO_TIMEOUT);
+
+    switch (g->state) {
+        case GEN_START:
+            audio_play_psk(ch, g->samples, PSK_SYM_START); // start
+            g->count = g->sync;
+            g->state = GEN_SYNC;
+            break;
+        case GEN_SYNC:
+            if (g->count) {
+                audio_play_psk(ch, g->samples, PSK_SYM_0); // 1sec of zeros - sync
+                g->count--;
             }
-            audio_play_morse((ICGLEN - IEGLEN) * samples, freq, false); // IEG was already played after element
-        }
+            else g->state = GEN_LEAD_CR;
+            break;
+        case GEN_LEAD_CR:
+            audio_psk_char(ch, '\r'); // CR
+            g->state = GEN_TEXT;
+            break;
+        case GEN_TEXT:
+            if (g->type == AUDIO_GEN_MORSE) {
+                if (text) audio_morse_char(ch, *g->s++);
+                else g->state = GEN_DONE;
+            } else {
+                if (text) audio_psk_char(ch, *g->s++); // data
+                else g->state = GEN_TRAIL_CR;
+            }
+            break;
+        case GEN_TRAIL_CR:
+            audio_psk_char(ch, '\r'); // CR
+            g->state = GEN_TRAIL_SPACE;
+            break;
+        case GEN_TRAIL_SPACE:
+            audio_psk_char(ch, ' '); // space to fix last CR
+            g->count = g->sync;
+            g->state = GEN_IDLE;
+            break;
+        case GEN_IDLE:
+            if (g->count) {
+                audio_play_psk(ch, g->samples, PSK_SYM_1); // 1sec of ones - no data
+                g->count--;
+            }
+            else g->state = GEN_STOP;
+            break;
+        case GEN_STOP:
+            audio_play_psk(ch, g->samples, PSK_SYM_STOP); // stop
+            g->state = GEN_DONE;
+            break;
     }
 }
 
 
-void audio_play_vox_start()
+/* Refill the queues of the mixed channels, never waits for free queue entries */
+static void audio_mix_task(void)
 {
-    audio_play_vox_stop();
-    audio_play_tone(0.100*SAMPLE_FREQ, 2300, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.100*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.100*SAMPLE_FREQ, 2300, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.100*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
+    for (uint8_t c = 1; c <= AUDIO_MIX_CHANNELS; c++) {
+        AUDIO_CHANNEL *ch = &channels[c];
+        while (ch->gen.state != GEN_DONE && (uint16_t)(ch->head - ch->tail) <= ch->len - AUDIO_GEN_STEP_MAX) {
+            audio_gen_step(ch);
+        }
+    }
 }
 
 
-void audio_play_vox_stop()
+static bool audio_mix_busy(void)
 {
-    audio_play_tone(0.100*SAMPLE_FREQ, 1900, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.100*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.100*SAMPLE_FREQ, 1900, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.100*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
+    for (uint8_t c = 1; c <= AUDIO_MIX_CHANNELS; c++) {
+        if (audio_channel_busy(&channels[c])) return true;
+    }
+    return false;
 }
 
 
-void audio_play_vis(uint8_t vis)
+void audio_start()
 {
-    audio_play_tone(0.300*SAMPLE_FREQ, 1900, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.010*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.300*SAMPLE_FREQ, 1900, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.030*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
-    for (uint8_t i = 0; i < 8; i++) {
-        audio_play_tone(0.030*SAMPLE_FREQ, (vis & 0x01) ? 1100 : 1300, AUDIO_VOLUME_SSTV);
-        vis >>= 1;
+    // reset command queues and phase accumulators
+    syslog_event(LOG_AUDIO_START);
+    for (uint8_t c = 0; c <= AUDIO_MIX_CHANNELS; c++) {
+        AUDIO_CHANNEL *ch = &channels[c];
+        ch->queue = (c == 0) ? audio_queue : mix_queue[c - 1];
+        ch->len = (c == 0) ? AUDIO_QUEUE_LEN : AUDIO_MIX_QUEUE_LEN;
+        ch->head = ch->tail = 0;
+        ch->pos = 0;
+        ch->phi = 0;
+        ch->level = (c == 0) ? 0 : AUDIO_BIAS;
+        ch->gen.state = GEN_DONE;
+    }
+    line_head = line_tail = 0;
+    time_frac = 0;
+    audio_queued = 0;
+    audio_rendered = 0;
+    nco_inc_hz = ((1ULL << 31) * sample_period) / AUDIO_TIM_CLOCK;
+    audio_prepare_pixels();
+    audio_running = true;
+    // cosinus ramp up from 0V to Vcc/2 bias, prefill the whole buffer and start audio output
+    audio_play_ramp(0x4000);
+    audio_render(audio_buffer, AUDIO_BUFFER_LEN);
+    // mixed channels set up by audio_mix_psk() or audio_mix_morse() start after the ramp
+    for (uint8_t c = 1; c <= AUDIO_MIX_CHANNELS; c++) {
+        if (channels[c].gen.type != AUDIO_GEN_IDLE) audio_gen_begin(&channels[c]);
     }
-    audio_play_tone(0.030*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
+    audio_mix_task();
+    htim6.Instance->ARR = sample_period - 1;
+    HAL_TIM_Base_Start(&htim6);
+    HAL_DAC_Start_DMA(&hdac, DAC_CHANNEL_2, (uint32_t*)audio_buffer, AUDIO_BUFFER_LEN, AUDIO_DAC_ALIGN);
 }
 
 
-void audio_play_vis16(uint16_t vis)
+void audio_stop()
 {
-    audio_play_tone(0.300*SAMPLE_FREQ, 1900, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.010*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.300*SAMPLE_FREQ, 1900, AUDIO_VOLUME_SSTV);
-    audio_play_tone(0.030*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
-    for (uint8_t i = 0; i < 16; i++) {
-        audio_play_tone(0.030*SAMPLE_FREQ, (vis & 0x0001) ? 1100 : 1300, AUDIO_VOLUME_SSTV);
-        vis >>= 1;
+    // mixed channels finish their messages, the main channel keeps the bias meanwhile
+    while (audio_mix_busy()) {
+        if ((uint16_t)(main_ch->head - main_ch->tail) < 2) audio_play_silence(main_ch, AUDIO_BUFFER_LEN/2, AUDIO_BIAS, 0);
+        audio_wait();
     }
-    audio_play_tone(0.030*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
+    for (uint8_t c = 1; c <= AUDIO_MIX_CHANNELS; c++) channels[c].gen.type = AUDIO_GEN_IDLE;
+    // cosinus ramp down from Vcc/2 bias to 0V, then one buffer of zero samples
+    audio_play_ramp(0);
+    audio_play_silence(main_ch, AUDIO_BUFFER_LEN, 0, 0);
+    // wait until the queue is rendered and the last rendered half is played
+    while (main_ch->tail != main_ch->head) audio_wait();
+    uint32_t blocks = audio_blocks;
+    while (audio_blocks - blocks < 2) audio_wait();
+    HAL_DAC_Stop_DMA(&hdac, DAC_CHANNEL_2);
+    HAL_TIM_Base_Stop(&htim6);
+    audio_running = false;
+    syslog_event(LOG_AUDIO_STOP);
 }
 
 
-static void audio_compute_luma(uint8_t *scanline, uint8_t *luma, uint8_t lines)
+void audio_psk(uint16_t speed, uint16_t freq, const char *s)
 {
-    for (int i = 0; i < IMG_WIDTH * lines; i++) {
-        uint16_t y = 0;
-        y += (uint16_t)scanline[i*3+0] * 30;
-        y += (uint16_t)scanline[i*3+1] * 59;
-        y += (uint16_t)scanline[i*3+2] * 11;
-        y /= 100;
-        luma[i] = y;
-    }
+    audio_gen_init(main_ch, AUDIO_GEN_PSK, speed, freq, s, AUDIO_VOLUME_PSK);
+    audio_gen_begin(main_ch);
+    while (main_ch->gen.state != GEN_DONE) audio_gen_step(main_ch);
 }
 
 
-static void audio_compute_chroma(uint8_t *scanline, uint8_t *luma, uint8_t *chroma, uint8_t mode)
+void audio_morse(uint16_t wpm, uint16_t freq, const char *s)
 {
-     for (int i = 0; i < IMG_WIDTH; i++) {
-        uint16_t y = luma[i];
-        uint16_t c = scanline[i*3+mode];
-        chroma[i] = (c-y + 255) / 2;
-    }
+    audio_gen_init(main_ch, AUDIO_GEN_MORSE, wpm, freq, s, AUDIO_VOLUME_MORSE);
+    audio_gen_begin(main_ch);
+    while (main_ch->gen.state != GEN_DONE) audio_gen_step(main_ch);
 }
 
 
-static void audio_compute_chroma_2lines(uint8_t *scanline, uint8_t *luma, uint8_t *chroma, uint8_t mode)
+/* Message on a mixed channel (1 to AUDIO_MIX_CHANNELS) under the main transmission, volume in Q15. Set up before
+   audio_start() or while running; the text is copied, audio_stop() waits for its end. */
+static void audio_mix(uint8_t channel, uint8_t type, uint16_t speed, uint16_t freq, const char *s, q15_t volume)
 {
-    for (int i = 0; i < IMG_WIDTH; i++) {
-        uint16_t y = ((uint16_t)luma[i] + luma[i+IMG_WIDTH])/2;
-        uint16_t c = ((uint16_t)scanline[i*3+mode] + scanline[i*3+mode+IMG_WIDTH*3])/2;
-        chroma[i] = (c-y + 255) / 2;
+    if (channel == 0 || channel > AUDIO_MIX_CHANNELS) return;
+    AUDIO_CHANNEL *ch = &channels[channel];
+
+    ch->gen.state = GEN_DONE; // interrupt renders what is queued, nothing is added meanwhile
+    strncpy(mix_text[channel - 1], s, AUDIO_MIX_TEXT_LEN - 1);
+    mix_text[channel - 1][AUDIO_MIX_TEXT_LEN - 1] = '\0';
+    audio_gen_init(ch, type, speed, freq, mix_text[channel - 1], volume);
+    if (audio_running) {
+        audio_gen_begin(ch);
+        audio_mix_task();
     }
 }
 
 
-void audio_robot36_color(uint8_t *scanline)
+void audio_mix_psk(uint8_t channel, uint16_t speed, uint16_t freq, const char *s, int16_t volume)
 {
-    uint8_t luma[IMG_WIDTH*2];
-    uint8_t chroma[IMG_WIDTH];
-
-    for (int line = 0; line < IMG_HEIGHT; line += 2) {
-        // luma 1st line
-        audio_compute_luma(scanline, luma, 2);
-        audio_play_tone(0.009*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
-        audio_play_tone(0.003*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
-        audio_play_line(0.088*SAMPLE_FREQ, IMG_WIDTH, luma, AUDIO_VOLUME_SSTV);
+    audio_mix(channel, AUDIO_GEN_PSK, speed, freq, s, volume);
+}
 
-        // chroma R-Y
-        audio_compute_chroma_2lines(scanline, luma, chroma, CHROMA_R_Y);
-        audio_play_tone(0.0045*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
-        audio_play_tone(0.0015*SAMPLE_FREQ, 1900, AUDIO_VOLUME_SSTV);
-        audio_play_line(0.044*SAMPLE_FREQ, IMG_WIDTH, chroma, AUDIO_VOLUME_SSTV);
 
-        // luma 2nd line
-        audio_play_tone(0.009*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
-        audio_play_tone(0.003*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
-        audio_play_line(0.088*SAMPLE_FREQ, IMG_WIDTH, luma+IMG_WIDTH, AUDIO_VOLUME_SSTV);
+void audio_mix_morse(uint8_t channel, uint16_t wpm, uint16_t freq, const char *s, int16_t volume)
+{
+    audio_mix(channel, AUDIO_GEN_MORSE, wpm, freq, s, volume);
+}
 
-        // chroma B-Y
-        audio_compute_chroma_2lines(scanline, luma, chroma, CHROMA_B_Y);
-        audio_play_tone(0.0045*SAMPLE_FREQ, 2300, AUDIO_VOLUME_SSTV);
-        audio_play_tone(0.0015*SAMPLE_FREQ, 1900, AUDIO_VOLUME_SSTV);
-        audio_play_line(0.044*SAMPLE_FREQ, IMG_WIDTH, chroma, AUDIO_VOLUME_SSTV);
 
-        scanline += IMG_WIDTH*2*3;
+/* Messages set up on the mixed channels before a transmission that did not start are dropped, so that the next
+   audio_start() does not play them; true if there were any */
+bool audio_mix_cancel(void)
+{
+    bool armed = false;
+    if (audio_running) return false;
+    for (uint8_t c = 1; c <= AUDIO_MIX_CHANNELS; c++) {
+        if (channels[c].gen.type != AUDIO_GEN_IDLE) armed = true;
+        channels[c].gen.type = AUDIO_GEN_IDLE;
     }
+    return armed;
 }
 
 
-void audio_robot72_color(uint8_t *scanline)
+void audio_play_vox_start()
 {
-    uint8_t luma[IMG_WIDTH];
-    uint8_t chroma[IMG_WIDTH];
+    audio_play_vox_stop();
+    audio_sstv_tone(AUDIO_US(0.100), 2300);
+    audio_sstv_tone(AUDIO_US(0.100), 1500);
+    audio_sstv_tone(AUDIO_US(0.100), 2300);
+    audio_sstv_tone(AUDIO_US(0.100), 1500);
+}
 
-    for (int line = 0; line < IMG_HEIGHT; line += 1) {
-        // luma
-        audio_compute_luma(scanline, luma, 1);
-        audio_play_tone(0.009*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
-        audio_play_tone(0.003*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
-        audio_play_line(0.138*SAMPLE_FREQ, IMG_WIDTH, luma, AUDIO_VOLUME_SSTV);
 
-        // chroma R-Y
-        audio_compute_chroma(scanline, luma, chroma, CHROMA_R_Y);
-        audio_play_tone(0.0045*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
-        audio_play_tone(0.0015*SAMPLE_FREQ, 1900, AUDIO_VOLUME_SSTV);
-        audio_play_line(0.069*SAMPLE_FREQ, IMG_WIDTH, chroma, AUDIO_VOLUME_SSTV);
+void audio_play_vox_stop()
+{
+    audio_sstv_tone(AUDIO_US(0.100), 1900);
+    audio_sstv_tone(AUDIO_US(0.100), 1500);
+    audio_sstv_tone(AUDIO_US(0.100), 1900);
+    audio_sstv_tone(AUDIO_US(0.100), 1500);
+}
 
-        // chroma B-Y
-        audio_compute_chroma(scanline, luma, chroma, CHROMA_B_Y);
-        audio_play_tone(0.0045*SAMPLE_FREQ, 2300, AUDIO_VOLUME_SSTV);
-        audio_play_tone(0.0015*SAMPLE_FREQ, 1900, AUDIO_VOLUME_SSTV);
-        audio_play_line(0.069*SAMPLE_FREQ, IMG_WIDTH, chroma, AUDIO_VOLUME_SSTV);
 
-        scanline += IMG_WIDTH*3;
+void audio_play_vis(uint8_t vis)
+{
+    audio_sstv_tone(AUDIO_US(0.300), 1900);
+    audio_sstv_tone(AUDIO_US(0.010), 1200);
+    audio_sstv_tone(AUDIO_US(0.300), 1900);
+    audio_sstv_tone(AUDIO_US(0.030), 1200);
+    for (uint8_t i = 0; i < 8; i++) {
+        audio_sstv_tone(AUDIO_US(0.030), (vis & 0x01) ? 1100 : 1300);
+        vis >>= 1;
     }
+    audio_sstv_tone(AUDIO_US(0.030), 1200);
 }
 
 
-void audio_mp73(uint8_t *scanline)
+void audio_play_vis16(uint16_t vis)
 {
-    uint8_t luma[IMG_WIDTH*2];
-    uint8_t chroma[IMG_WIDTH];
+    audio_sstv_tone(AUDIO_US(0.300), 1900);
+    audio_sstv_tone(AUDIO_US(0.010), 1200);
+    audio_sstv_tone(AUDIO_US(0.300), 1900);
+    audio_sstv_tone(AUDIO_US(0.030), 1200);
+    for (uint8_t i = 0; i < 16; i++) {
+        audio_sstv_tone(AUDIO_US(0.030), (vis & 0x0001) ? 1100 : 1300);
+        vis >>= 1;
+    }
+    audio_sstv_tone(AUDIO_US(0.030), 1200);
+}
 
-    for (int line = 0; line < IMG_HEIGHT; line += 2) {
-        // luma 1st line
-        audio_compute_luma(scanline, luma, 2);
-        audio_play_tone(0.009*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
-        audio_play_tone(0.001*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
-        audio_play_line(0.140*SAMPLE_FREQ, IMG_WIDTH, luma, AUDIO_VOLUME_SSTV);
 
-        // chroma R-Y
-        audio_compute_chroma_2lines(scanline, luma, chroma, CHROMA_R_Y);
-        audio_play_line(0.140*SAMPLE_FREQ, IMG_WIDTH, chroma, AUDIO_VOLUME_SSTV);
+static void audio_compute_luma(uint8_t *scanline, uint8_t *luma, uint16_t width, uint8_t lines)
+{
+    yuv_luma(scanline, luma, width * lines);
+}
+
 
-        // chroma B-Y
-        audio_compute_chroma_2lines(scanline, luma, chroma, CHROMA_B_Y);
-        audio_play_line(0.140*SAMPLE_FREQ, IMG_WIDTH, chroma, AUDIO_VOLUME_SSTV);
+static void audio_compute_chroma(uint8_t *scanline, uint8_t *luma, uint8_t *chroma, uint16_t width, uint8_t mode)
+{
+    yuv_chroma(scanline, luma, chroma, mode, width);
+}
 
-        // luma 2nd line
-        audio_play_line(0.140*SAMPLE_FREQ, IMG_WIDTH, luma+IMG_WIDTH, AUDIO_VOLUME_SSTV);
 
-        scanline += IMG_WIDTH*2*3;
+static void audio_compute_chroma_2lines(uint8_t *scanline, uint8_t *luma, uint8_t *chroma, uint16_t width, uint8_t mode)
+{
+    yuv_chroma_2lines(scanline, luma, chroma, mode, width);
+}
+
+
+/* Extract one colour component of the line */
+static void audio_compute_rgb(uint8_t *scanline, uint8_t *dst, uint16_t width, uint8_t component)
+{
+    scanline += component;
+    for (uint16_t i = 0; i < width; i++) {
+        *dst++ = *scanline;
+        scanline += 3;
     }
 }
 
 
-void audio_mp115(uint8_t *scanline)
+/* Starting sync pulse, sent once after VIS by modes with mid-line sync */
+void audio_play_sync(uint32_t us)
+{
+    audio_sstv_tone(us, 1200);
+}
+
+
+/* One segment sequence of the mode fits the line pool and the command queue, audio_sstv_scan() of mode->lines
+   rows will not wait for the render interrupt */
+bool audio_sstv_ready(const SSTV_MODE *mode)
 {
-    uint8_t luma[IMG_WIDTH*2];
-    uint8_t chroma[IMG_WIDTH];
+    uint8_t lines = 0, cmds = 0;
 
-    for (int line = 0; line < IMG_HEIGHT; line += 2) {
-        // luma 1st line
-        audio_compute_luma(scanline, luma, 2);
-        audio_play_tone(0.009*SAMPLE_FREQ, 1200, AUDIO_VOLUME_SSTV);
-        audio_play_tone(0.001*SAMPLE_FREQ, 1500, AUDIO_VOLUME_SSTV);
-        audio_play_line(0.223*SAMPLE_FREQ, IMG_WIDTH, luma, AUDIO_VOLUME_SSTV);
+    for (const SSTV_SEGMENT *seg = mode->seq; seg->us; seg++, cmds++) {
+        if (seg->scan != SSTV_TONE) lines++;
+    }
+    return (uint8_t)(line_head - line_tail) + lines <= AUDIO_LINE_SLOTS &&
+        (uint16_t)(main_ch->head - main_ch->tail) + cmds <= main_ch->len;
+}
 
-        // chroma R-Y
-        audio_compute_chroma_2lines(scanline, luma, chroma, CHROMA_R_Y);
-        audio_play_line(0.223*SAMPLE_FREQ, IMG_WIDTH, chroma, AUDIO_VOLUME_SSTV);
 
-        // chroma B-Y
-        audio_compute_chroma_2lines(scanline, luma, chroma, CHROMA_B_Y);
-        audio_play_line(0.223*SAMPLE_FREQ, IMG_WIDTH, chroma, AUDIO_VOLUME_SSTV);
+/* Generic scanline engine: sends up to IMG_HEIGHT rows of RGB888 data as the segment sequences of the mode */
+void audio_sstv_scan(const SSTV_MODE *mode, uint8_t *scanline, uint8_t rows)
+{
+    uint8_t *luma = scan_luma, *chroma = scan_chroma;
+    uint16_t width = mode->width;
 
-        // luma 2nd line
-        audio_play_line(0.223*SAMPLE_FREQ, IMG_WIDTH, luma+IMG_WIDTH, AUDIO_VOLUME_SSTV);
+    for (int line = 0; line < rows; line += mode->lines) {
+        bool luma_ok = false;
 
-        scanline += IMG_WIDTH*2*3;
+        for (const SSTV_SEGMENT *seg = mode->seq; seg->us; seg++) {
+            if ((seg->scan == SSTV_LUMA || seg->scan == SSTV_R_Y || seg->scan == SSTV_B_Y) && !luma_ok) {
+                audio_compute_luma(scanline, luma, width, mode->lines);
+                luma_ok = true;
+            }
+
+            switch (seg->scan) {
+                case SSTV_TONE:
+                    audio_sstv_tone(seg->us, seg->freq);
+                    break;
+                case SSTV_LUMA:
+                    audio_sstv_line(seg->us, width, luma + seg->line*width);
+                    break;
+                case SSTV_R_Y:
+                case SSTV_B_Y:
+                    if (mode->lines == 2) audio_compute_chroma_2lines(scanline, luma, chroma, width, (seg->scan == SSTV_R_Y) ? CHROMA_R_Y : CHROMA_B_Y);
+                    else audio_compute_chroma(scanline, luma, chroma, width, (seg->scan == SSTV_R_Y) ? CHROMA_R_Y : CHROMA_B_Y);
+                    audio_sstv_line(seg->us, width, chroma);
+                    break;
+                case SSTV_RED:
+                case SSTV_GREEN:
+                case SSTV_BLUE:
+                    audio_compute_rgb(scanline + seg->line*width*3, chroma, width, seg->scan - SSTV_RED);
+                    audio_sstv_line(seg->us, width, chroma);
+                    break;
+            }
+        }
+
+        scanline += width*mode->lines*3;
     }
 }
 
 
+/* Scanline engine for YCbCr strips of modes without RGB scans: sends rows from the line of the strip, see
+   IMG_STRIP_YCC() for the layout; chroma of each line pair is transmitted at half width */
+void audio_sstv_scan_ycc(const SSTV_MODE *mode, uint8_t *strip, uint8_t line, uint8_t rows)
+{
+    uint8_t *chroma = scan_chroma;
+    uint16_t width = mode->width;
+    uint8_t *cb = strip + width*IMG_HEIGHT;
+    uint8_t *cr = cb + width/2*IMG_HEIGHT/2;
+
+    for (uint8_t end = line + rows; line < end; line += mode->lines) {
+        for (const SSTV_SEGMENT *seg = mode->seq; seg->us; seg++) {
+            switch (seg->scan) {
+                case SSTV_TONE:
+                    audio_sstv_tone(seg->us, seg->freq);
+                    break;
+                case SSTV_LUMA:
+                    audio_sstv_line(seg->us, width, strip + (line + seg->line)*width);
+                    break;
+                case SSTV_R_Y:
+                    yuv_sstv_chroma(cr + line/2*width/2, chroma, YUV_GAIN_CR, width/2);
+                    audio_sstv_line(seg->us, width/2, chroma);
+                    break;
+                case SSTV_B_Y:
+                    yuv_sstv_chroma(cb + line/2*width/2, chroma, YUV_GAIN_CB, width/2);
+                    audio_sstv_line(seg->us, width/2, chroma);
+                    break;
+                default: // RGB scans need RGB strips
+                    break;
+            }
+        }
+    }
+}
@@ -83,7 +83,11 @@ static void psk_process_char(uint8_t c)
         psk_auto_handler(c);
         awaiting_cmd = 0;
     }
-    else if (c == PSK_RSP_UPLINK_CMD || c == PSK_RSP_AUTO_CMD) {
+    else if (awaiting_cmd == PSK_RSP_SLOT && (HAL_GetTick() - comm_timeout) < 500) {
+        psk_slot_handler(c);
+        awaiting_cmd = 0;
+    }
+    else if (c == PSK_RSP_UPLINK_CMD || c == PSK_RSP_AUTO_CMD || c == PSK_RSP_SLOT) {
         comm_timeout = HAL_GetTick();
         awaiting_cmd = c;
     }
@@ -11,6 +11,8 @@
 #include "cube.h"
 #include "comm.h"
 #include "eeprom.h"
+#include "audio.h"
+#include "sstv.h"
 
 /* access to global configuration in satcam.c */
 extern CONFIG_SYSTEM config;
@@ -380,9 +382,9 @@ void syslog_read_config(char *str)
     str += snprintf(str, end-str, CALLSIGN_SSTV_PSK " config at %u\r", (unsigned int)HAL_GetTick());
     if (str > end) return;
 
-    str += snprintf(str, end-str, "ov2640 delay %u, qs %u, agc %u, aec %u, agc-ceiling %u, agc-manual %u, aec-manual %u, awb %u\r",
+    str += snprintf(str, end-str, "ov2640 delay %u, qs %u, agc %u, aec %u, agc-ceiling %u, agc-manual %u, aec-manual %u, awb %u, rotate %u\r",
         config.cam.delay, config.cam.qs, config.cam.agc, config.cam.aec, config.cam.agc_ceiling,
-        config.cam.agc_manual, config.cam.aec_manual, config.cam.awb
+        config.cam.agc_manual, config.cam.aec_manual, config.cam.awb, config.cam.rotate
     );
     if (str > end) return;
 
@@ -407,8 +409,8 @@ void syslog_read_config(char *str)
     );
     if (str > end) return;
 
-    str += snprintf(str, end-str, "sstv save plan page %u, count %u, curr %u, next %u, llow %u, lhigh %u\r",
-        plan.sstv_save.page, plan.sstv_save.count, plan.sstv_save.delay_curr, plan.sstv_save.delay_next,
+    str += snprintf(str, end-str, "sstv save plan page %u, width %u, count %u, curr %u, next %u, llow %u, lhigh %u\r",
+        plan.sstv_save.page, plan.sstv_save.width, plan.sstv_save.count, plan.sstv_save.delay_curr, plan.sstv_save.delay_next,
         plan.sstv_save.light_low, plan.sstv_save.light_high
     );
     if (str > end) return;
@@ -456,6 +458,9 @@ void syslog_read_telemetry(char *str)
     EncCharFull(syslog_get_counter(LOG_CMD_HANDLED) + syslog_get_counter(LOG_PSK_UPLINK) + 2, &str);
     EncCharFull(syslog_get_counter(LOG_CMD_IGNORED) + 1, &str);
     EncCharFull(syslog_get_counter(LOG_AUTH_ERROR) + 1, &str);
+    *str++ = ' ';
+
+    EncCharFull((sstv_get_slack() < 1023) ? sstv_get_slack() : 1023, &str); // 10ms units, 1023 also if no SSTV yet
     *str++ = '\r';
     *str++ = '\0';
 }
@@ -15,6 +15,12 @@
 
 static bool flash_fail = false;
 
+// streamed read: the READ command is kept running, blocks are received by DMA alternately to two buffers
+static uint8_t stream_block[2][FLASH_STREAM_BLOCK];
+static uint8_t stream_dma; // block being received by DMA
+static uint16_t stream_pos; // read position in the other block, FLASH_STREAM_BLOCK when consumed
+static bool stream_open = false;
+
 static void flash_spi_write(uint8_t *buffer, uint16_t length, bool keep_nss)
 {
     HAL_GPIO_WritePin(SPI2_NSS_GPIO_Port, SPI2_NSS_Pin, 0);
@@ -105,6 +111,57 @@ void flash_read(uint32_t addr, uint8_t *buffer, uint16_t length)
 }
 
 
+void flash_stream_open(uint32_t addr)
+{
+    uint32_t cmd = __REV((0x03 << 24) | (addr & 0x001FFFFF));
+    flash_stream_close();
+    if (flash_fail) return;
+    flash_spi_write((uint8_t*)(&cmd), 4, true);
+    /* prefetch of the first block, the caller goes on until it needs the data */
+    stream_dma = 0;
+    stream_pos = FLASH_STREAM_BLOCK;
+    HAL_SPI_Receive_DMA(&hspi2, stream_block[stream_dma], FLASH_STREAM_BLOCK);
+    stream_open = true;
+}
+
+
+void flash_stream_read(uint8_t *buffer, uint16_t length)
+{
+    if (!stream_open) {
+        /* read as erased flash */
+        if (buffer) memset(buffer, 0xFF, length);
+        return;
+    }
+
+    while (length) {
+        if (stream_pos == FLASH_STREAM_BLOCK) {
+            /* take the prefetched block and start the next one, the flash continues with the next address */
+            while (hspi2.State == HAL_SPI_STATE_BUSY_RX);
+            stream_dma ^= 1;
+            stream_pos = 0;
+            HAL_SPI_Receive_DMA(&hspi2, stream_block[stream_dma], FLASH_STREAM_BLOCK);
+        }
+        uint16_t n = FLASH_STREAM_BLOCK - stream_pos;
+        if (n > length) n = length;
+        if (buffer) {
+            memcpy(buffer, &stream_block[stream_dma ^ 1][stream_pos], n);
+            buffer += n;
+        }
+        stream_pos += n;
+        length -= n;
+    }
+}
+
+
+void flash_stream_close(void)
+{
+    if (!stream_open) return;
+    while (hspi2.State == HAL_SPI_STATE_BUSY_RX);
+    HAL_GPIO_WritePin(SPI2_NSS_GPIO_Port, SPI2_NSS_Pin, 1);
+    stream_open = false;
+}
+
+
 bool flash_program_page(uint32_t addr, uint8_t *buffer)
 {
     uint32_t cmd = __REV((0x02 << 24) | (addr & 0x001FFF00));
@@ -20,6 +20,12 @@
 #define INCLUDE_OV2640_REGS
 #include "ov2640_regs.h"
 
+static uint16_t frame_width = 320; // JPEG frame size, 320x240 or 640x480, 800x600 up to 1600x1200 streamed to flash
+
+// ping-pong capture: DMA fills one half of the buffer while the other one is drained
+static volatile uint8_t stream_full; // bit 0: first half full, bit 1: second half full
+static volatile bool stream_overrun; // DMA switched to a half not drained yet
+
 
 static uint8_t SCCB_Write(uint8_t addr, uint8_t data)
 {
@@ -87,13 +93,18 @@ bool ov2640_enable(bool en)
         /* frame size; timing for XCLK=12MHz, 43% duty, CLKRC=0x00 */
         // SCCB_Write_Multi(OV2640_SENSOR_SMALL); SCCB_Write_Multi(OV2640_DSP_160x120); // 6MHz
         // SCCB_Write_Multi(OV2640_SENSOR_SMALL); SCCB_Write_Multi(OV2640_DSP_176x144); // 6MHz
-        SCCB_Write_Multi(OV2640_SENSOR_SMALL); SCCB_Write_Multi(OV2640_DSP_320x240); // 6MHz
+        switch (frame_width) {
+            case 1600: SCCB_Write_Multi(OV2640_SENSOR_LARGE); SCCB_Write_Multi(OV2640_DSP_1600x1200); break; // 18MHz, q=50
+            case 1280: SCCB_Write_Multi(OV2640_SENSOR_LARGE); SCCB_Write_Multi(OV2640_DSP_1280x1024); break; // 18MHz, q=20
+            case 1024: SCCB_Write_Multi(OV2640_SENSOR_LARGE); SCCB_Write_Multi(OV2640_DSP_1024x768); break; // 18MHz, 7.14fps, q=10 -> 9MHz, 3.57fps
+            case 800: SCCB_Write_Multi(OV2640_SENSOR_LARGE); SCCB_Write_Multi(OV2640_DSP_800x600); break; // 18MHz, 7.14fps
+            case 640: SCCB_Write_Multi(OV2640_SENSOR_LARGE); SCCB_Write_Multi(OV2640_DSP_640x480); break; // 9MHz, 7.14fps
+            default: SCCB_Write_Multi(OV2640_SENSOR_SMALL); SCCB_Write_Multi(OV2640_DSP_320x240); break; // 6MHz
+        }
         // SCCB_Write_Multi(OV2640_SENSOR_SMALL); SCCB_Write_Multi(OV2640_DSP_352x288); // 6MHz, 13.7fps
-        // SCCB_Write_Multi(OV2640_SENSOR_LARGE); SCCB_Write_Multi(OV2640_DSP_640x480); // 9MHz, 7.14fps
-        // SCCB_Write_Multi(OV2640_SENSOR_LARGE); SCCB_Write_Multi(OV2640_DSP_800x600); // 18MHz, 7.14fps
-        // SCCB_Write_Multi(OV2640_SENSOR_LARGE); SCCB_Write_Multi(OV2640_DSP_1024x768); // 18MHz, 7.14fps, q=10 -> 9MHz, 3.57fps
-        // SCCB_Write_Multi(OV2640_SENSOR_LARGE); SCCB_Write_Multi(OV2640_DSP_1280x1024); // 18MHz, q=20
-        // SCCB_Write_Multi(OV2640_SENSOR_LARGE); SCCB_Write_Multi(OV2640_DSP_1600x1200); // 18MHz, q=50
+
+        /* frames larger than the buffer are streamed to flash, slower sensor clock */
+        if (frame_width > 640) ov2640_set_register(BANK_SEL_SENSOR, 0x11, SENSOR_CLKRC_STREAM);
 
         /* enable JPEG */
         SCCB_Write_Multi(OV2640_JPEG_ON);
@@ -165,6 +176,102 @@ uint32_t ov2640_snapshot(uint8_t *buffer, uint32_t length)
 }
 
 
+static void ov2640_stream_m0(DMA_HandleTypeDef *hdma)
+{
+    if (stream_full & 0x02) stream_overrun = true;
+    stream_full |= 0x01;
+}
+
+
+static void ov2640_stream_m1(DMA_HandleTypeDef *hdma)
+{
+    if (stream_full & 0x01) stream_overrun = true;
+    stream_full |= 0x02;
+}
+
+
+static void ov2640_stream_error(DMA_HandleTypeDef *hdma)
+{
+    stream_overrun = true;
+}
+
+
+/* Drains the data, false when the image would be larger than the limit or on drain error */
+static bool ov2640_stream_drain(bool (*drain)(uint8_t *data, uint32_t length), uint8_t *data, uint32_t length, uint32_t *total, uint32_t limit)
+{
+    if (*total + length > limit) {
+        /* Image larger than the space reserved for it */
+        syslog_event(LOG_CAM_SIZE_ERROR);
+        return false;
+    }
+    *total += length;
+    return drain(data, length);
+}
+
+
+uint32_t ov2640_snapshot_stream(uint8_t *buffer, uint32_t length, uint32_t limit, bool (*drain)(uint8_t *data, uint32_t length))
+{
+    uint32_t half = (length / 2) & ~0xFF; // whole flash pages
+    uint32_t total = 0;
+    uint8_t next = 0; // half to be drained next
+    bool ok = true;
+
+    stream_full = 0;
+    stream_overrun = false;
+
+    /* Start the DCMI, DMA double buffer mode with the halves of the buffer */
+    syslog_event(LOG_CAM_SNAPSHOT);
+    __HAL_DCMI_ENABLE(&hdcmi);
+    hdcmi.Instance->CR = (hdcmi.Instance->CR & ~DCMI_CR_CM) | DCMI_MODE_SNAPSHOT;
+    hdma_dcmi.XferCpltCallback = ov2640_stream_m0;
+    hdma_dcmi.XferM1CpltCallback = ov2640_stream_m1;
+    hdma_dcmi.XferErrorCallback = ov2640_stream_error;
+    HAL_DMAEx_MultiBufferStart_IT(&hdma_dcmi, (uint32_t)&hdcmi.Instance->DR, (uint32_t)buffer, (uint32_t)(buffer + half), half / 4);
+    hdcmi.Instance->CR |= DCMI_CR_CAPTURE;
+
+    /* Drain full halves while the frame is captured */
+    uint32_t snapshot_start = HAL_GetTick();
+    while (ok && (hdcmi.Instance->CR & DCMI_CR_CAPTURE) != 0) {
+        if (stream_full & (1 << next)) {
+            ok = ov2640_stream_drain(drain, buffer + next * half, half, &total, limit);
+            __disable_irq();
+            stream_full &= ~(1 << next);
+            __enable_irq();
+            next ^= 1;
+            HAL_IWDG_Refresh(&hiwdg); // one half per flash programming time
+        }
+        if (!ok) break;
+        if (stream_overrun) {
+            /* Flash programming slower than the sensor, part of JPEG has been dropped */
+            syslog_event(LOG_CAM_SIZE_ERROR);
+            ok = false;
+        }
+        else if ((HAL_GetTick() - snapshot_start) >= SENSOR_TIMEOUT_STREAM) {
+            /* Sensor timeout, most likely a HW issue */
+            syslog_event(LOG_CAM_DCMI_ERROR);
+            ok = false;
+        }
+    }
+
+    /* Stop the DMA, its FIFO is flushed to the buffer; back to single buffer mode for ov2640_snapshot() */
+    HAL_DCMI_Stop(&hdcmi);
+    hdma_dcmi.Instance->CR &= ~DMA_SxCR_DBM;
+    if (ok && stream_overrun) {
+        syslog_event(LOG_CAM_SIZE_ERROR);
+        ok = false;
+    }
+    if (!ok) return 0;
+
+    /* The frame is finished: the last full half, then the partial one being filled */
+    uint8_t last = (hdma_dcmi.Instance->CR & DMA_SxCR_CT) ? 1 : 0;
+    uint32_t rest = half - hdma_dcmi.Instance->NDTR * 4;
+    if (stream_full & (1 << next)) ok = ov2640_stream_drain(drain, buffer + next * half, half, &total, limit);
+    if (ok && rest) ok = ov2640_stream_drain(drain, buffer + last * half, rest, &total, limit);
+
+    return ok ? total : 0;
+}
+
+
 void ov2640_set_awb(uint8_t mode)
 {
     switch (mode) {
@@ -221,8 +328,9 @@ uint8_t ov2640_get_register(uint8_t bank, uint8_t reg)
 }
 
 
-bool ov2640_hilevel_init(CONFIG_CAMERA cam)
+bool ov2640_hilevel_init(CONFIG_CAMERA cam, uint16_t width)
 {
+    frame_width = width;
     if (!ov2640_enable_safe(true)) return false;
 
     ov2640_set_register(BANK_SEL_DSP, 0x44, cam.qs); // 0~100%, 255~0%, default 95%
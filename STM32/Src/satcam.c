@@ -9,6 +9,7 @@
  *************************************************************************/
 
 #include "cube.h"
+#include <arm_math.h>
 #include "eeprom.h"
 #include "ov2640.h"
 #include "audio.h"
@@ -23,8 +24,15 @@ static struct {
     char overlay[2][TEXT_LEN];
 } img;
 
+// high resolution snapshot streamed to the JPEG pages of consecutive flash images
+static uint8_t capture_sector;
+static uint32_t capture_length; // programmed so far
+static uint32_t capture_limit; // erased JPEG pages
+
 static bool startup_done = false;
 static uint32_t last_cmd_tick = 0;
+static uint8_t auto_slot = 0; // remaining TX slot in seconds from PSK board, 0 if unknown
+static uint32_t auto_slot_tick;
 
 IMPORT_BIN("Inc/sstv_monoscope.jpg", uint8_t, img_monoscope);
 
@@ -45,6 +53,7 @@ const CONFIG_SYSTEM config_default = {
         .agc_manual = 0,
         .aec_manual = 0,
         .awb = AWB_SUNNY,
+        .rotate = SSTV_ROTATE_NONE,
     },
     .sstv_keep_rx = true,
     .auth_req = AUTH_AUTH_SET + AUTH_CAMCFG + AUTH_CAMCFG_STARTUP + AUTH_CAMCFG_SAVE + AUTH_DEBUG + AUTH_MULTI_HIGH_DUTY + AUTH_TCMD,
@@ -53,15 +62,44 @@ const CONFIG_SYSTEM config_default = {
 };
 
 
-static bool camera_snapshot(void)
+static bool camera_flash_drain(uint8_t *data, uint32_t length)
+{
+    bool ok = flash_program(ADDR_JPEGDATA(capture_sector, capture_length), data, length);
+    capture_length += length;
+    return ok;
+}
+
+
+/* Erases the JPEG pages for a high resolution snapshot from sector, later images are marked as its continuation */
+static bool camera_flash_prepare(uint8_t sector, uint8_t count)
+{
+    const uint32_t length = 0; // continuation of the previous image
+    for (uint8_t i = 0; i < count; i++) {
+        if (!flash_erase_sector(ADDR_JPEGIMAGE(sector + i))) return false;
+        if (i == 0) continue;
+        if (!flash_erase_sector(ADDR_THUMBNAIL(sector + i))) return false;
+        flash_program(ADDR_FLASHINFO(sector + i), (uint8_t*)(&length), sizeof(length));
+    }
+    capture_sector = sector;
+    capture_length = 0;
+    capture_limit = (uint32_t)count << 16;
+    return true;
+}
+
+
+static bool camera_snapshot(uint16_t width)
 {
     set_led_red(true);
-    if (!ov2640_hilevel_init(config.cam)) {
+    if (!ov2640_hilevel_init(config.cam, width)) {
         set_led_red(false);
         return false;
     }
 
-    img.length = ov2640_snapshot(jpeg, sizeof(jpeg)); // requires enabled turbo
+    if (width > IMG_WIDTH_MAX) {
+        /* streamed to flash prepared by camera_flash_prepare(), the buffer is a ping-pong of two halves */
+        img.length = ov2640_snapshot_stream(jpeg, sizeof(jpeg), capture_limit, camera_flash_drain);
+    }
+    else img.length = ov2640_snapshot(jpeg, sizeof(jpeg)); // requires enabled turbo
     uint16_t agc = ov2640_get_current_agc();
     uint16_t aec = ov2640_get_current_aec();
     set_led_red(false);
@@ -119,15 +157,37 @@ static void send_downlink(CMD_RESULT what)
     if (text) {
         cmd_response(text);
     }
-    if (cw && psk_request(PSK_CMD_TX_KEEP_RX)) {
+    if (cw && !audio_busy() && psk_request(PSK_CMD_TX_KEEP_RX)) {
+        audio_set_rate(PSK_SAMPLE_FREQ);
         audio_start();
         audio_morse(CW_WPM, CW_FREQ, cw);
         audio_stop();
+        audio_set_rate(SAMPLE_FREQ);
         psk_request(PSK_CMD_STOP_TX);
     }
 }
 
 
+/* CW message due now is mixed under the starting transmission if its tone is outside the used band; true if mixed */
+static bool plan_mix_cw(uint16_t band_low, uint16_t band_high, int16_t volume)
+{
+    if (plan.cw.count == 0 || plan.cw.delay_curr > 0) return false;
+    if (plan.cw.freq + CW_MIX_GUARD > band_low && plan.cw.freq < band_high + CW_MIX_GUARD) return false;
+    if (2 * (uint32_t)plan.cw.freq >= audio_get_rate()) return false; // aliased at the rate of this transmission
+    audio_mix_morse(1, plan.cw.wpm, plan.cw.freq, plan.cw.buffer, volume);
+    return true;
+}
+
+
+/* CW message mixed by plan_mix_cw() is done after the transmission, it stays due when the audio did not start */
+static void plan_mix_cw_done(bool mixed)
+{
+    if (!mixed || audio_mix_cancel()) return;
+    plan.cw.delay_curr = plan.cw.delay_next;
+    plan.cw.count--;
+}
+
+
 void plan_task(void)
 {
     static uint32_t tick_last = 0;
@@ -142,14 +202,14 @@ void plan_task(void)
 
     if (plan.sstv_live.count > 0) {
         if (plan.sstv_live.delay_curr > 0) plan.sstv_live.delay_curr--;
-        else {
+        else if (!audio_busy()) { // postpone while another transmission is running
             uint32_t task_start = HAL_GetTick();
             plan.sstv_live.delay_curr = plan.sstv_live.delay_next;
             plan.sstv_live.count--;
 
             /* start SSTV here */
             enable_turbo(true); // peak 18% CPU
-            bool ok = camera_snapshot();
+            bool ok = camera_snapshot(sstv_get_mode(plan.sstv_live.mode)->width); // 640x480 for PD120/PD180
             if (ok) ok = jpeg_test(jpeg, img.length);
             if (ok) {
                 sstv_set_overlay(OVERLAY_HEADER, img.overlay[OVERLAY_HEADER]);
@@ -157,7 +217,10 @@ void plan_task(void)
                 sstv_set_overlay(OVERLAY_LARGE, NULL);
                 sstv_set_overlay(OVERLAY_FROM, CALLSIGN_SSTV_PSK);
                 if (psk_request(config.sstv_keep_rx ? PSK_CMD_TX_KEEP_RX : PSK_CMD_TX_NO_RX)) {
+                    bool mixed = plan_mix_cw(1100, 2300, AUDIO_VOLUME_MIX); // CW ID under the image
+                    sstv_set_rotate(config.cam.rotate);
                     sstv_play_jpeg(jpeg, plan.sstv_live.mode);
+                    plan_mix_cw_done(mixed);
                     psk_request(PSK_CMD_STOP_TX);
                 }
             }
@@ -168,7 +231,7 @@ void plan_task(void)
     }
     if (plan.sstv_save.count > 0) {
         if (plan.sstv_save.delay_curr > 0) plan.sstv_save.delay_curr--;
-        else {
+        else if (!audio_busy()) { // postpone while another transmission is running
             uint32_t task_start = HAL_GetTick();
             plan.sstv_save.delay_curr = plan.sstv_save.delay_next;
 
@@ -181,22 +244,38 @@ void plan_task(void)
 
             /* do CAM snapshot here */
             uint8_t sector = plan.sstv_save.page;
+            uint8_t images = 1; // flash images taken by the snapshot
             uint8_t *thumbnail;
+            bool ok;
             enable_turbo(true);
-            bool ok = camera_snapshot();
-            if (ok) ok = jpeg_thumbnail(jpeg, &thumbnail); // 4060ms without turbo, 205ms with turbo
-            if (ok) {
-                if (flash_erase_sector(ADDR_JPEGIMAGE(sector))) {
-                    flash_program(ADDR_JPEGIMAGE(sector), jpeg, img.length);
-                }
-                if (flash_erase_sector(ADDR_THUMBNAIL(sector))) {
-                    flash_program(ADDR_THUMBNAIL(sector), thumbnail, 80*60*3);
+            if (plan.sstv_save.width > IMG_WIDTH_MAX) {
+                /* high resolution: JPEG programmed to flash during the snapshot, no thumbnail */
+                images = (16 - sector < HIRES_MAX_IMAGES) ? 16 - sector : HIRES_MAX_IMAGES;
+                ok = camera_flash_prepare(sector, images);
+                if (ok) ok = camera_snapshot(plan.sstv_save.width);
+                if (ok) ok = (img.length != 0);
+                if (flash_erase_sector(ADDR_THUMBNAIL(sector)) && ok) {
                     flash_program(ADDR_FLASHINFO(sector), (uint8_t*)(&img), sizeof(img));
                 }
             }
+            else {
+                ok = camera_snapshot(IMG_WIDTH);
+                if (ok) ok = jpeg_test(jpeg, img.length);
+                if (ok) ok = jpeg_thumbnail(jpeg, &thumbnail); // DC-only 1/8 preview, ~3x faster than the former 1/4 scale decode (4060/205ms without/with turbo)
+                if (ok) {
+                    if (flash_erase_sector(ADDR_JPEGIMAGE(sector))) {
+                        flash_program(ADDR_JPEGIMAGE(sector), jpeg, img.length);
+                    }
+                    if (flash_erase_sector(ADDR_THUMBNAIL(sector))) {
+                        flash_program(ADDR_THUMBNAIL(sector), thumbnail, 80*60*3);
+                        flash_program(ADDR_FLASHINFO(sector), (uint8_t*)(&img), sizeof(img));
+                    }
+                }
+            }
             enable_turbo(false);
 
-            if (++plan.sstv_save.page >= 16) plan.sstv_save.page = 0;
+            plan.sstv_save.page += images;
+            if (plan.sstv_save.page >= 16) plan.sstv_save.page = 0;
             if (plan.sstv_save.delay_curr < 30) last_cmd_tick = HAL_GetTick(); // ignore auto PSK commands for short measurement intervals
             plan.sstv_save.delay_curr += (HAL_GetTick() - task_start) / 1000 + 1; // add elapsed time to delay
             send_downlink(R_QUEUED);
@@ -204,7 +283,7 @@ void plan_task(void)
     }
     if (plan.psk.count > 0) {
         if (plan.psk.delay_curr > 0) plan.psk.delay_curr--;
-        else {
+        else if (!audio_busy()) { // postpone while another transmission is running
             uint32_t task_start = HAL_GetTick();
             plan.psk.delay_curr = plan.psk.delay_next;
             plan.psk.count--;
@@ -228,11 +307,13 @@ void plan_task(void)
 
             /* start PSK here */
             if (psk_request((plan.psk.what == PSK_TLM) ? PSK_CMD_TX_IDLE : PSK_CMD_TX_KEEP_RX)) {
-                enable_turbo(true); // peak 18% CPU
+                audio_set_rate(PSK_SAMPLE_FREQ);
                 audio_start();
-                audio_psk(plan.psk.speed, plan.psk.freq, plan.psk.buffer); // 76% CPU without turbo, 4% CPU with turbo
+                bool mixed = plan_mix_cw(plan.psk.freq, plan.psk.freq, AUDIO_VOLUME_PSK);
+                audio_psk(plan.psk.speed, plan.psk.freq, plan.psk.buffer); // no turbo, symbol envelopes are cached like for CW
                 audio_stop();
-                enable_turbo(false);
+                plan_mix_cw_done(mixed);
+                audio_set_rate(SAMPLE_FREQ);
                 psk_request(PSK_CMD_STOP_TX);
             }
             plan.psk.delay_curr += (HAL_GetTick() - task_start) / 1000 + 1; // add elapsed time to delay
@@ -241,16 +322,18 @@ void plan_task(void)
     }
     if (plan.cw.count > 0) {
         if (plan.cw.delay_curr > 0) plan.cw.delay_curr--;
-        else {
+        else if (!audio_busy()) { // postpone while another transmission is running
             uint32_t task_start = HAL_GetTick();
             plan.cw.delay_curr = plan.cw.delay_next;
             plan.cw.count--;
 
             /* start CW here */
             if (psk_request(PSK_CMD_TX_KEEP_RX)) {
+                audio_set_rate(PSK_SAMPLE_FREQ);
                 audio_start();
                 audio_morse(plan.cw.wpm, plan.cw.freq, plan.cw.buffer);
                 audio_stop();
+                audio_set_rate(SAMPLE_FREQ);
                 psk_request(PSK_CMD_STOP_TX);
             }
             plan.cw.delay_curr += (HAL_GetTick() - task_start) / 1000 + 1; // add elapsed time to delay
@@ -304,6 +387,7 @@ static CMD_RESULT cmd_sstv(char **saveptr)
         if (!auth_check_req(AUTH_SSTV_SAVE)) return R_ERR_AUTH;
         if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
         plan.sstv_save.page = atol(token);
+        plan.sstv_save.width = IMG_WIDTH;
         plan.sstv_save.count = 1;
         plan.sstv_save.delay_curr = 0;
         plan.sstv_save.delay_next = 0;
@@ -326,6 +410,23 @@ static CMD_RESULT cmd_sstv(char **saveptr)
         plan.sstv_save.light_high = atol(token);
         return R_OK;
     }
+    else if (streq(token, "hires")) {
+        if (!auth_check_req(AUTH_SSTV_SAVE)) return R_ERR_AUTH;
+        if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
+        uint8_t page = atol(token);
+        if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
+        uint16_t width = atol(token);
+        if (page >= 16 || (width != 800 && width != 1024 && width != 1280 && width != 1600)) return R_ERR_SYNTAX;
+        plan.sstv_save.page = page;
+        plan.sstv_save.width = width;
+        plan.sstv_save.count = 1;
+        plan.sstv_save.delay_curr = 0;
+        plan.sstv_save.delay_next = 0;
+        plan.sstv_save.light_low = 0;
+        plan.sstv_save.light_high = 0;
+        /* queued camera snapshot streamed to flash, up to HIRES_MAX_IMAGES images from page */
+        return R_OK;
+    }
     else if (streq(token, "load")) {
         if (!auth_check_req(AUTH_SSTV_LOAD)) return R_ERR_AUTH;
         if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
@@ -333,13 +434,24 @@ static CMD_RESULT cmd_sstv(char **saveptr)
         if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
         uint8_t sector = atol(token);
         char *overlay = NULL;
-        if ((token = strtok_r(NULL, ".", saveptr)) != NULL) overlay = token;
+        uint8_t zoom = 0, x = 50, y = 50;
+        if ((token = strtok_r(NULL, ".", saveptr)) != NULL && streq(token, "zoom")) {
+            /* zoom window: 1/ZOOM of the image size centred at X, Y percent of the image */
+            if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
+            zoom = atol(token);
+            if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
+            x = atol(token);
+            if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
+            y = atol(token);
+            if (zoom < 1 || zoom > 16 || x > 100 || y > 100) return R_ERR_SYNTAX;
+            token = strtok_r(NULL, ".", saveptr);
+        }
+        if (token != NULL) overlay = token;
 
-        /* load image from FLASH: sector */
-        flash_read(ADDR_JPEGIMAGE(sector), jpeg, 0xFFFF);
+        /* image info from FLASH: sector; the image is decoded while read, the last capture stays in RAM */
         flash_read(ADDR_FLASHINFO(sector), (uint8_t*)(&img), sizeof(img));
 
-        /* send image: mode, overlay */
+        /* send image: mode, overlay; checked when saved, later data errors are concealed by the decoder */
         if (img.length != 0 && img.length != 0xFFFFFFFF) {
             // add memory number
             snprintf(img.overlay[OVERLAY_HEADER], sizeof(img.overlay[OVERLAY_HEADER]), "%s F#%u",
@@ -351,7 +463,9 @@ static CMD_RESULT cmd_sstv(char **saveptr)
             sstv_set_overlay(OVERLAY_FROM, CALLSIGN_SSTV_PSK);
             if (!psk_request(config.sstv_keep_rx ? PSK_CMD_TX_KEEP_RX : PSK_CMD_TX_NO_RX)) return R_TX_DENIED;
             enable_turbo(true); // peak 18% CPU
-            sstv_play_jpeg(jpeg, mode);
+            sstv_set_zoom(zoom, x, y);
+            sstv_set_rotate(config.cam.rotate);
+            sstv_play_flash(sector, img.length, mode);
             enable_turbo(false);
             psk_request(PSK_CMD_STOP_TX);
         }
@@ -611,6 +725,22 @@ static CMD_RESULT cmd_camcfg(char **saveptr)
         }
         else return R_ERR_SYNTAX;
     }
+    else if (streq(token, "rotate")) {
+        if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
+        if (streq(token, "off")) {
+            config.cam.rotate = SSTV_ROTATE_NONE;
+            return R_OK;
+        }
+        else if (streq(token, "cw")) {
+            config.cam.rotate = SSTV_ROTATE_CW;
+            return R_OK;
+        }
+        else if (streq(token, "ccw")) {
+            config.cam.rotate = SSTV_ROTATE_CCW;
+            return R_OK;
+        }
+        else return R_ERR_SYNTAX;
+    }
     else if (streq(token, "rx")) {
         if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
         if (streq(token, "disable")) {
@@ -683,7 +813,7 @@ static CMD_RESULT cmd_debug(char **saveptr)
     }
     else if (streq(token, "sendjpeg")) {
         enable_turbo(true);
-        if (!camera_snapshot()) img.length = 0;
+        if (!camera_snapshot(IMG_WIDTH)) img.length = 0;
         enable_turbo(false);
 
         HAL_UART_Transmit(&huart3, (char*)(&img.length), sizeof(img.length), HAL_MAX_DELAY);
@@ -698,6 +828,33 @@ static CMD_RESULT cmd_debug(char **saveptr)
         }
         return R_OK_SILENT;
     }
+    else if (streq(token, "jpegbench")) {
+        /* decoding time of ROM images and the last camera image, DC-only preview and full size, turbo and normal clock,
+         * rotated Robot36 with and without the decoder state index */
+        for (uint8_t i = 0; i <= sizeof(images)/sizeof(images[0]); i++) {
+            uint8_t *image = (i < sizeof(images)/sizeof(images[0])) ? images[i] : jpeg;
+            if (image == jpeg && (img.length == 0 || img.length > IMG_BUFFER_SIZE)) break;
+            enable_turbo(true);
+            uint32_t thumb_turbo = jpeg_benchmark(image, 3);
+            uint32_t full_turbo = jpeg_benchmark(image, 0);
+            enable_turbo(false);
+            uint32_t thumb = jpeg_benchmark(image, 3);
+            uint32_t full = jpeg_benchmark(image, 0);
+            printf_debug("JPEG #%u%s: preview %u/%ums, full %u/%ums (turbo/normal)", i, (image == jpeg) ? " camera" : "",
+                (unsigned int)thumb_turbo, (unsigned int)thumb, (unsigned int)full_turbo, (unsigned int)full
+            );
+            /* rotated Robot36, one decoder pass per strip, each strip is played for 2400ms */
+            uint16_t passes = 0;
+            enable_turbo(true);
+            uint32_t rotate_index = jpeg_benchmark_rotate(image, 36, true, &passes);
+            uint32_t rotate_reparse = jpeg_benchmark_rotate(image, 36, false, &passes);
+            enable_turbo(false);
+            printf_debug("JPEG #%u rotated: %u passes %u/%ums (index/reparse, turbo)", i,
+                passes, (unsigned int)rotate_index, (unsigned int)rotate_reparse
+            );
+        }
+        return R_OK_SILENT;
+    }
     else if (streq(token, "eeprom")) {
         if ((token = strtok_r(NULL, ".", saveptr)) == NULL) return R_ERR_SYNTAX;
         if (streq(token, "erase")) {
@@ -773,7 +930,12 @@ void cmd_handler(char *cmd, CMD_SOURCE src)
     CMD_RESULT result = R_ERR_SYNTAX;
     token = strtok_r(cmd, ".", &saveptr);
 
-    if (streq(token, "sstv")) {
+    if (audio_busy() && !(streq(token, "auth") || *token == '\0')) {
+        /* commands run from audio_wait() during transmission: only those changing RAM state, without TX, camera,
+           JPEG buffer, EEPROM or flash access */
+        result = R_TX_DENIED;
+    }
+    else if (streq(token, "sstv")) {
         result = cmd_sstv(&saveptr);
     }
     else if (streq(token, "psk")) {
@@ -814,33 +976,45 @@ void psk_uplink_handler(char cmd)
 }
 
 
+/* Remaining TX slot announced by PSK board, applies to the next auto command */
+void psk_slot_handler(char cmd)
+{
+    auto_slot = (uint8_t)cmd;
+    auto_slot_tick = HAL_GetTick();
+    printf_debug("TRX slot %us", auto_slot);
+}
+
+
 void psk_auto_handler(char cmd)
 {
     static bool rom = true;
     static uint8_t page_load = 0;
     static uint8_t page_rom = 0;
     char s[CMD_MAX_LEN] = "";
+    uint8_t mode;
 
-    // ignore PSK auto commands if idle time not yet elapsed
+    // ignore PSK auto commands if idle time not yet elapsed, or during transmission: the slot and the pages are kept
     if (!startup_done || config.idle_time == 0 || HAL_GetTick() - last_cmd_tick < config.idle_time * 1000UL) return;
+    if (audio_busy()) return;
     printf_debug("TRX auto cmd %c", cmd);
 
     switch (cmd) {
         case PSK_RSP_SSTV_36:
-            if (rom) {
-                sprintf(s, "SSTV.ROM.36.%u", page_rom++);
-                rom = false;
-            } else {
-                sprintf(s, "SSTV.LOAD.36.%u", page_load++);
-                rom = true;
-            }
-            break;
         case PSK_RSP_SSTV_73:
+            mode = (cmd == PSK_RSP_SSTV_36) ? 36 : 73;
+            if (auto_slot) {
+                // shorter mode if the requested one does not fit the rest of the slot, B/W quick-look at the end of pass
+                uint32_t slot = auto_slot * 1000UL;
+                uint32_t elapsed = HAL_GetTick() - auto_slot_tick;
+                mode = sstv_fit_mode(mode, (elapsed < slot) ? slot - elapsed : 0);
+                auto_slot = 0;
+                if (mode == 0) return;
+            }
             if (rom) {
-                sprintf(s, "SSTV.ROM.73.%u", page_rom++);
+                sprintf(s, "SSTV.ROM.%u.%u", mode, page_rom++);
                 rom = false;
             } else {
-                sprintf(s, "SSTV.LOAD.73.%u", page_load++);
+                sprintf(s, "SSTV.LOAD.%u.%u", mode, page_load++);
                 rom = true;
             }
             break;
@@ -856,6 +1030,20 @@ void psk_auto_handler(char cmd)
 }
 
 
+/* Main loop tasks, called while the audio engine waits for free buffers during transmission */
+void audio_idle_callback(void)
+{
+    static bool running = false;
+
+    if (running) return;
+    running = true;
+    comm_cmd_task();
+    comm_psk_task();
+    plan_task();
+    running = false;
+}
+
+
 void main_satcam()
 {
 #if ENABLE_SWD_DEBUG
@@ -17,90 +17,722 @@
 #include "sstv.h"
 
 // JPEG decompression engine variables
-static uint8_t workspace[3100] __attribute__ ((aligned(4)));
-static uint8_t *jpeg_data;
-static uint16_t jpeg_pos;
+static uint8_t workspace[IMG_WORKSPACE] __attribute__ ((aligned(4)));
+static uint8_t *jpeg_data; // image in RAM, NULL when streamed from flash
+static uint8_t jpeg_flash; // flash image streamed, JPEG over the JPEG pages of consecutive images when larger than 64kB
+static uint32_t jpeg_pos;
+static uint32_t jpeg_len; // end of input data, the decoder gets an input error beyond it
 
-// for JPEG decompression: 320*16*3 = 15360 bytes
-// for complete thumbnail: 80*60*3 = 14400 bytes
-static uint8_t image_buffer[IMG_WIDTH*IMG_HEIGHT*3];
+// for JPEG decompression: 640*16*3 = 30720 bytes, RGB strips: one 640 or two 320 pixel wide,
+// YCbCr strips of modes without RGB scans take a half: two 640 pixel wide
+// for complete thumbnail: 80*60*3 = 14400 bytes, followed by the 1/8 scale preview it is upscaled from
+static uint8_t image_buffer[IMG_WIDTH_MAX*IMG_HEIGHT*3] __attribute__ ((aligned(4)));
+static uint8_t *preview_buffer; // destination of tjd_preview_output()
+static uint16_t image_width = IMG_WIDTH; // width of decompressed JPEG block
+static uint8_t image_scale; // JPEG decompression scale, 1/2 for quick-look modes
+static bool image_resample; // image width other than the mode width or its power of two multiple, resampled to the mode raster
+
+// strip pipeline: the decoder fills one strip while the other one is sent line by line; only for images decoded
+// at the mode raster (camera snapshots, incl. 640 pixel YCbCr strips of PD120/PD180), resampled, zoomed and
+// rotated images use a single strip and the decoder waits until it is queued
+static uint8_t *strip_fill; // strip being decoded
+static uint8_t *strip_play; // strip being sent
+static uint8_t strip_line; // next unsent row of the strip being sent
+static uint8_t strip_rows; // unsent rows of the strip being sent
+static bool strip_double; // two strips fit image_buffer
+static bool strip_ycc; // YCbCr strips from the decoder, RGB888 otherwise
+static uint16_t strip_slack = UINT16_MAX; // worst audio slack at the end of a strip decode in 10ms, last transmission
+
+// resampler: MCU row of the decoder resampled horizontally to the second half of image_buffer, the output rows
+// are interpolated from it to the single strip in the first half; RGB888 plane or Y, Cb and Cr planes
+typedef struct {
+    uint8_t *rows;      // MCU row at the output width
+    uint16_t src_x, src_y, src_w, src_h; // window of the plane at the decoder scale, whole image or crop
+    uint16_t dst_w, dst_h; // plane size of the mode
+    uint16_t ox;        // next output column of the MCU row
+    uint8_t edge[IMG_HEIGHT*3]; // last column of the previous MCU
+} RESAMPLE_PLANE;
+
+// rotation of portrait modules: the image is decoded once per strip, the decoder outputs the source column band
+// of the strip rows to the band rows in the second half of image_buffer, followed by the decoder state index
+#define ROTATE_BAND         64 // widest column band of a strip
+#define ROTATE_BAND_SIZE    ((IMG_HEIGHT + 1) * ROTATE_BAND * 3) // band rows of RGB888 or Y, Cb and Cr planes
+typedef struct {
+    uint8_t *band;      // band rows of the MCU row, the first one is the last row of the previous MCU row
+    uint8_t *strip;     // plane in the strip
+    uint16_t stride;    // strip plane row in bytes
+    uint16_t src_x, src_y, src_w, src_h; // window of the plane at the decoder scale, whole image or crop
+    uint16_t dst_x, dst_y, dst_w, dst_h; // rotated window in the plane of the mode raster
+    uint16_t band_x, band_w; // source columns of the band of the strip
+    uint8_t rows, bpp;  // strip rows of the plane, bytes per pixel
+    uint8_t cx[IMG_HEIGHT], cf[IMG_HEIGHT]; // left band column and its weight of the strip rows, 0xFF out of the image
+} ROTATE_PLANE;
+
+static union {
+    RESAMPLE_PLANE resample[3];
+    ROTATE_PLANE rotate[3];
+} plane;
+static uint16_t resample_row; // next output row
+static JRECT image_crop; // decoded window of the image
+static uint8_t crop_zoom; // window of 1/zoom of the image size for the next transmission, 0 for the whole image
+static uint8_t crop_x, crop_y; // window centre in percent of the image size
+static uint8_t image_rotate; // SSTV_ROTATE_CW or SSTV_ROTATE_CCW, 0 for none
+static uint8_t rotate_next; // rotation of the next transmission
+static uint16_t rotate_w, rotate_h; // rotated window fitted to the mode raster
+static JSTATE *rotate_index; // decoder states of the MCU rows saved by the first pass, NULL to decode all rows again
+static uint16_t rotate_step; // MCUs between the decoder states of a row
 
 // overlay text buffer: 4 * up to 39 chars + trailing zero
 static char text_buffer[4][TEXT_LEN];
 
-static uint8_t sstv_mode;
+/* Robot36: Y 2 lines, R-Y and B-Y averaged over the line pair */
+static const SSTV_SEGMENT seq_robot36[] = {
+    { SSTV_TONE, 0, 1200, AUDIO_US(0.009) },
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.003) },
+    { SSTV_LUMA, 0, 0, AUDIO_US(0.088) },
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.0045) },
+    { SSTV_TONE, 0, 1900, AUDIO_US(0.0015) },
+    { SSTV_R_Y, 0, 0, AUDIO_US(0.044) },
+    { SSTV_TONE, 0, 1200, AUDIO_US(0.009) },
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.003) },
+    { SSTV_LUMA, 1, 0, AUDIO_US(0.088) },
+    { SSTV_TONE, 0, 2300, AUDIO_US(0.0045) },
+    { SSTV_TONE, 0, 1900, AUDIO_US(0.0015) },
+    { SSTV_B_Y, 0, 0, AUDIO_US(0.044) },
+    { 0 }
+};
+
+/* Robot72: Y, R-Y, B-Y of each line */
+static const SSTV_SEGMENT seq_robot72[] = {
+    { SSTV_TONE, 0, 1200, AUDIO_US(0.009) },
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.003) },
+    { SSTV_LUMA, 0, 0, AUDIO_US(0.138) },
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.0045) },
+    { SSTV_TONE, 0, 1900, AUDIO_US(0.0015) },
+    { SSTV_R_Y, 0, 0, AUDIO_US(0.069) },
+    { SSTV_TONE, 0, 2300, AUDIO_US(0.0045) },
+    { SSTV_TONE, 0, 1900, AUDIO_US(0.0015) },
+    { SSTV_B_Y, 0, 0, AUDIO_US(0.069) },
+    { 0 }
+};
+
+/* MP73/MP115: Y, R-Y, B-Y, Y of the line pair after one sync */
+static const SSTV_SEGMENT seq_mp73[] = {
+    { SSTV_TONE, 0, 1200, AUDIO_US(0.009) },
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.001) },
+    { SSTV_LUMA, 0, 0, AUDIO_US(0.140) },
+    { SSTV_R_Y, 0, 0, AUDIO_US(0.140) },
+    { SSTV_B_Y, 0, 0, AUDIO_US(0.140) },
+    { SSTV_LUMA, 1, 0, AUDIO_US(0.140) },
+    { 0 }
+};
+
+static const SSTV_SEGMENT seq_mp115[] = {
+    { SSTV_TONE, 0, 1200, AUDIO_US(0.009) },
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.001) },
+    { SSTV_LUMA, 0, 0, AUDIO_US(0.223) },
+    { SSTV_R_Y, 0, 0, AUDIO_US(0.223) },
+    { SSTV_B_Y, 0, 0, AUDIO_US(0.223) },
+    { SSTV_LUMA, 1, 0, AUDIO_US(0.223) },
+    { 0 }
+};
+
+/* Scottie: G, B, sync in the middle of the line, R */
+#define SEQ_SCOTTIE(__scan) { \
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.0015) }, \
+    { SSTV_GREEN, 0, 0, AUDIO_US(__scan) }, \
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.0015) }, \
+    { SSTV_BLUE, 0, 0, AUDIO_US(__scan) }, \
+    { SSTV_TONE, 0, 1200, AUDIO_US(0.009) }, \
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.0015) }, \
+    { SSTV_RED, 0, 0, AUDIO_US(__scan) }, \
+    { 0 } \
+}
+
+static const SSTV_SEGMENT seq_scottie1[] = SEQ_SCOTTIE(0.138240);
+static const SSTV_SEGMENT seq_scottie2[] = SEQ_SCOTTIE(0.088064);
+static const SSTV_SEGMENT seq_scottie_dx[] = SEQ_SCOTTIE(0.345600);
+
+/* Martin: sync, G, B, R with separators */
+#define SEQ_MARTIN(__scan) { \
+    { SSTV_TONE, 0, 1200, AUDIO_US(0.004862) }, \
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.000572) }, \
+    { SSTV_GREEN, 0, 0, AUDIO_US(__scan) }, \
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.000572) }, \
+    { SSTV_BLUE, 0, 0, AUDIO_US(__scan) }, \
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.000572) }, \
+    { SSTV_RED, 0, 0, AUDIO_US(__scan) }, \
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.000572) }, \
+    { 0 } \
+}
+
+static const SSTV_SEGMENT seq_martin1[] = SEQ_MARTIN(0.146432);
+static const SSTV_SEGMENT seq_martin2[] = SEQ_MARTIN(0.073216);
+
+/* PD: Y, R-Y, B-Y, Y of the line pair after sync and porch */
+#define SEQ_PD(__scan) { \
+    { SSTV_TONE, 0, 1200, AUDIO_US(0.020) }, \
+    { SSTV_TONE, 0, 1500, AUDIO_US(0.00208) }, \
+    { SSTV_LUMA, 0, 0, AUDIO_US(__scan) }, \
+    { SSTV_R_Y, 0, 0, AUDIO_US(__scan) }, \
+    { SSTV_B_Y, 0, 0, AUDIO_US(__scan) }, \
+    { SSTV_LUMA, 1, 0, AUDIO_US(__scan) }, \
+    { 0 } \
+}
+
+static const SSTV_SEGMENT seq_pd90[] = SEQ_PD(0.17024);
+static const SSTV_SEGMENT seq_pd120[] = SEQ_PD(0.1216);
+static const SSTV_SEGMENT seq_pd180[] = SEQ_PD(0.18304);
+
+/* Robot B/W: Y of each line after sync */
+#define SEQ_ROBOT_BW(__scan) { \
+    { SSTV_TONE, 0, 1200, AUDIO_US(0.007) }, \
+    { SSTV_LUMA, 0, 0, AUDIO_US(__scan) }, \
+    { 0 } \
+}
+
+static const SSTV_SEGMENT seq_robot8bw[] = SEQ_ROBOT_BW(0.060);
+static const SSTV_SEGMENT seq_robot12bw[] = SEQ_ROBOT_BW(0.093);
+static const SSTV_SEGMENT seq_robot24bw[] = SEQ_ROBOT_BW(0.093);
+
+/* Supported modes, the first one is default; new modes are numbered by their 7-bit VIS code */
+static const SSTV_MODE sstv_modes[] = {
+    // mode  name         width height VIS     bits lines header ovl_header ovl_large start_us        sequence
+    { 36,  "Robot36",    320,  240,   0x88,   8,   2,    false,  1,         3,        0,              seq_robot36 },
+    { 72,  "Robot72",    320,  240,   0x0C,   8,   1,    false,  1,         3,        0,              seq_robot72 },
+    { 73,  "MP73",       320,  256,   0x2523, 16,  2,    true,   0,         2,        0,              seq_mp73 },
+    { 115, "MP115",      320,  256,   0x2923, 16,  2,    true,   0,         2,        0,              seq_mp115 },
+    { 60,  "Scottie1",   320,  256,   0x3C,   8,   1,    true,   0,         2,        AUDIO_US(0.009), seq_scottie1 },
+    { 56,  "Scottie2",   320,  256,   0xB8,   8,   1,    true,   0,         2,        AUDIO_US(0.009), seq_scottie2 },
+    { 76,  "ScottieDX",  320,  256,   0xCC,   8,   1,    true,   0,         2,        AUDIO_US(0.009), seq_scottie_dx },
+    { 44,  "Martin1",    320,  256,   0xAC,   8,   1,    true,   0,         2,        0,              seq_martin1 },
+    { 40,  "Martin2",    320,  256,   0x28,   8,   1,    true,   0,         2,        0,              seq_martin2 },
+    { 99,  "PD90",       320,  256,   0x63,   8,   2,    true,   0,         2,        0,              seq_pd90 },
+    { 95,  "PD120",      640,  496,   0x5F,   8,   2,    true,   0,         2,        0,              seq_pd120 },
+    { 96,  "PD180",      640,  496,   0x60,   8,   2,    true,   0,         2,        0,              seq_pd180 },
+    { 2,   "Robot8BW",   160,  120,   0x82,   8,   1,    false,  1,         3,        0,              seq_robot8bw },
+    { 6,   "Robot12BW",  160,  120,   0x06,   8,   1,    false,  1,         3,        0,              seq_robot12bw },
+    { 10,  "Robot24BW",  320,  240,   0x0A,   8,   1,    false,  1,         3,        0,              seq_robot24bw },
+};
+
+static const SSTV_MODE *sstv_mode;
+static uint8_t sstv_last_row; // last overlay block row of the image
 
 IMPORT_BIN("Inc/8x13B.fnt", uint8_t, Font8x13B);
 
 static bool sstv_audio_callback(uint8_t *buffer, uint8_t line);
+static void sstv_strip_pump(void);
+static void sstv_strip_clear(uint8_t *buffer);
+static bool sstv_setup(uint8_t* jpeg, bool thumbnails, uint8_t mode);
+
+
+/* Duration of one segment sequence of the mode in us */
+static uint32_t sstv_seq_us(const SSTV_MODE *mode)
+{
+    uint32_t us = 0;
+
+    for (const SSTV_SEGMENT *seg = mode->seq; seg->us; seg++) us += seg->us;
+    return us;
+}
+
+
+/* Decoder input from the start of the image in RAM, or from the start of the flash stream for NULL */
+static void jpeg_input(uint8_t *jpeg)
+{
+    jpeg_data = jpeg;
+    jpeg_pos = 0;
+    if (jpeg != NULL) jpeg_len = IMG_BUFFER_SIZE;
+    else flash_stream_open(ADDR_JPEGIMAGE(jpeg_flash));
+}
 
 
 /* User defined call-back function to input JPEG data */
 static UINT tjd_input(JDEC* jd, uint8_t* buff, UINT nd)
 {
-    if (buff) memcpy(buff, &jpeg_data[jpeg_pos], nd);
-    jpeg_pos += nd;
+    if (jpeg_pos + nd > jpeg_len) nd = jpeg_len - jpeg_pos; // truncated image, no read beyond the buffer
+    if (jpeg_data != NULL) {
+        if (buff) memcpy(buff, &jpeg_data[jpeg_pos], nd);
+        jpeg_pos += nd;
+        return nd;
+    }
+
+    /* flash stream, the next block is prefetched by DMA while this one is decoded; reopened at the next JPEG page */
+    if (buff == NULL && nd > FLASH_STREAM_BLOCK) {
+        /* skip of MCU rows resumed by the rotator or a segment, the stream is reopened after it */
+        jpeg_pos += nd;
+        flash_stream_open(ADDR_JPEGDATA(jpeg_flash, jpeg_pos));
+        return nd;
+    }
+    for (UINT n = nd, k; n; n -= k) {
+        k = 0x10000 - (jpeg_pos & 0xFFFF);
+        if (k > n) k = n;
+        flash_stream_read(buff, k);
+        if (buff) buff += k;
+        jpeg_pos += k;
+        if ((jpeg_pos & 0xFFFF) == 0) flash_stream_open(ADDR_JPEGDATA(jpeg_flash, jpeg_pos));
+    }
     return nd;
 }
 
 
-/* User defined call-back function to output RGB bitmap */
-static UINT tjd_thumbnail_output(JDEC* jd, void* bitmap, JRECT* rect)
+/* User defined call-back function to output RGB bitmap, 1/8 scale preview */
+static UINT tjd_preview_output(JDEC* jd, void* bitmap, JRECT* rect)
 {
     uint8_t *src, *dst;
     uint16_t y, bws, bwd;
 
     /* Copy the decompressed RGB rectangular to the frame buffer (assuming RGB888 cfg) */
     src = (uint8_t*)bitmap;
-    dst = image_buffer + 3 * (rect->top * (IMG_WIDTH/4) + rect->left);  /* Left-top of destination rectangular */
+    bwd = 3 * (jd->width >> 3);                   /* Width of frame buffer [byte] */
+    dst = preview_buffer + rect->top * bwd + 3 * rect->left;  /* Left-top of destination rectangular */
     bws = 3 * (rect->right - rect->left + 1);     /* Width of source rectangular [byte] */
-    bwd = 3 * (IMG_WIDTH/4);                      /* Width of frame buffer [byte] */
     for (y = rect->top; y <= rect->bottom; y++) {
-        memcpy(dst, src, bws);   /* Copy a line */
-        src += bws; dst += bwd;  /* Next line */
+        if (src == NULL && y == 0) memset(dst, 0, bws);  /* Lost MCU, black on the first line */
+        else if (src == NULL) memcpy(dst, dst - bwd, bws); /* Lost MCU, repeat the line above */
+        else { memcpy(dst, src, bws); src += bws; }  /* Copy a line */
+        dst += bwd;  /* Next line */
     }
 
     return 1;    /* Continue to decompress */
 }
 
 
-/* User defined call-back function to output RGB bitmap */
+/* Conceals h rows of bw bytes at the top row of the strip plane lost by a data error, the row above is repeated:
+ * the last row of the previous strip for the top of the strip (black on the first image row) */
+static void sstv_conceal_plane(uint8_t *plane, uint16_t plane_height, uint16_t top, uint16_t h, uint16_t left, uint16_t bw,
+                               uint16_t stride, bool first, uint8_t black)
+{
+    const uint8_t *above;
+    if (top) above = plane + (top - 1) * stride + left;
+    else if (first) above = NULL;
+    else above = (strip_double ? strip_play : strip_fill) + (plane - strip_fill) + (plane_height - 1) * stride + left;
+
+    for (uint8_t *dst = plane + top * stride + left; h--; dst += stride) {
+        if (above) memcpy(dst, above, bw);
+        else memset(dst, black, bw);
+    }
+}
+
+
+/* Conceals the rectangular lost by a data error in the strip */
+static void sstv_conceal(JRECT* rect)
+{
+    uint16_t top = rect->top % IMG_HEIGHT;
+    uint16_t h = rect->bottom - rect->top + 1;
+    uint16_t w = rect->right - rect->left + 1;
+    bool first = (rect->top == 0);
+
+    if (strip_ycc) {
+        sstv_conceal_plane(strip_fill, IMG_HEIGHT, top, h, rect->left, w, image_width, first, 0);
+        for (uint8_t c = 0; c < 2; c++) {
+            sstv_conceal_plane(strip_fill + image_width * IMG_HEIGHT + c * (image_width/2) * (IMG_HEIGHT/2), IMG_HEIGHT/2,
+                               top/2, (h + 1)/2, rect->left/2, (w + 1)/2, image_width/2, first, 128);
+        }
+    }
+    else {
+        sstv_conceal_plane(strip_fill, IMG_HEIGHT, top, h, 3 * rect->left, 3 * w, 3 * image_width, first, 0);
+    }
+}
+
+
+/* User defined call-back function to output RGB bitmap, null bitmap for MCUs lost by data errors */
 static UINT tjd_full_output(JDEC* jd, void* bitmap, JRECT* rect)
 {
     uint8_t *src, *dst;
     uint16_t y, bws, bwd;
 
-    /* Copy the decompressed RGB rectangular to the frame buffer (assuming RGB888 cfg) */
+    /* previous strip is sent while this one is decoded */
+    sstv_strip_pump();
+
     src = (uint8_t*)bitmap;
-    dst = image_buffer + 3 * ((rect->top % IMG_HEIGHT) * IMG_WIDTH + rect->left);  /* Left-top of destination rectangular */
-    bws = 3 * (rect->right - rect->left + 1);     /* Width of source rectangular [byte] */
-    bwd = 3 * IMG_WIDTH;                          /* Width of frame buffer [byte] */
-    for (y = rect->top; y <= rect->bottom; y++) {
-        memcpy(dst, src, bws);   /* Copy a line */
-        src += bws; dst += bwd;  /* Next line */
+    if (src == NULL) {
+        sstv_conceal(rect);
+    }
+    else if (strip_ycc) {
+        /* Copy the Y plane and the half sized Cb and Cr planes of the rectangular to the strip planes */
+        uint16_t top = rect->top % IMG_HEIGHT;
+        uint16_t h = rect->bottom - rect->top + 1;
+        bws = rect->right - rect->left + 1;
+        dst = strip_fill + top * image_width + rect->left;
+        for (y = 0; y < h; y++) {
+            memcpy(dst, src, bws);
+            src += bws; dst += image_width;
+        }
+        for (uint8_t c = 0; c < 2; c++) {
+            dst = strip_fill + image_width * IMG_HEIGHT + c * (image_width/2) * (IMG_HEIGHT/2) + (top/2) * (image_width/2) + rect->left/2;
+            for (y = 0; y < (h + 1)/2; y++) {
+                memcpy(dst, src, (bws + 1)/2);
+                src += (bws + 1)/2; dst += image_width/2;
+            }
+        }
+    }
+    else {
+        /* Copy the decompressed RGB rectangular to the frame buffer (assuming RGB888 cfg) */
+        dst = strip_fill + 3 * ((rect->top % IMG_HEIGHT) * image_width + rect->left);  /* Left-top of destination rectangular */
+        bws = 3 * (rect->right - rect->left + 1);     /* Width of source rectangular [byte] */
+        bwd = 3 * image_width;                        /* Width of frame buffer [byte] */
+        for (y = rect->top; y <= rect->bottom; y++) {
+            memcpy(dst, src, bws);   /* Copy a line */
+            src += bws; dst += bwd;  /* Next line */
+        }
     }
 
-    /* execute callback when line block finished */
-    if ((rect->bottom % IMG_HEIGHT) == (IMG_HEIGHT - 1) && rect->right == (IMG_WIDTH - 1)) {
-        return sstv_audio_callback(image_buffer, (rect->bottom / IMG_HEIGHT) + 1) ? 1 : 0;
+    /* execute callback when line block finished, the last block may be partial */
+    if (((rect->bottom % IMG_HEIGHT) == (IMG_HEIGHT - 1) || rect->bottom == (jd->height >> jd->scale) - 1) && rect->right == (image_width - 1)) {
+        return sstv_audio_callback(strip_fill, (rect->bottom / IMG_HEIGHT) + 1) ? 1 : 0;
     }
 
     return 1;    /* Continue to decompress */
 }
 
 
-bool jpeg_thumbnail(uint8_t *jpeg, uint8_t **thumbnail)
+/* Source position of the output pixel o in 1/256 pixel, n source pixels to m output pixels with aligned centres */
+static uint32_t resample_pos(uint16_t o, uint16_t n, uint16_t m)
+{
+    int32_t p = (int32_t)((2 * o + 1) * (uint32_t)n * 128 / m) - 128;
+
+    if (p < 0) return 0;
+    if (p > (n - 1) * 256) return (n - 1) * 256;
+    return p;
+}
+
+
+/* Two tap interpolation of n bytes, weight f/256 of the second source */
+static void resample_lerp(uint8_t *dst, const uint8_t *a, const uint8_t *b, uint16_t n, uint16_t f)
+{
+    if (f == 0) memcpy(dst, a, n);
+    else while (n--) *dst++ = (*a++ * (256 - f) + *b++ * f + 128) >> 8;
+}
+
+
+/* Horizontal resampling of the MCU of the plane to its MCU row, output columns with both source pixels decoded;
+ * the last column is kept for the next MCU, a lost MCU leaves the previous MCU row in place */
+static void resample_mcu(RESAMPLE_PLANE *pl, const uint8_t *src, uint16_t left, uint16_t w, uint16_t h, uint8_t bpp)
+{
+    uint16_t stride = pl->dst_w * bpp;
+
+    if (left <= pl->src_x) pl->ox = 0; // first MCU of the window
+    for (; pl->ox < pl->dst_w; pl->ox++) {
+        uint32_t p = resample_pos(pl->ox, pl->src_w, pl->dst_w);
+        uint16_t x0 = pl->src_x + (p >> 8), f = p & 0xFF;
+        if (x0 + (f ? 1 : 0) >= left + w) break; // right pixel in the next MCU
+        if (src == NULL) continue;
+
+        uint8_t *dst = pl->rows + pl->ox * bpp;
+        for (uint16_t y = 0; y < h; y++, dst += stride) {
+            const uint8_t *b = src + (y * w + x0 + 1 - left) * bpp;
+            const uint8_t *a = (x0 < left) ? pl->edge + y * bpp : b - bpp;
+            if (f == 0) b = a;
+            resample_lerp(dst, a, b, bpp, f);
+        }
+    }
+
+    if (src != NULL) {
+        for (uint16_t y = 0; y < h; y++) memcpy(pl->edge + y * bpp, src + (y * w + w - 1) * bpp, bpp);
+    }
+}
+
+
+/* Vertical resampling of the plane row o from the MCU row of source rows first to last to dst; rows below
+ * the MCU row are not decoded yet and those above are dropped, the nearest row of the MCU row is used for them */
+static void resample_plane_row(RESAMPLE_PLANE *pl, uint8_t *dst, uint16_t o, uint16_t first, uint16_t last, uint8_t bpp)
+{
+    uint32_t p = resample_pos(o, pl->src_h, pl->dst_h);
+    uint16_t y0 = pl->src_y + (p >> 8), f = p & 0xFF;
+    uint16_t y1 = f ? y0 + 1 : y0;
+
+    if (y0 < first) { y0 = (y1 < first) ? first : y1; f = 0; }
+    else if (y1 > last) { y0 = (y0 > last) ? last : y0; f = 0; }
+    const uint8_t *a = pl->rows + (y0 - first) * pl->dst_w * bpp;
+    resample_lerp(dst, a, a + pl->dst_w * bpp, pl->dst_w * bpp, f);
+}
+
+
+/* Output rows of the MCU row of source rows top to bottom, the strip is sent when full; false to stop */
+static bool resample_rows(uint16_t top, uint16_t bottom)
+{
+    RESAMPLE_PLANE *pl = &plane.resample[0];
+
+    while (resample_row < pl->dst_h) {
+        /* all output rows of the MCU row done when the lower source row is in the next MCU row */
+        uint32_t p = resample_pos(resample_row, pl->src_h, pl->dst_h);
+        if (pl->src_y + (p >> 8) + ((p & 0xFF) ? 1 : 0) > bottom) break;
+
+        uint8_t r = resample_row % IMG_HEIGHT;
+        if (strip_ycc) {
+            resample_plane_row(pl, strip_fill + r * image_width, resample_row, top, bottom, 1);
+            for (uint8_t c = 0; !(r & 1) && c < 2; c++) {
+                uint8_t *dst = strip_fill + image_width * IMG_HEIGHT + c * (image_width/2) * (IMG_HEIGHT/2) + (r/2) * (image_width/2);
+                resample_plane_row(&plane.resample[1 + c], dst, resample_row/2, top/2, bottom/2, 1);
+            }
+        }
+        else {
+            resample_plane_row(pl, strip_fill + r * image_width * 3, resample_row, top, bottom, 3);
+        }
+
+        resample_row++;
+        if (resample_row % IMG_HEIGHT == 0 || resample_row == pl->dst_h) {
+            if (!sstv_audio_callback(strip_fill, (resample_row - 1) / IMG_HEIGHT + 1)) return false;
+        }
+    }
+    return true;
+}
+
+
+/* User defined call-back function to output RGB or YCbCr bitmap resampled to the mode raster, null bitmap for lost MCUs */
+static UINT tjd_resample_output(JDEC* jd, void* bitmap, JRECT* rect)
+{
+    uint8_t *src = (uint8_t*)bitmap;
+    uint16_t w = rect->right - rect->left + 1;
+    uint16_t h = rect->bottom - rect->top + 1;
+
+    if (strip_ycc) {
+        resample_mcu(&plane.resample[0], src, rect->left, w, h, 1);
+        for (uint8_t c = 0; c < 2; c++) {
+            uint8_t *csrc = src ? src + w * h + c * ((w + 1)/2) * ((h + 1)/2) : NULL;
+            resample_mcu(&plane.resample[1 + c], csrc, rect->left/2, (w + 1)/2, (h + 1)/2, 1);
+        }
+    }
+    else {
+        resample_mcu(&plane.resample[0], src, rect->left, w, h, 3);
+    }
+
+    /* vertical resampling when the MCU row of the window is complete */
+    if (rect->right >= plane.resample[0].src_x + plane.resample[0].src_w - 1) {
+        return resample_rows(rect->top, rect->bottom) ? 1 : 0;
+    }
+
+    return 1;    /* Continue to decompress */
+}
+
+
+/* Resampler planes of the crop window of the image decoded at image_scale: MCU row planes laid out as a strip
+ * in the second half of image_buffer */
+static void resample_init(JDEC* jd)
+{
+    uint8_t *rows = image_buffer + sizeof(image_buffer)/2;
+    uint16_t x0 = jd->crop.left >> image_scale, y0 = jd->crop.top >> image_scale;
+    uint16_t x1 = jd->crop.right >> image_scale, y1 = jd->crop.bottom >> image_scale;
+
+    /* last pixels of the scaled image, the clipped MCUs are rounded down */
+    if (x1 > (jd->width >> image_scale) - 1) x1 = (jd->width >> image_scale) - 1;
+    if (y1 > (jd->height >> image_scale) - 1) y1 = (jd->height >> image_scale) - 1;
+    resample_row = 0;
+
+    for (uint8_t i = 0; i < 3; i++) {
+        RESAMPLE_PLANE *pl = &plane.resample[i];
+        uint8_t sub = i ? 1 : 0; // chroma planes of half width and height
+        pl->ox = 0;
+        pl->rows = i ? rows + image_width * IMG_HEIGHT + (i - 1) * (image_width/2) * (IMG_HEIGHT/2) : rows;
+        pl->src_x = x0 >> sub;
+        pl->src_y = y0 >> sub;
+        pl->src_w = (x1 >> sub) - pl->src_x + 1;
+        pl->src_h = (y1 >> sub) - pl->src_y + 1;
+        pl->dst_w = image_width >> sub;
+        pl->dst_h = (sstv_mode->height - (sstv_mode->header ? IMG_HEIGHT : 0)) >> sub;
+    }
+}
+
+
+/* Source position of the output pixel o of the rotated axis in 1/256 pixel, mirrored for the reversed axis */
+static uint32_t rotate_pos(uint16_t o, uint16_t n, uint16_t m, bool reverse)
+{
+    return resample_pos(reverse ? m - 1 - o : o, n, m);
+}
+
+
+/* Source column band of the plane rows of the strip k and the band columns of the rows; false for no image rows */
+static bool rotate_band(ROTATE_PLANE *pl, uint16_t k)
+{
+    uint16_t lo = UINT16_MAX, hi = 0;
+
+    /* strip rows are source columns: clockwise from the left, counterclockwise from the right */
+    for (uint8_t pass = 0; pass < 2; pass++) {
+        for (uint8_t j = 0; j < pl->rows; j++) {
+            int32_t v = (int32_t)k * pl->rows + j - pl->dst_y;
+            if (v < 0 || v >= pl->dst_h) {
+                pl->cx[j] = 0xFF;
+                continue;
+            }
+            uint32_t p = rotate_pos(v, pl->src_w, pl->dst_h, image_rotate == SSTV_ROTATE_CCW);
+            uint16_t x0 = p >> 8, x1 = (p & 0xFF) ? x0 + 1 : x0;
+            if (pass == 0) {
+                if (x0 < lo) lo = x0;
+                if (x1 > hi) hi = x1;
+            }
+            else {
+                pl->cx[j] = x0 - lo;
+                pl->cf[j] = p & 0xFF;
+            }
+        }
+        if (lo > hi) return false;
+    }
+    pl->band_x = pl->src_x + lo;
+    pl->band_w = hi - lo + 1;
+    return true;
+}
+
+
+/* MCU columns of the band to the band rows below the edge row, a lost MCU leaves the previous MCU row in place */
+static void rotate_mcu(ROTATE_PLANE *pl, const uint8_t *src, uint16_t left, uint16_t w, uint16_t h)
+{
+    uint16_t a = (left > pl->band_x) ? left : pl->band_x;
+    uint16_t b = (left + w < pl->band_x + pl->band_w) ? left + w : pl->band_x + pl->band_w;
+
+    if (src == NULL || a >= b) return;
+    for (uint16_t y = 0; y < h; y++) {
+        memcpy(pl->band + ((y + 1) * pl->band_w + a - pl->band_x) * pl->bpp, src + (y * w + a - left) * pl->bpp, (b - a) * pl->bpp);
+    }
+}
+
+
+/* Strip columns of the plane with both source rows in the band rows of the MCU row of h source rows from top;
+ * bilinear interpolation of the band, the last band row is kept for the next MCU row */
+static void rotate_rows(ROTATE_PLANE *pl, uint16_t top, uint16_t h)
+{
+    uint16_t stride = pl->band_w * pl->bpp;
+    uint8_t t0[3], t1[3];
+
+    /* strip columns are source rows: clockwise from the bottom, counterclockwise from the top */
+    for (uint16_t u = 0; u < pl->dst_w; u++) {
+        uint32_t p = rotate_pos(u, pl->src_h, pl->dst_w, image_rotate == SSTV_ROTATE_CW);
+        uint16_t y0 = pl->src_y + (p >> 8), fy = p & 0xFF;
+        uint16_t y1 = fy ? y0 + 1 : y0;
+        if (y1 < top || y1 >= top + h) continue;
+
+        const uint8_t *r0 = pl->band + (y0 + 1 - top) * stride, *r1 = pl->band + (y1 + 1 - top) * stride;
+        uint8_t *dst = pl->strip + (pl->dst_x + u) * pl->bpp;
+        for (uint8_t j = 0; j < pl->rows; j++, dst += pl->stride) {
+            if (pl->cx[j] == 0xFF) continue;
+            uint16_t i0 = pl->cx[j] * pl->bpp, i1 = pl->cf[j] ? i0 + pl->bpp : i0;
+            resample_lerp(t0, r0 + i0, r0 + i1, pl->bpp, pl->cf[j]);
+            resample_lerp(t1, r1 + i0, r1 + i1, pl->bpp, pl->cf[j]);
+            resample_lerp(dst, t0, t1, pl->bpp, fy);
+        }
+    }
+
+    memcpy(pl->band, pl->band + h * stride, stride);
+}
+
+
+/* User defined call-back function to output RGB or YCbCr bitmap of the column band rotated to the strip, null bitmap
+ * for lost MCUs */
+static UINT tjd_rotate_output(JDEC* jd, void* bitmap, JRECT* rect)
+{
+    uint8_t *src = (uint8_t*)bitmap;
+    uint16_t w = rect->right - rect->left + 1;
+    uint16_t h = rect->bottom - rect->top + 1;
+
+    rotate_mcu(&plane.rotate[0], src, rect->left, w, h);
+    for (uint8_t c = 0; strip_ycc && c < 2; c++) {
+        uint8_t *csrc = src ? src + w * h + c * ((w + 1)/2) * ((h + 1)/2) : NULL;
+        rotate_mcu(&plane.rotate[1 + c], csrc, rect->left/2, (w + 1)/2, (h + 1)/2);
+    }
+
+    /* strip columns when the band of the MCU row is complete */
+    if (rect->right >= (jd->crop.right >> jd->scale)) {
+        rotate_rows(&plane.rotate[0], rect->top, h);
+        for (uint8_t c = 0; strip_ycc && c < 2; c++) rotate_rows(&plane.rotate[1 + c], rect->top/2, (h + 1)/2);
+    }
+
+    return 1;    /* Continue to decompress */
+}
+
+
+/* Rotator planes of the crop window of the image decoded at image_scale fitted to the mode raster, band rows
+ * and the decoder state index in the second half of image_buffer */
+static void rotate_init(JDEC* jd, bool index)
+{
+    uint8_t *band = image_buffer + sizeof(image_buffer)/2;
+    uint16_t x0 = jd->crop.left >> image_scale, y0 = jd->crop.top >> image_scale;
+    uint16_t x1 = jd->crop.right >> image_scale, y1 = jd->crop.bottom >> image_scale;
+    uint16_t rows = sstv_mode->height - (sstv_mode->header ? IMG_HEIGHT : 0);
+    uint16_t left = (image_width - rotate_w) / 2, top = (rows - rotate_h) / 2;
+    uint16_t cols = (jd->width + jd->msx * 8 - 1) / (jd->msx * 8), n = (jd->height + jd->msy * 8 - 1) / (jd->msy * 8);
+    uint16_t per_row = (sizeof(image_buffer)/2 - ROTATE_BAND_SIZE) / sizeof(JSTATE) / n;
+
+    /* last pixels of the scaled image, the clipped MCUs are rounded down */
+    if (x1 > (jd->width >> image_scale) - 1) x1 = (jd->width >> image_scale) - 1;
+    if (y1 > (jd->height >> image_scale) - 1) y1 = (jd->height >> image_scale) - 1;
+
+    for (uint8_t i = 0; i < 3; i++) {
+        ROTATE_PLANE *pl = &plane.rotate[i];
+        uint8_t sub = i ? 1 : 0; // chroma planes of half width and height
+        pl->bpp = strip_ycc ? 1 : 3;
+        pl->rows = IMG_HEIGHT >> sub;
+        pl->stride = (image_width >> sub) * pl->bpp;
+        pl->strip = i ? strip_fill + image_width * IMG_HEIGHT + (i - 1) * (image_width/2) * (IMG_HEIGHT/2) : strip_fill;
+        pl->band = i ? band + (IMG_HEIGHT + 1) * ROTATE_BAND + (i - 1) * (IMG_HEIGHT/2 + 1) * ROTATE_BAND : band;
+        pl->src_x = x0 >> sub;
+        pl->src_y = y0 >> sub;
+        pl->src_w = (x1 >> sub) - pl->src_x + 1;
+        pl->src_h = (y1 >> sub) - pl->src_y + 1;
+        pl->dst_x = left >> sub;
+        pl->dst_y = top >> sub;
+        pl->dst_w = ((left + rotate_w) >> sub) - pl->dst_x;
+        pl->dst_h = ((top + rotate_h) >> sub) - pl->dst_y;
+    }
+
+    /* index of the decoder states at every rotate_step MCU of the rows, as dense as the rest of the buffer allows;
+     * each pass decodes the rows from their start without it */
+    rotate_index = NULL;
+    if (index && per_row) {
+        rotate_step = (cols + per_row - 1) / per_row;
+        rotate_index = (JSTATE*)(band + ROTATE_BAND_SIZE);
+        memset(rotate_index, 0, n * ((cols + rotate_step - 1) / rotate_step) * sizeof(JSTATE));
+    }
+}
+
+
+/* Nearest source pixel on the other side of the output pixel o of 2x upscale, n source pixels */
+static uint16_t jpeg_upscale_near(uint16_t o, uint16_t n)
+{
+    if (o & 1) return (o/2 + 1 < n) ? o/2 + 1 : o/2;
+    return o ? o/2 - 1 : 0;
+}
+
+
+/* 2x bilinear upscale of w x h RGB888 image, output limited to rows h_max; pixel weights 9:3:3:1 */
+static void jpeg_upscale(const uint8_t *src, uint8_t *dst, uint16_t w, uint16_t h, uint16_t h_max)
+{
+    for (uint16_t y = 0; y < 2*h && y < h_max; y++) {
+        const uint8_t *r0 = src + (y/2) * w * 3;
+        const uint8_t *r1 = src + jpeg_upscale_near(y, h) * w * 3;
+        for (uint16_t x = 0; x < 2*w; x++) {
+            uint16_t i = (x/2) * 3, j = jpeg_upscale_near(x, w) * 3;
+            for (uint8_t c = 0; c < 3; c++, i++, j++) {
+                *dst++ = (9*r0[i] + 3*r0[j] + 3*r1[i] + r1[j] + 8) >> 4;
+            }
+        }
+    }
+}
+
+
+/* DC-only decode at 1/8 scale to the buffer, 40x30 preview of 320x240 image; false on error */
+static bool jpeg_preview(uint8_t *jpeg, uint8_t *buffer, uint16_t *width, uint16_t *height)
 {
-    /* prepare variables */
-    bool ok = true;
     JDEC jdec;
-    jpeg_data = jpeg;
-    jpeg_pos = 0;
+    jpeg_input(jpeg);
+    preview_buffer = buffer;
 
-    /* decompression */
-    if (ok && jd_prepare(&jdec, tjd_input, workspace, sizeof(workspace), NULL) != JDR_OK) ok = false;
-    if (ok && jdec.width != IMG_WIDTH) ok = false;
-    if (ok && jd_decomp(&jdec, tjd_thumbnail_output, 2) != JDR_OK) ok = false;
+    if (jd_prepare(&jdec, tjd_input, workspace, sizeof(workspace), NULL) != JDR_OK) return false;
+    if (jdec.width != IMG_WIDTH && jdec.width != IMG_WIDTH_MAX) return false;
+    if (jd_decomp(&jdec, tjd_preview_output, 3) != JDR_OK) return false;
+    *width = jdec.width >> 3;
+    *height = jdec.height >> 3;
+    return true;
+}
+
+
+/* 80x60 thumbnail: 1/8 scale preview, upscaled from 40x30 for 320 pixel wide images */
+bool jpeg_thumbnail(uint8_t *jpeg, uint8_t **thumbnail)
+{
+    uint16_t w, h;
+    uint8_t *preview = image_buffer + 80*60*3; // upscaled to the beginning of the buffer
+    bool ok = jpeg_preview(jpeg, preview, &w, &h);
+
+    if (ok && w == IMG_WIDTH/8) jpeg_upscale(preview, image_buffer, w, h, 60);
+    else if (ok) memcpy(image_buffer, preview, 80*60*3);
 
     if (thumbnail != NULL)
         *thumbnail = image_buffer;
@@ -111,28 +743,220 @@ bool jpeg_thumbnail(uint8_t *jpeg, uint8_t **thumbnail)
 }
 
 
+/* Rotated image decoded once per strip, the strips are sent when playing; false on error. The decoder outputs
+ * the column band of the strip, the MCU rows are resumed from the state index of the previous pass */
+static bool jpeg_rotate(uint8_t *jpeg, bool play, bool index, UINT *lost)
+{
+    JDEC jdec;
+    uint16_t rows = sstv_mode->height - (sstv_mode->header ? IMG_HEIGHT : 0);
+
+    *lost = 0;
+    for (uint16_t k = 0; k < (rows + IMG_HEIGHT - 1) / IMG_HEIGHT; k++) {
+        jpeg_input(jpeg);
+        if (jd_prepare(&jdec, tjd_input, workspace, sizeof(workspace), NULL) != JDR_OK) return false;
+        jdec.crop = image_crop;
+        if (k == 0) rotate_init(&jdec, index);
+        sstv_strip_clear(strip_fill);
+
+        /* decoder crop of the bands of all planes, the black borders of the strip are not decoded */
+        uint16_t lo = UINT16_MAX, hi = 0;
+        for (uint8_t i = 0; i < (strip_ycc ? 3 : 1); i++) {
+            ROTATE_PLANE *pl = &plane.rotate[i];
+            uint8_t sub = i ? 1 : 0; // chroma planes of half width and height
+            if (!rotate_band(pl, k)) continue;
+            if (pl->band_w > ROTATE_BAND) return false;
+            if ((pl->band_x << sub) < lo) lo = pl->band_x << sub;
+            if (((pl->band_x + pl->band_w) << sub) - 1 > hi) hi = ((pl->band_x + pl->band_w) << sub) - 1;
+        }
+        if (hi > (jdec.width >> image_scale) - 1) hi = (jdec.width >> image_scale) - 1;
+        if (lo <= hi) {
+            jdec.crop.left = lo << image_scale;
+            jdec.crop.right = ((hi + 1) << image_scale) - 1;
+            jdec.index = rotate_index;
+            jdec.istep = rotate_step;
+            jdec.ycc = strip_ycc;
+            if (jd_decomp(&jdec, tjd_rotate_output, image_scale) != JDR_OK) return false;
+            *lost += jdec.nlost;
+        }
+
+        if (play && !sstv_audio_callback(strip_fill, k + 1)) return false;
+    }
+    return true;
+}
+
+
 bool jpeg_decompress(uint8_t *jpeg)
 {
     /* prepare variables */
     bool ok = true;
+    UINT lost = 0;
     JDEC jdec;
-    jpeg_data = jpeg;
-    jpeg_pos = 0;
 
     /* decompression */
-    if (ok && jd_prepare(&jdec, tjd_input, workspace, sizeof(workspace), NULL) != JDR_OK) ok = false;
-    if (ok && jdec.width != IMG_WIDTH) ok = false;
-    if (ok && jd_decomp(&jdec, tjd_full_output, 0) != JDR_OK) ok = false;
+    if (image_rotate) {
+        ok = jpeg_rotate(jpeg, true, true, &lost);
+    }
+    else {
+        jpeg_input(jpeg);
+        if (ok && jd_prepare(&jdec, tjd_input, workspace, sizeof(workspace), NULL) != JDR_OK) ok = false;
+        if (ok && !image_resample && (jdec.width >> image_scale) != image_width) ok = false;
+        if (ok && image_resample) {
+            jdec.crop = image_crop;
+            resample_init(&jdec);
+        }
+        jdec.ycc = strip_ycc;
+        if (ok && jd_decomp(&jdec, image_resample ? tjd_resample_output : tjd_full_output, image_scale) != JDR_OK) ok = false;
+        if (ok) lost = jdec.nlost;
+    }
 
+    /* data errors are concealed and the image sent to the end, logged as well */
+    if (ok && lost) {
+        printf_debug("JPEG %u MCUs lost", lost);
+        ok = false;
+    }
     if (!ok) syslog_event(LOG_JPEG_ERROR);
 
     return true;
 }
 
 
+/* Image size from JPEG header, flash stream for NULL; false on error */
+static bool jpeg_get_size(uint8_t *jpeg, uint16_t *width, uint16_t *height)
+{
+    JDEC jdec;
+    jpeg_input(jpeg);
+    if (jd_prepare(&jdec, tjd_input, workspace, sizeof(workspace), NULL) != JDR_OK) return false;
+    *width = jdec.width;
+    *height = jdec.height;
+    return true;
+}
+
+
+/* User defined call-back function to discard the output, decoder benchmark */
+static UINT tjd_null_output(JDEC* jd, void* bitmap, JRECT* rect)
+{
+    HAL_IWDG_Refresh(&hiwdg); // seconds per image without turbo
+    return 1;
+}
+
+
+/* Decoding time in ms at the current clock, output discarded; 0 on error */
+uint32_t jpeg_benchmark(uint8_t *jpeg, uint8_t scale)
+{
+    JDEC jdec;
+    uint32_t start = HAL_GetTick();
+    jpeg_input(jpeg);
+
+    if (jd_prepare(&jdec, tjd_input, workspace, sizeof(workspace), NULL) != JDR_OK) return 0;
+    if (jd_decomp(&jdec, tjd_null_output, scale) != JDR_OK) return 0;
+    return HAL_GetTick() - start + 1;
+}
+
+
+/* Decoding time in ms of the image rotated clockwise to the strips of the mode, one pass per strip, not sent;
+ * 0 on error. Without the index, each pass huffman decodes the MCU rows from the start of the image again */
+uint32_t jpeg_benchmark_rotate(uint8_t *jpeg, uint8_t mode, bool index, uint16_t *passes)
+{
+    UINT lost;
+    uint32_t start = HAL_GetTick();
+
+    rotate_next = SSTV_ROTATE_CW;
+    if (!sstv_setup(jpeg, false, mode) || !image_rotate || !jpeg_rotate(jpeg, false, index, &lost)) return 0;
+    *passes = (sstv_mode->height - (sstv_mode->header ? IMG_HEIGHT : 0) + IMG_HEIGHT - 1) / IMG_HEIGHT;
+    return HAL_GetTick() - start + 1;
+}
+
+
+#define JPEG_WORD(__p)  (((uint16_t)(__p)[0] << 8) | (__p)[1])
+
+/* Structural check of the image without decoding, the segments are checked as jd_prepare() loads them:
+ * baseline Y/Cb/Cr 4:4:4, 4:2:2 or 4:2:0 of any size, tables used by the scan loaded,
+ * entropy coded data terminated by EOI within length */
+static bool jpeg_validate(const uint8_t *jpeg, uint32_t length)
+{
+    uint32_t pos = 2;
+    uint8_t qt = 0; // loaded quantization tables by ID
+    uint8_t ht = 0; // loaded huffman tables, bit 2*ID + class
+    uint8_t qtid[3] = { 0 };
+    bool sof = false;
+
+    if (length < 4 || length > IMG_BUFFER_SIZE || JPEG_WORD(jpeg) != 0xFFD8) return false;
+
+    for (;;) {
+        if (pos + 4 > length) return false;
+        uint16_t marker = JPEG_WORD(&jpeg[pos]);
+        uint16_t len = JPEG_WORD(&jpeg[pos + 2]);
+        const uint8_t *seg = &jpeg[pos + 4];
+        if ((marker >> 8) != 0xFF || len <= 2 || pos + 2 + len > length) return false;
+        len -= 2; // content size excluding length field
+        pos += 4 + len;
+        if (len > JD_SZBUF && (marker == 0xFFC0 || marker == 0xFFC4 || marker == 0xFFDB || marker == 0xFFDD || marker == 0xFFDA)) return false;
+
+        switch (marker & 0xFF) {
+            case 0xC0: // SOF0
+                if (len < 15 || seg[0] != 8 || seg[5] != 3) return false;
+                if (!JPEG_WORD(&seg[1]) || !JPEG_WORD(&seg[3])) return false;
+                for (uint8_t i = 0; i < 3; i++) {
+                    uint8_t b = seg[7 + 3*i]; // sampling factor
+                    if (i == 0 && b != 0x11 && b != 0x21 && b != 0x22) return false;
+                    if (i != 0 && b != 0x11) return false;
+                    qtid[i] = seg[8 + 3*i];
+                    if (qtid[i] > 3) return false;
+                }
+                sof = true;
+                break;
+            case 0xC4: // DHT, one or more tables
+                for (uint16_t i = 0, n; i < len; i += 17 + n) {
+                    if (i + 17 > len || (seg[i] & 0xEE)) return false; // class and ID 0 or 1
+                    n = 0;
+                    for (uint8_t k = 1; k <= 16; k++) n += seg[i + k];
+                    if (n > 256 || i + 17 + n > len) return false;
+                    ht |= 1 << ((seg[i] & 0x01) * 2 + (seg[i] >> 4));
+                }
+                break;
+            case 0xDB: // DQT, one or more 8-bit tables
+                if (len % 65) return false;
+                for (uint16_t i = 0; i < len; i += 65) {
+                    if (seg[i] & 0xF0) return false;
+                    qt |= 1 << (seg[i] & 0x03);
+                }
+                break;
+            case 0xDD: // DRI
+                if (len < 2) return false;
+                break;
+            case 0xDA: // SOS
+                if (!sof || len < 7 || seg[0] != 3) return false;
+                for (uint8_t i = 0; i < 3; i++) {
+                    uint8_t b = seg[2 + 2*i]; // DC and AC table ID
+                    uint8_t id = i ? 1 : 0;
+                    if (b != 0x00 && b != 0x11) return false;
+                    if ((ht & (0x03 << (2*id))) != (0x03 << (2*id)) || !(qt & (1 << qtid[i]))) return false;
+                }
+                /* entropy coded data: only stuffed zeros, restart markers and fill bytes up to EOI */
+                for (;;) {
+                    const uint8_t *p = memchr(&jpeg[pos], 0xFF, length - pos);
+                    if (p == NULL || p + 1 >= jpeg + length) return false;
+                    pos = p - jpeg + 1;
+                    if (jpeg[pos] == 0x00 || (jpeg[pos] >= 0xD0 && jpeg[pos] <= 0xD7)) pos++;
+                    else if (jpeg[pos] != 0xFF) return jpeg[pos] == 0xD9; // the first other marker ends the image
+                }
+            case 0xC1: case 0xC2: case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+            case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+            case 0xD8: case 0xD9:
+                return false; // not supported by the decoder or misplaced
+            default: // APPn, COM and other segments are skipped
+                break;
+        }
+    }
+}
+
+
 bool jpeg_test(uint8_t *jpeg, uint32_t length)
 {
-    return jpeg_thumbnail(jpeg, NULL);
+    bool ok = jpeg_validate(jpeg, length);
+    if (!ok) syslog_event(LOG_JPEG_ERROR);
+
+    return ok;
 }
 
 
@@ -140,35 +964,53 @@ static bool sstv_thumbnails(void)
 {
     uint16_t ram_offset = 0;
     uint16_t flash_offset;
+    uint16_t line = 0;
+    uint8_t step = 1 << image_scale; // every other pixel and line in 160-pixel modes
 
     for (uint8_t row = 0; row < 4; row++) {
         flash_offset = 0; // thumbnail has a zero offset
-        for (uint8_t y = 0; y < 60; y++) {
+        for (uint8_t y = 0; y < 60; y++, flash_offset += 80*3) {
+            if (y % step) continue;
             for (uint8_t col = 0; col < 4; col++) {
-                flash_read(ADDR_THUMBNAIL(row*4 + col) + flash_offset, &image_buffer[ram_offset], 80*3);
-                ram_offset += 80*3;
+                flash_read(ADDR_THUMBNAIL(row*4 + col) + flash_offset, &strip_fill[ram_offset], 80*3);
+                for (uint8_t x = 1; x < 80/step; x++) {
+                    memcpy(&strip_fill[ram_offset + x*3], &strip_fill[ram_offset + x*step*3], 3);
+                }
+                sstv_strip_pump();
+                ram_offset += 80/step*3;
             }
-            flash_offset += 80*3;
 
-            uint16_t line = row*60+y;
+            line = (row*60 + y) / step;
             if (line % IMG_HEIGHT == IMG_HEIGHT-1) {
                 /* decompression block buffer is full */
-                if (!sstv_audio_callback(image_buffer, line / IMG_HEIGHT + 1)) return false;
+                if (!sstv_audio_callback(strip_fill, line / IMG_HEIGHT + 1)) return false;
                 ram_offset = 0;
             }
         }
     }
+
+    /* last partial block of 120-line modes */
+    if (ram_offset) return sstv_audio_callback(strip_fill, line / IMG_HEIGHT + 1);
     return true;
 }
 
 
-static void sstv_do_overlay(uint8_t *s, uint32_t color, uint8_t zoom, uint8_t part)
+/* Text overlay in IMG_WIDTH wide area starting at column left, clipped to the image width */
+static void sstv_do_overlay(uint8_t *buffer, uint8_t *s, uint32_t color, uint8_t zoom, uint8_t part, int16_t left)
 {
     uint16_t h = Font8x13B[15]; /* Font size: height */
     uint16_t w = Font8x13B[14]; /* Font size: width */
-    uint16_t x = 3; /* X offset */
+    int16_t x = left + 3; /* X offset */
+    uint8_t *cb = buffer + image_width*IMG_HEIGHT; /* YCbCr strip: chroma planes */
+    uint8_t *cr = cb + (image_width/2)*(IMG_HEIGHT/2);
+    int16_t r = (color >> 16) & 0xFF, g = (color >> 8) & 0xFF, b = color & 0xFF;
+    uint8_t ycc[3] = { /* JFIF colour conversion of the text colour for YCbCr strips */
+        (77*r + 150*g + 29*b) >> 8,
+        128 + ((-43*r - 85*g + 128*b) >> 8),
+        128 + ((128*r - 107*g - 21*b) >> 8),
+    };
 
-    while (x <= IMG_WIDTH - w*zoom) {
+    while (x <= left + IMG_WIDTH - w*zoom) {
         uint8_t chr = *s++; /* Load character */
 
         if (chr >= 31 && chr <= 127) {
@@ -180,16 +1022,30 @@ static void sstv_do_overlay(uint8_t *s, uint32_t color, uint8_t zoom, uint8_t pa
                 if (chr_line < h) { /* Is current line mapped in font face? */
                     uint8_t d = fnt[chr_line]; /* Get next 8 horizontal dots */
                     for (uint16_t j = 0; j < w*zoom; j++) { /* Go through X axis */
-                        uint16_t idx = i*IMG_WIDTH + (x+j);
-                        if (zoom == 1) idx += IMG_WIDTH; /* No zoom -> shift line by 1px down */
-                        if (d & 0x80) { /* color */
-                            image_buffer[idx*3+0] = (color >> 16) & 0xFF;
-                            image_buffer[idx*3+1] = (color >> 8) & 0xFF;
-                            image_buffer[idx*3+2] = (color >> 0) & 0xFF;
-                        } else { /* lower brightness */
-                            image_buffer[idx*3+0] >>= 1;
-                            image_buffer[idx*3+1] >>= 1;
-                            image_buffer[idx*3+2] >>= 1;
+                        if (x+j >= 0 && x+j < image_width) { /* Is the dot inside the image? */
+                            uint16_t row = (zoom == 1) ? i + 1 : i; /* No zoom -> shift line by 1px down */
+                            uint16_t idx = row*image_width + (x+j);
+                            if (strip_ycc) {
+                                /* chroma of a 2x2 square follows its top left pixel */
+                                uint16_t cidx = (row/2)*(image_width/2) + (x+j)/2;
+                                bool sub = !(row & 1) && !((x+j) & 1);
+                                if (d & 0x80) { /* color */
+                                    buffer[idx] = ycc[0];
+                                    if (sub) { cb[cidx] = ycc[1]; cr[cidx] = ycc[2]; }
+                                } else { /* lower brightness and saturation */
+                                    buffer[idx] >>= 1;
+                                    if (sub) { cb[cidx] = 64 + (cb[cidx] >> 1); cr[cidx] = 64 + (cr[cidx] >> 1); }
+                                }
+                            }
+                            else if (d & 0x80) { /* color */
+                                buffer[idx*3+0] = (color >> 16) & 0xFF;
+                                buffer[idx*3+1] = (color >> 8) & 0xFF;
+                                buffer[idx*3+2] = (color >> 0) & 0xFF;
+                            } else { /* lower brightness */
+                                buffer[idx*3+0] >>= 1;
+                                buffer[idx*3+1] >>= 1;
+                                buffer[idx*3+2] >>= 1;
+                            }
                         }
                         if (j % zoom == zoom - 1) d <<= 1; /* Next horizontal bit */
                     }
@@ -201,79 +1057,286 @@ static void sstv_do_overlay(uint8_t *s, uint32_t color, uint8_t zoom, uint8_t pa
 }
 
 
-static bool sstv_audio_callback(uint8_t *buffer, uint8_t line)
+/* Sends rows of the strip being played from its next unsent row */
+static void sstv_strip_send(uint8_t rows)
+{
+    if (strip_ycc) audio_sstv_scan_ycc(sstv_mode, strip_play, strip_line, rows);
+    else audio_sstv_scan(sstv_mode, strip_play + image_width * strip_line * 3, rows);
+    strip_line += rows;
+    strip_rows -= rows;
+}
+
+
+/* Sends the sequences of the strip being played that fit the audio queues without waiting */
+static void sstv_strip_pump(void)
 {
-    // modes with 15 text lines
-    if (sstv_mode == 36 || sstv_mode == 72) {
-        // overlay basic white chars, no zoom
-        if (line == 1) sstv_do_overlay(text_buffer[OVERLAY_HEADER], 0xFFFFFF, 1, 0);
-        if (line == 15) sstv_do_overlay(text_buffer[OVERLAY_IMG], 0xFFFFFF, 1, 0);
+    while (strip_rows && audio_sstv_ready(sstv_mode)) {
+        sstv_strip_send((strip_rows > sstv_mode->lines) ? sstv_mode->lines : strip_rows);
+    }
+}
 
-        // overlay up to 13 yellow chars on lines 3-5, zoom 3x
-        if (line == 3 || line == 4 || line == 5) sstv_do_overlay(text_buffer[OVERLAY_LARGE], 0xFFFF00, 3, line-3);
 
-        // overlay up to 19 red chars on lines 14-15, zoom 2x
-        if (line == 14 || line == 15) sstv_do_overlay(text_buffer[OVERLAY_FROM], 0xFF4040, 2, line-14);
+/* Sends the rest of the strip being played */
+static void sstv_strip_flush(void)
+{
+    if (strip_rows) sstv_strip_send(strip_rows);
+}
+
+
+/* Black strip */
+static void sstv_strip_clear(uint8_t *buffer)
+{
+    if (strip_ycc) {
+        memset(buffer, 0, image_width*IMG_HEIGHT);
+        memset(buffer + image_width*IMG_HEIGHT, 128, IMG_STRIP_YCC(image_width) - image_width*IMG_HEIGHT);
     }
-    // modes with 16 text lines
-    else if (sstv_mode == 73 || sstv_mode == 115) {
-        // overlay basic white chars, no zoom
-        if (line == 0) sstv_do_overlay(text_buffer[OVERLAY_HEADER], 0xFFFFFF, 1, 0);
-        if (line == 15) sstv_do_overlay(text_buffer[OVERLAY_IMG], 0xFFFFFF, 1, 0);
+    else memset(buffer, 0, IMG_STRIP_RGB(image_width));
+}
 
-        // overlay up to 13 yellow chars on lines 2-4, zoom 3x
-        if (line == 2 || line == 3 || line == 4) sstv_do_overlay(text_buffer[OVERLAY_LARGE], 0xFFFF00, 3, line-2);
 
-        // overlay up to 19 red chars on lines 14-15, zoom 2x
-        if (line == 14 || line == 15) sstv_do_overlay(text_buffer[OVERLAY_FROM], 0xFF4040, 2, line-14);
+/* Decoded strip is played after the previous one, the decoder continues to the other strip meanwhile */
+static void sstv_strip_queue(uint8_t *buffer, uint8_t rows)
+{
+    // slack: audio queued and not sent yet when the strip is ready, underrun if the decoder falls behind
+    uint32_t slack = audio_get_pending() + strip_rows / sstv_mode->lines * sstv_seq_us(sstv_mode) / 1000;
+    if (slack / 10 < strip_slack) strip_slack = slack / 10;
+
+    sstv_strip_flush();
+    strip_play = buffer;
+    strip_line = 0;
+    strip_rows = rows;
+    if (strip_double) {
+        strip_fill = (buffer == image_buffer) ? image_buffer + sizeof(image_buffer)/2 : image_buffer;
     }
+    else {
+        sstv_strip_flush(); // single strip buffer, played before the decoder continues
+    }
+}
+
+
+static bool sstv_audio_callback(uint8_t *buffer, uint8_t line)
+{
+    uint8_t last = sstv_last_row;
+    uint16_t top = (sstv_mode->header ? line : line - 1) * IMG_HEIGHT; // first transmitted line of the block
+    uint8_t rows = IMG_HEIGHT;
+
+    // the last block of 120-line modes is partial
+    if (top < sstv_mode->height && top + IMG_HEIGHT > sstv_mode->height) rows = sstv_mode->height - top;
+
+    // overlay basic white chars, no zoom
+    if (line == sstv_mode->ovl_header) sstv_do_overlay(buffer, text_buffer[OVERLAY_HEADER], 0xFFFFFF, 1, 0, 0);
+    if (line == last) sstv_do_overlay(buffer, text_buffer[OVERLAY_IMG], 0xFFFFFF, 1, 0, 0);
+
+    // overlay up to 13 yellow chars on 3 lines, zoom 3x
+    if (line >= sstv_mode->ovl_large && line < sstv_mode->ovl_large + 3) sstv_do_overlay(buffer, text_buffer[OVERLAY_LARGE], 0xFFFF00, 3, line - sstv_mode->ovl_large, 0);
+
+    // overlay up to 19 red chars on last 2 lines, zoom 2x, right aligned
+    if (line == last - 1 || line == last) sstv_do_overlay(buffer, text_buffer[OVERLAY_FROM], 0xFF4040, 2, line - (last - 1), (int16_t)image_width - IMG_WIDTH);
 
     // send audio block
-    if (sstv_mode == 36) audio_robot36_color(buffer);
-    else if (sstv_mode == 72) audio_robot72_color(buffer);
-    else if (sstv_mode == 73) audio_mp73(buffer);
-    else if (sstv_mode == 115) audio_mp115(buffer);
+    sstv_strip_queue(buffer, rows);
 
     return true; // continue
 }
 
 
-bool sstv_play_jpeg(uint8_t* jpeg, uint8_t mode)
+/* Mode descriptor, defaults to Robot36 for unknown modes */
+const SSTV_MODE *sstv_get_mode(uint8_t mode)
+{
+    for (uint8_t i = 0; i < sizeof(sstv_modes)/sizeof(sstv_modes[0]); i++) {
+        if (sstv_modes[i].mode == mode) return &sstv_modes[i];
+    }
+    return &sstv_modes[0];
+}
+
+
+/* Transmission time of the mode in ms, incl. VOX tones and VIS code */
+uint32_t sstv_get_duration(uint8_t mode)
+{
+    const SSTV_MODE *m = sstv_get_mode(mode);
+
+    return (AUDIO_VOX_US + AUDIO_VIS_US(m->vis_bits) + m->start_us + sstv_seq_us(m) * (m->height / m->lines)) / 1000;
+}
+
+
+/* Mode for a TX slot: the requested mode if it fits, otherwise the longest mode of the same
+ * or smaller width that fits, 0 if none does */
+uint8_t sstv_fit_mode(uint8_t mode, uint32_t slot_ms)
+{
+    const SSTV_MODE *req = sstv_get_mode(mode);
+    uint8_t fit = 0;
+    uint32_t fit_ms = 0;
+
+    if (sstv_get_duration(req->mode) <= slot_ms) return req->mode;
+    for (uint8_t i = 0; i < sizeof(sstv_modes)/sizeof(sstv_modes[0]); i++) {
+        uint32_t ms = sstv_get_duration(sstv_modes[i].mode);
+        if (sstv_modes[i].width <= req->width && ms <= slot_ms && ms > fit_ms) {
+            fit = sstv_modes[i].mode;
+            fit_ms = ms;
+        }
+    }
+    return fit;
+}
+
+
+/* Mode raster, decoder scale, zoom window, rotation and strips of the transmission of the image in RAM, the image
+ * streamed from flash for NULL, or the flash thumbnails; false on error */
+static bool sstv_setup(uint8_t* jpeg, bool thumbnails, uint8_t mode)
 {
-    bool ok = true;
-    
     /* check valid SSTV mode, default to Robot36 */
-    if (mode == 72 || mode == 73 || mode == 115) sstv_mode = mode;
-    else sstv_mode = 36;
+    sstv_mode = sstv_get_mode(mode);
+    image_width = sstv_mode->width;
+    sstv_last_row = (sstv_mode->height - (sstv_mode->header ? IMG_HEIGHT : 0)) / IMG_HEIGHT;
+
+    /* zoom window and rotation of this transmission, the decoder skips the MCUs outside */
+    uint8_t zoom = thumbnails ? 0 : crop_zoom;
+    uint16_t width = IMG_WIDTH, height = IMG_WIDTH;
+    image_rotate = thumbnails ? 0 : rotate_next;
+    crop_zoom = 0;
+    rotate_next = 0;
+    if (!thumbnails && (!jpeg_get_size(jpeg, &width, &height) || !width || !height)) {
+        image_scale = 0;
+        syslog_event(LOG_JPEG_ERROR);
+        return false;
+    }
+    image_crop.left = 0; image_crop.right = width - 1;
+    image_crop.top = 0; image_crop.bottom = height - 1;
+    bool window = (zoom > 1 && width / zoom && height / zoom);
+    if (window) {
+        uint16_t w = width / zoom, h = height / zoom;
+        int32_t left = (int32_t)crop_x * width / 100 - w / 2, top = (int32_t)crop_y * height / 100 - h / 2;
+        image_crop.left = (left < 0) ? 0 : (left > width - w) ? width - w : left;
+        image_crop.top = (top < 0) ? 0 : (top > height - h) ? height - h : top;
+        image_crop.right = image_crop.left + w - 1;
+        image_crop.bottom = image_crop.top + h - 1;
+        width = w;
+        height = h;
+    }
+
+    /* image of the mode raster or its power of two multiple is downscaled by the decoder, other sizes and zoom
+     * windows are decoded at the smallest scale not narrower than the mode and resampled */
+    uint16_t rows = sstv_mode->height - (sstv_mode->header ? IMG_HEIGHT : 0);
+    for (image_scale = 0; image_scale <= 3 && (image_width << image_scale) != width; image_scale++);
+    image_resample = (image_scale > 3 || window || (!thumbnails && (height >> image_scale) != rows));
+    if (image_resample) {
+        for (image_scale = 0; image_scale < 3 && (width >> (image_scale + 1)) >= image_width; image_scale++);
+    }
+
+    /* rotated window fitted to the mode raster with black borders, decoded at the smallest scale not shorter than it */
+    if (image_rotate) {
+        if ((uint32_t)height * rows <= (uint32_t)width * image_width) {
+            rotate_w = (uint32_t)height * rows / width;
+            rotate_h = rows;
+        }
+        else {
+            rotate_w = image_width;
+            rotate_h = (uint32_t)width * image_width / height;
+        }
+        if (!rotate_w) rotate_w = 1;
+        if (!rotate_h) rotate_h = 1;
+        for (image_scale = 0; image_scale < 3 && (width >> (image_scale + 1)) >= rotate_h; image_scale++);
+        image_resample = false;
+    }
+
+    /* YCbCr strips from the decoder for modes without RGB scans, thumbnails are stored as RGB */
+    strip_ycc = (!thumbnails && image_scale < 3);
+    for (const SSTV_SEGMENT *seg = sstv_mode->seq; seg->us; seg++) {
+        if (seg->scan == SSTV_RED || seg->scan == SSTV_GREEN || seg->scan == SSTV_BLUE) strip_ycc = false;
+    }
+
+    strip_fill = image_buffer;
+    strip_rows = 0;
+    strip_double = 2 * (strip_ycc ? IMG_STRIP_YCC(image_width) : IMG_STRIP_RGB(image_width)) <= sizeof(image_buffer);
+    strip_slack = UINT16_MAX;
+
+    /* resampler and rotator: the second strip holds the MCU row or the band, not available for 640 pixel RGB strips;
+     * one strip is decoded while the line pool and the queue are played, 550ms for Robot36 (sstv_get_slack()) */
+    if ((image_resample || image_rotate) && !strip_double) {
+        syslog_event(LOG_JPEG_ERROR);
+        return false;
+    }
+    if (image_resample || image_rotate) strip_double = false;
+    return true;
+}
+
+
+/* Sends the image in RAM, the image streamed from flash for NULL, or the flash thumbnails */
+static bool sstv_play(uint8_t* jpeg, bool thumbnails, uint8_t mode)
+{
+    bool ok = true;
+
+    if (!sstv_setup(jpeg, thumbnails, mode)) return false;
 
     audio_start();
     audio_play_vox_start();
-    if (sstv_mode == 36) audio_play_vis(0x88); // Robot36
-    else if (sstv_mode == 72) audio_play_vis(0x0C); // Robot72
-    else if (sstv_mode == 73) audio_play_vis16(0x2523); // MP73
-    else if (sstv_mode == 115) audio_play_vis16(0x2923); // MP115
+    if (sstv_mode->vis_bits == 16) audio_play_vis16(sstv_mode->vis);
+    else audio_play_vis(sstv_mode->vis);
+    if (sstv_mode->start_us) audio_play_sync(sstv_mode->start_us);
 
-    if (sstv_mode == 73 || sstv_mode == 115) {
-        // black header on line 0 for MP modes
-        memset(image_buffer, 0, sizeof(image_buffer));
-        ok = sstv_audio_callback(image_buffer, 0);
+    if (sstv_mode->header) {
+        // black header on line 0 for 256-line and 496-line modes
+        sstv_strip_clear(strip_fill);
+        ok = sstv_audio_callback(strip_fill, 0);
     }
 
-    if (ok && jpeg != NULL) {
+    if (ok && !thumbnails) {
         ok = jpeg_decompress(jpeg);
     }
-    else if (ok && jpeg == NULL) {
+    else if (ok && thumbnails) {
         ok = sstv_thumbnails();
     }
+    sstv_strip_flush();
     audio_play_vox_stop();
     audio_stop();
     return ok;
 }
 
 
+bool sstv_play_jpeg(uint8_t* jpeg, uint8_t mode)
+{
+    return sstv_play(jpeg, jpeg == NULL, mode);
+}
+
+
+/* Image decoded while read from flash, no copy in RAM; decoding starts with the first prefetched block */
+bool sstv_play_flash(uint8_t sector, uint32_t length, uint8_t mode)
+{
+    jpeg_flash = sector;
+    jpeg_len = (length < ((uint32_t)HIRES_MAX_IMAGES << 16)) ? length : ((uint32_t)HIRES_MAX_IMAGES << 16);
+    bool ok = sstv_play(NULL, false, mode);
+    flash_stream_close();
+    return ok;
+}
+
+
 bool sstv_play_thumbnail(uint8_t mode)
 {
-    return sstv_play_jpeg(NULL, mode);
+    return sstv_play(NULL, true, mode);
+}
+
+
+/* Worst audio slack of the last transmission in 10ms units, time left to decode a strip before an underrun */
+uint16_t sstv_get_slack(void)
+{
+    return strip_slack;
+}
+
+
+/* Zoom of the next transmitted image: window of 1/zoom of the image size centred at x, y percent of the image,
+ * resampled to the mode raster; zoom 0 or 1 for the whole image */
+void sstv_set_zoom(uint8_t zoom, uint8_t x, uint8_t y)
+{
+    crop_zoom = zoom;
+    crop_x = (x > 100) ? 100 : x;
+    crop_y = (y > 100) ? 100 : y;
+}
+
+
+/* Rotation of the next transmitted image by 90 degrees for portrait modules: SSTV_ROTATE_CW or SSTV_ROTATE_CCW,
+ * fitted to the mode raster with black borders; SSTV_ROTATE_NONE for the image as is */
+void sstv_set_rotate(uint8_t rotate)
+{
+    rotate_next = (rotate == SSTV_ROTATE_CW || rotate == SSTV_ROTATE_CCW) ? rotate : SSTV_ROTATE_NONE;
 }
 
 
@@ -282,22 +1345,25 @@ void sstv_set_overlay(uint8_t line, const char *overlay)
     char s[TEXT_LEN];
 
     if (overlay == NULL) s[0] = '\0';
-    else strncpy(s, overlay, TEXT_LEN);
+    else {
+        strncpy(s, overlay, TEXT_LEN - 1);
+        s[TEXT_LEN - 1] = '\0';
+    }
 
     switch (line) {
         case OVERLAY_HEADER:
         case OVERLAY_IMG:
-            if (strlen(overlay) > TEXT_Z1_WIDTH) s[TEXT_Z1_WIDTH] = '\0';
+            if (strlen(s) > TEXT_Z1_WIDTH) s[TEXT_Z1_WIDTH] = '\0';
             memset(text_buffer[line], 0x00, TEXT_Z1_WIDTH);
             strcpy(text_buffer[line], s);
             break;
         case OVERLAY_LARGE:
-            if (strlen(overlay) > TEXT_Z3_WIDTH) s[TEXT_Z3_WIDTH] = '\0';
+            if (strlen(s) > TEXT_Z3_WIDTH) s[TEXT_Z3_WIDTH] = '\0';
             memset(text_buffer[line], 0x00, TEXT_Z3_WIDTH);
             strcpy(text_buffer[line], s);
             break;
         case OVERLAY_FROM:
-            if (strlen(overlay) > TEXT_Z2_WIDTH) s[TEXT_Z2_WIDTH] = '\0';
+            if (strlen(s) > TEXT_Z2_WIDTH) s[TEXT_Z2_WIDTH] = '\0';
             memset(text_buffer[line], 0xFF, TEXT_Z2_WIDTH); // blanks for right alignment
             strcpy(text_buffer[line] + (TEXT_Z2_WIDTH-strlen(s)), s);
             break;
@@ -33,6 +33,7 @@
   */
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f4xx_hal.h"
+#include "cube.h"
 
 extern DMA_HandleTypeDef hdma_dac2;
 
@@ -195,8 +196,13 @@ void HAL_DAC_MspInit(DAC_HandleTypeDef* hdac)
     hdma_dac2.Init.Direction = DMA_MEMORY_TO_PERIPH;
     hdma_dac2.Init.PeriphInc = DMA_PINC_DISABLE;
     hdma_dac2.Init.MemInc = DMA_MINC_ENABLE;
+#if ENABLE_DAC_12BIT
+    hdma_dac2.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+    hdma_dac2.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+#else
     hdma_dac2.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
     hdma_dac2.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+#endif
     hdma_dac2.Init.Mode = DMA_CIRCULAR;
     hdma_dac2.Init.Priority = DMA_PRIORITY_HIGH;
     hdma_dac2.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
@@ -16,6 +16,7 @@
 / Oct 04,'11 R0.01  First release.
 / Feb 19,'12 R0.01a Fixed decompression fails when scan starts with an escape seq.
 / Sep 03,'12 R0.01b Added JD_TBLCLIP option.
+/           SatCam: bit stream shift register and JD_HUFFLUT fast lookup tables.
 /----------------------------------------------------------------------------*/
 
 #include "tjpgd.h"
@@ -245,6 +246,91 @@ UINT create_huffman_tbl (	/* 0:OK, !0:Failed */
 
 
 
+#if JD_HUFFLUT
+/*-----------------------------------------------------------------------*/
+/* Create a huffman fast lookup table in the rest of the memory pool     */
+/*-----------------------------------------------------------------------*/
+
+static
+void create_huffman_lut (
+	JDEC* jd,		/* Pointer to the decompressor object */
+	UINT id,		/* Table number 0/1 */
+	UINT cls		/* Class dc(0)/ac(1) */
+)
+{
+	UINT i, j, k, l, nd;
+	const BYTE *hb = jd->huffbits[id][cls];
+	const WORD *hc = jd->huffcode[id][cls];
+	BYTE *lut;
+
+
+	lut = alloc_pool(jd, 1 << JD_HUFFLUT);	/* Allocate the table if the pool has room */
+	if (!lut) return;						/* The codes are searched by length */
+	for (i = 0; i < (1 << JD_HUFFLUT); i++) lut[i] = 0xFF;	/* Not in the table */
+
+	/* Entry of each code of 2 to JD_HUFFLUT bits: (length - 2) << 5 | index of the code, index 0 to 30 */
+	for (k = 0, l = 1; l <= JD_HUFFLUT; l++) {
+		for (nd = hb[l - 1]; nd; nd--, k++) {
+			if (l < 2 || k > 30 || (hc[k] >> l)) continue;	/* Left to the search (or invalid code) */
+			j = hc[k] << (JD_HUFFLUT - l);			/* All table entries starting with the code */
+			for (i = 0; i < (1U << (JD_HUFFLUT - l)); i++) lut[j + i] = (BYTE)(((l - 2) << 5) | k);
+		}
+	}
+	jd->hufflut[id][cls] = lut;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Fill the bit stream shift register up to the next marker              */
+/*-----------------------------------------------------------------------*/
+
+static
+INT fill_wreg (	/* 0:OK, <0: error code */
+	JDEC* jd	/* Pointer to the decompressor object */
+)
+{
+	BYTE d, *dp;
+	UINT dc, n, f;
+	DWORD w;
+
+
+	w = jd->wreg; n = jd->dbit; dc = jd->dctr; dp = jd->dptr;	/* Register, number of data available, read ptr */
+	f = 0;
+	while (n <= 24 && !jd->marker) {
+		if (!dc) {			/* No input data is available, re-fill input buffer */
+			dp = jd->inbuf;	/* Top of input buffer */
+			dc = jd->infunc(jd, dp, JD_SZBUF);
+			if (!dc) return 0 - (INT)JDR_INP;	/* Err: read error or wrong stream termination */
+			jd->nread += dc;
+		} else {
+			dp++;			/* Next data ptr */
+		}
+		dc--;				/* Decrement number of available bytes */
+		d = *dp;
+		if (f) {			/* In flag sequence? */
+			f = 0;			/* Exit flag sequence */
+			if (d != 0) {	/* Marker, the data before it are in the register */
+				jd->marker = d;
+				break;
+			}
+			d = 0xFF;		/* The flag is a data 0xFF */
+		} else if (d == 0xFF) {	/* Is start of flag sequence? */
+			f = 1; continue;	/* Enter flag sequence, get trailing byte */
+		}
+		w |= (DWORD)d << (24 - n);	/* Append the byte */
+		n += 8;
+	}
+	jd->wreg = w; jd->dbit = n; jd->dctr = dc; jd->dptr = dp;
+
+	return 0;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Extract N bits from input stream                                      */
 /*-----------------------------------------------------------------------*/
@@ -252,43 +338,21 @@ UINT create_huffman_tbl (	/* 0:OK, !0:Failed */
 static
 INT bitext (	/* >=0: extracted data, <0: error code */
 	JDEC* jd,	/* Pointer to the decompressor object */
-	UINT nbit	/* Number of bits to extract (1 to 11) */
+	UINT nbit	/* Number of bits to extract (1 to 16) */
 )
 {
-	BYTE msk, s, *dp;
-	UINT dc, v, f;
+	UINT v;
+	INT e;
 
 
-	msk = jd->dmsk; dc = jd->dctr; dp = jd->dptr;	/* Bit mask, number of data available, read ptr */
-	s = *dp; v = f = 0;
-	do {
-		if (!msk) {				/* Next byte? */
-			if (!dc) {			/* No input data is available, re-fill input buffer */
-				dp = jd->inbuf;	/* Top of input buffer */
-				dc = jd->infunc(jd, dp, JD_SZBUF);
-				if (!dc) return 0 - (INT)JDR_INP;	/* Err: read error or wrong stream termination */
-			} else {
-				dp++;			/* Next data ptr */
-			}
-			dc--;				/* Decrement number of available bytes */
-			if (f) {			/* In flag sequence? */
-				f = 0;			/* Exit flag sequence */
-				if (*dp != 0) return 0 - (INT)JDR_FMT1;	/* Err: unexpected flag is detected (may be collapted data) */
-				*dp = s = 0xFF;			/* The flag is a data 0xFF */
-			} else {
-				s = *dp;				/* Get next data byte */
-				if (s == 0xFF) {		/* Is start of flag sequence? */
-					f = 1; continue;	/* Enter flag sequence */
-				}
-			}
-			msk = 0x80;		/* Read from MSB */
-		}
-		v <<= 1;	/* Get a bit */
-		if (s & msk) v++;
-		msk >>= 1;
-		nbit--;
-	} while (nbit);
-	jd->dmsk = msk; jd->dctr = dc; jd->dptr = dp;
+	if (jd->dbit < nbit) {
+		e = fill_wreg(jd);
+		if (e) return e;
+		if (jd->dbit < nbit) return 0 - (INT)JDR_FMT1;	/* Err: unexpected marker is detected (may be collapted data) */
+	}
+	v = jd->wreg >> (32 - nbit);	/* Get the bits */
+	jd->wreg <<= nbit;
+	jd->dbit -= nbit;
 
 	return (INT)v;
 }
@@ -305,52 +369,45 @@ INT huffext (			/* >=0: decoded data, <0: error code */
 	JDEC* jd,			/* Pointer to the decompressor object */
 	const BYTE* hbits,	/* Pointer to the bit distribution table */
 	const WORD* hcode,	/* Pointer to the code word table */
-	const BYTE* hdata	/* Pointer to the data table */
+	const BYTE* hdata,	/* Pointer to the data table */
+	const BYTE* hlut	/* Pointer to the fast lookup table (null:not available) */
 )
 {
-	BYTE msk, s, *dp;
-	UINT dc, v, f, bl, nd;
+	UINT v, bl, nd;
+	INT e;
 
 
-	msk = jd->dmsk; dc = jd->dctr; dp = jd->dptr;	/* Bit mask, number of data available, read ptr */
-	s = *dp; v = f = 0;
-	bl = 16;	/* Max code length */
-	do {
-		if (!msk) {		/* Next byte? */
-			if (!dc) {	/* No input data is available, re-fill input buffer */
-				dp = jd->inbuf;	/* Top of input buffer */
-				dc = jd->infunc(jd, dp, JD_SZBUF);
-				if (!dc) return 0 - (INT)JDR_INP;	/* Err: read error or wrong stream termination */
-			} else {
-				dp++;	/* Next data ptr */
-			}
-			dc--;		/* Decrement number of available bytes */
-			if (f) {		/* In flag sequence? */
-				f = 0;		/* Exit flag sequence */
-				if (*dp != 0)
-					return 0 - (INT)JDR_FMT1;	/* Err: unexpected flag is detected (may be collapted data) */
-				*dp = s = 0xFF;			/* The flag is a data 0xFF */
-			} else {
-				s = *dp;				/* Get next data byte */
-				if (s == 0xFF) {		/* Is start of flag sequence? */
-					f = 1; continue;	/* Enter flag sequence, get trailing byte */
-				}
-			}
-			msk = 0x80;		/* Read from MSB */
+	if (jd->dbit < 16) {	/* Max code length in the register unless a marker follows */
+		e = fill_wreg(jd);
+		if (e) return e;
+	}
+
+#if JD_HUFFLUT
+	if (hlut) {
+		v = hlut[jd->wreg >> (32 - JD_HUFFLUT)];	/* Look up the leading bits */
+		if (v != 0xFF) {
+			bl = (v >> 5) + 2;					/* Code length */
+			if (bl > jd->dbit) return 0 - (INT)JDR_FMT1;	/* Err: code runs into a marker (may be collapted data) */
+			jd->wreg <<= bl;
+			jd->dbit -= bl;
+			return hdata[v & 0x1F];				/* Return the decoded data */
 		}
-		v <<= 1;	/* Get a bit */
-		if (s & msk) v++;
-		msk >>= 1;
-
-		for (nd = *hbits++; nd; nd--) {	/* Search the code word in this bit length */
-			if (v == *hcode++) {		/* Matched? */
-				jd->dmsk = msk; jd->dctr = dc; jd->dptr = dp;
-				return *hdata;			/* Return the decoded data */
+	}
+#endif
+
+	for (bl = 1; bl <= 16; bl++) {	/* Codes of each length are consecutive numbers */
+		nd = *hbits++;
+		if (nd) {
+			v = (jd->wreg >> (32 - bl)) - *hcode;	/* Offset from the first code of this length */
+			if (v < nd) {						/* Matched? */
+				if (bl > jd->dbit) break;		/* Err: code runs into a marker */
+				jd->wreg <<= bl;
+				jd->dbit -= bl;
+				return hdata[v];				/* Return the decoded data */
 			}
-			hdata++;
+			hcode += nd; hdata += nd;
 		}
-		bl--;
-	} while (bl);
+	}
 
 	return 0 - (INT)JDR_FMT1;	/* Err: code not found (may be collapted data) */
 }
@@ -375,6 +432,13 @@ void block_idct (
 
 	/* Process columns */
 	for (i = 0; i < 8; i++) {
+		if (!(src[8 * 1] | src[8 * 2] | src[8 * 3] | src[8 * 4] | src[8 * 5] | src[8 * 6] | src[8 * 7])) {
+			v0 = src[8 * 0];	/* No AC elements in the column, all outputs equal the DC element */
+			src[8 * 1] = src[8 * 2] = src[8 * 3] = src[8 * 4] = src[8 * 5] = src[8 * 6] = src[8 * 7] = v0;
+			src++;	/* Next column */
+			continue;
+		}
+
 		v0 = src[8 * 0];	/* Get even elements */
 		v1 = src[8 * 2];
 		v2 = src[8 * 4];
@@ -423,6 +487,13 @@ void block_idct (
 	src -= 8;
 	for (i = 0; i < 8; i++) {
 		v0 = src[0] + (128L << 8);	/* Get even elements (remove DC offset (-128) here) */
+		if (!(src[1] | src[2] | src[3] | src[4] | src[5] | src[6] | src[7])) {
+			v0 = BYTECLIP(v0 >> 8);	/* No AC elements in the row, output the DC element */
+			dst[0] = dst[1] = dst[2] = dst[3] = dst[4] = dst[5] = dst[6] = dst[7] = (BYTE)v0;
+			dst += 8;
+			src += 8;	/* Next row */
+			continue;
+		}
 		v1 = src[2];
 		v2 = src[4];
 		v3 = src[6];
@@ -481,10 +552,10 @@ JRESULT mcu_load (
 )
 {
 	LONG *tmp = (LONG*)jd->workbuf;	/* Block working buffer for de-quantize and IDCT */
-	UINT blk, nby, nbc, i, z, id, cmp;
+	UINT blk, nby, nbc, i, z, id, cmp, ac;
 	INT b, d, e;
 	BYTE *bp;
-	const BYTE *hb, *hd;
+	const BYTE *hb, *hd, *hl;
 	const WORD *hc;
 	const LONG *dqf;
 
@@ -501,7 +572,8 @@ JRESULT mcu_load (
 		hb = jd->huffbits[id][0];				/* Huffman table for the DC element */
 		hc = jd->huffcode[id][0];
 		hd = jd->huffdata[id][0];
-		b = huffext(jd, hb, hc, hd);			/* Extract a huffman coded data (bit length) */
+		hl = jd->hufflut[id][0];
+		b = huffext(jd, hb, hc, hd, hl);		/* Extract a huffman coded data (bit length) */
 		if (b < 0) return 0 - b;				/* Err: invalid code or input */
 		d = jd->dcv[cmp];						/* DC value of previous block */
 		if (b) {								/* If there is any difference from previous block */
@@ -516,13 +588,34 @@ JRESULT mcu_load (
 		tmp[0] = d * dqf[0] >> 8;				/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
 
 		/* Extract following 63 AC elements from input stream */
-		for (i = 1; i < 64; i++) tmp[i] = 0;	/* Clear rest of elements */
 		hb = jd->huffbits[id][1];				/* Huffman table for the AC elements */
 		hc = jd->huffcode[id][1];
 		hd = jd->huffdata[id][1];
+		hl = jd->hufflut[id][1];
 		i = 1;					/* Top of the AC elements */
+
+		if (JD_USE_SCALE && jd->scale == 3) {	/* If scale ratio is 1/8, only DC element is used, AC elements are skipped in the stream */
+			do {
+				b = huffext(jd, hb, hc, hd, hl);	/* Extract a huffman coded value (zero runs and bit length) */
+				if (b == 0) break;					/* EOB? */
+				if (b < 0) return 0 - b;			/* Err: invalid code or input error */
+				i += (UINT)b >> 4;					/* Skip zero elements */
+				if (i >= 64) return JDR_FMT1;		/* Too long zero run */
+				if (b &= 0x0F) {					/* Skip data bits */
+					d = bitext(jd, b);
+					if (d < 0) return 0 - d;		/* Err: input device */
+				}
+			} while (++i < 64);		/* Next AC element */
+			*bp = BYTECLIP((*tmp + (128L << 8)) >> 8);	/* IDCT is ommited, the DC element is the average of the block */
+			bp += 64;				/* Next block */
+			continue;
+		}
+
+		for (i = 1; i < 64; i++) tmp[i] = 0;	/* Clear rest of elements */
+		ac = 0;									/* No AC element yet */
+		i = 1;
 		do {
-			b = huffext(jd, hb, hc, hd);		/* Extract a huffman coded value (zero runs and bit length) */
+			b = huffext(jd, hb, hc, hd, hl);	/* Extract a huffman coded value (zero runs and bit length) */
 			if (b == 0) break;					/* EOB? */
 			if (b < 0) return 0 - b;			/* Err: invalid code or input error */
 			z = (UINT)b >> 4;					/* Number of leading zero elements */
@@ -537,11 +630,14 @@ JRESULT mcu_load (
 				if (!(d & b)) d -= (b << 1) - 1;/* Restore negative value if needed */
 				z = ZIG(i);						/* Zigzag-order to raster-order converted index */
 				tmp[z] = d * dqf[z] >> 8;		/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+				ac = 1;
 			}
 		} while (++i < 64);		/* Next AC element */
 
-		if (JD_USE_SCALE && jd->scale == 3)
-			*bp = (*tmp / 256) + 128;	/* If scale ratio is 1/8, IDCT can be ommited and only DC element is used */
+		if (!ac) {					/* Flat block, IDCT output is the DC element in all pixels */
+			d = BYTECLIP((tmp[0] + (128L << 8)) >> 8);
+			for (i = 0; i < 64; i++) bp[i] = (BYTE)d;
+		}
 		else
 			block_idct(tmp, bp);		/* Apply IDCT and store the block to the MCU buffer */
 
@@ -554,6 +650,155 @@ JRESULT mcu_load (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Skip an MCU outside the crop window: huffman decode only              */
+/*-----------------------------------------------------------------------*/
+
+static
+JRESULT mcu_skip (
+	JDEC* jd		/* Pointer to the decompressor object */
+)
+{
+	UINT blk, nby, i, cmp, id;
+	INT b, e;
+	const BYTE *hb, *hd, *hl;
+	const WORD *hc;
+
+
+	nby = jd->msx * jd->msy;	/* Number of Y blocks (1, 2 or 4) */
+
+	for (blk = 0; blk < nby + 2; blk++) {
+		cmp = (blk < nby) ? 0 : blk - nby + 1;	/* Component number 0:Y, 1:Cb, 2:Cr */
+		id = cmp ? 1 : 0;						/* Huffman table ID of the component */
+
+		/* Extract a DC element, the DC value is kept for the following blocks */
+		hb = jd->huffbits[id][0];
+		hc = jd->huffcode[id][0];
+		hd = jd->huffdata[id][0];
+		hl = jd->hufflut[id][0];
+		b = huffext(jd, hb, hc, hd, hl);		/* Extract a huffman coded data (bit length) */
+		if (b < 0) return 0 - b;				/* Err: invalid code or input */
+		if (b) {								/* If there is any difference from previous block */
+			e = bitext(jd, b);					/* Extract data bits */
+			if (e < 0) return 0 - e;			/* Err: input */
+			b = 1 << (b - 1);					/* MSB position */
+			if (!(e & b)) e -= (b << 1) - 1;	/* Restore sign if needed */
+			jd->dcv[cmp] += e;					/* Save current DC value for next block */
+		}
+
+		/* Skip following 63 AC elements in the stream, no de-quantization and IDCT */
+		hb = jd->huffbits[id][1];
+		hc = jd->huffcode[id][1];
+		hd = jd->huffdata[id][1];
+		hl = jd->hufflut[id][1];
+		i = 1;
+		do {
+			b = huffext(jd, hb, hc, hd, hl);	/* Extract a huffman coded value (zero runs and bit length) */
+			if (b == 0) break;					/* EOB? */
+			if (b < 0) return 0 - b;			/* Err: invalid code or input error */
+			i += (UINT)b >> 4;					/* Skip zero elements */
+			if (i >= 64) return JDR_FMT1;		/* Too long zero run */
+			if (b &= 0x0F) {					/* Skip data bits */
+				e = bitext(jd, b);
+				if (e < 0) return 0 - e;		/* Err: input device */
+			}
+		} while (++i < 64);		/* Next AC element */
+	}
+
+	return JDR_OK;	/* All blocks have been skipped successfully */
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Output an MCU in planar YCbCr 4:2:0 form                              */
+/*-----------------------------------------------------------------------*/
+
+#if JD_USE_YCC
+static
+JRESULT mcu_output_ycc (
+	JDEC* jd,	/* Pointer to the decompressor object */
+	UINT (*outfunc)(JDEC*, void*, JRECT*),	/* YCbCr output function */
+	JRECT* rect,	/* Rectangular area of the MCU in the frame buffer */
+	UINT mx,	/* MCU size (pixel) */
+	UINT my
+)
+{
+	UINT ix, iy, x, y, w, s, a, hx, hy, cw, ch, rx, ry, crx, cry;
+	BYTE *sp, *op;
+
+
+	/* Y plane: copy the blocks in raster order, average squares if descaling */
+	op = (BYTE*)jd->workbuf;
+	if (!jd->scale) {
+		for (iy = 0; iy < my; iy++) {
+			sp = jd->mcubuf + (iy >> 3) * jd->msx * 64 + (iy & 7) * 8;
+			for (ix = 0; ix < mx; ix += 8) {
+				op[0] = sp[0]; op[1] = sp[1]; op[2] = sp[2]; op[3] = sp[3];
+				op[4] = sp[4]; op[5] = sp[5]; op[6] = sp[6]; op[7] = sp[7];
+				op += 8; sp += 64;
+			}
+		}
+	} else {
+		s = jd->scale * 2;	/* Number of shifts for averaging */
+		w = 1 << jd->scale;	/* Width of square */
+		for (iy = 0; iy < my; iy += w) {
+			for (ix = 0; ix < mx; ix += w) {
+				sp = jd->mcubuf + ((iy >> 3) * jd->msx + (ix >> 3)) * 64 + (iy & 7) * 8 + (ix & 7);
+				a = 0;
+				for (y = 0; y < w; y++) {	/* Squares do not cross the blocks */
+					for (x = 0; x < w; x++) a += sp[x];
+					sp += 8;
+				}
+				*op++ = (BYTE)(a >> s);
+			}
+		}
+	}
+
+	/* Cb and Cr planes of half width and height of the Y plane: average the 8x8 chroma blocks down to it */
+	mx >>= jd->scale; my >>= jd->scale;
+	cw = mx / 2; ch = my / 2;
+	hx = jd->scale + 2 - jd->msx;	/* Horizontal and vertical shifts of the chroma squares */
+	hy = jd->scale + 2 - jd->msy;
+	sp = jd->mcubuf + jd->msx * jd->msy * 64;
+	for (iy = 0; iy < 2 * 8; iy += 1 << hy) {	/* Cb block and Cr block */
+		for (ix = 0; ix < 8; ix += 1 << hx) {
+			a = 0;
+			for (y = 0; y < (1U << hy); y++) {
+				for (x = 0; x < (1U << hx); x++) a += sp[(iy + y) * 8 + ix + x];
+			}
+			*op++ = (BYTE)(a >> (hx + hy));
+		}
+	}
+
+	/* Squeeze up the planes if a part of MCU is to be truncated */
+	rx = rect->right - rect->left + 1; ry = rect->bottom - rect->top + 1;
+	if (rx < mx || ry < my) {
+		crx = (rx + 1) / 2; cry = (ry + 1) / 2;
+		sp = op = (BYTE*)jd->workbuf;
+		for (y = 0; y < ry; y++) {
+			for (x = 0; x < rx; x++) *op++ = sp[x];
+			sp += mx;
+		}
+		sp = (BYTE*)jd->workbuf + mx * my;
+		for (iy = 0; iy < 2; iy++) {
+			for (y = 0; y < cry; y++) {
+				for (x = 0; x < crx; x++) *op++ = sp[x];
+				sp += cw;
+			}
+			sp += (ch - cry) * cw;
+		}
+	}
+
+	/* Output the YCbCr rectangular */
+	return outfunc(jd, jd->workbuf, rect) ? JDR_OK : JDR_INTR;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Output an MCU: Convert YCrCb to RGB and output it in RGB form         */
 /*-----------------------------------------------------------------------*/
@@ -584,6 +829,9 @@ JRESULT mcu_output (
 	rect.left = x; rect.right = x + rx - 1;				/* Rectangular area in the frame buffer */
 	rect.top = y; rect.bottom = y + ry - 1;
 
+#if JD_USE_YCC
+	if (jd->ycc) return mcu_output_ycc(jd, outfunc, &rect, mx, my);
+#endif
 
 	if (!JD_USE_SCALE || jd->scale != 3) {	/* Not for 1/8 scaling */
 
@@ -720,31 +968,199 @@ JRESULT restart (
 	BYTE *dp;
 
 
-	/* Discard padding bits and get two bytes from the input stream */
+	/* Discard padding bits, get the marker found by the bit stream reader or two bytes from the input stream */
+	if (jd->marker) {
+		d = 0xFF00 | jd->marker;
+	} else {
+		dp = jd->dptr; dc = jd->dctr;
+		d = 0;
+		for (i = 0; i < 2; i++) {
+			if (!dc) {	/* No input data is available, re-fill input buffer */
+				dp = jd->inbuf;
+				dc = jd->infunc(jd, dp, JD_SZBUF);
+				if (!dc) return JDR_INP;
+				jd->nread += dc;
+			} else {
+				dp++;
+			}
+			dc--;
+			d = (d << 8) | *dp;	/* Get a byte */
+		}
+		jd->dptr = dp; jd->dctr = dc;
+	}
+	jd->wreg = 0; jd->dbit = 0; jd->marker = 0;
+
+	/* Check the marker */
+	if ((d & 0xFFD8) != 0xFFD0 || (d & 7) != (rstn & 7)) {
+		if ((d & 0xFF00) == 0xFF00 && (BYTE)d != 0 && (BYTE)d != 0xFF)
+			jd->marker = (BYTE)d;	/* Keep a wrong marker for resync() */
+		return JDR_FMT1;	/* Err: expected RSTn marker is not detected (may be collapted data) */
+	}
+
+	/* Reset DC offset */
+	jd->dcv[2] = jd->dcv[1] = jd->dcv[0] = 0;
+
+	return JDR_OK;
+}
+
+
+
+#if JD_CONCEAL
+/*-----------------------------------------------------------------------*/
+/* Resynchronize at the next RSTn marker after a data error              */
+/*-----------------------------------------------------------------------*/
+
+static
+INT resync (	/* >=0: number of the RSTn marker found, <0: no RSTn marker up to the end of data */
+	JDEC* jd	/* Pointer to the decompressor object */
+)
+{
+	UINT dc, f;
+	BYTE d, *dp;
+
+
+	/* Discard the bit stream up to a marker, the bit stream reader may have found it already */
+	d = jd->marker;
 	dp = jd->dptr; dc = jd->dctr;
-	d = 0;
-	for (i = 0; i < 2; i++) {
+	f = 0;
+	while (!d) {
 		if (!dc) {	/* No input data is available, re-fill input buffer */
 			dp = jd->inbuf;
 			dc = jd->infunc(jd, dp, JD_SZBUF);
-			if (!dc) return JDR_INP;
+			if (!dc) break;	/* End of data */
+			jd->nread += dc;
 		} else {
 			dp++;
 		}
 		dc--;
-		d = (d << 8) | *dp;	/* Get a byte */
+		if (f && *dp != 0xFF) {	/* Trailing byte of flag sequence, not a fill byte */
+			f = 0;
+			d = *dp;			/* Marker, zero is a data 0xFF */
+		} else if (*dp == 0xFF) {
+			f = 1;
+		}
 	}
-	jd->dptr = dp; jd->dctr = dc; jd->dmsk = 0;
-
-	/* Check the marker */
-	if ((d & 0xFFD8) != 0xFFD0 || (d & 7) != (rstn & 7))
-		return JDR_FMT1;	/* Err: expected RSTn marker is not detected (may be collapted data) */
+	jd->dptr = dp; jd->dctr = dc;
+	jd->wreg = 0; jd->dbit = 0; jd->marker = 0;
 
 	/* Reset DC offset */
 	jd->dcv[2] = jd->dcv[1] = jd->dcv[0] = 0;
 
+	return ((d & 0xF8) == 0xD0) ? (INT)(d & 7) : -1;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Output a lost MCU: the output function conceals it (null bitmap)      */
+/*-----------------------------------------------------------------------*/
+
+static
+JRESULT mcu_conceal (
+	JDEC* jd,	/* Pointer to the decompressor object */
+	UINT (*outfunc)(JDEC*, void*, JRECT*),	/* RGB output function */
+	UINT x,		/* MCU position in the image (left of the MCU) */
+	UINT y		/* MCU position in the image (top of the MCU) */
+)
+{
+	UINT mx, my, rx, ry;
+	JRECT rect;
+
+
+	jd->nlost++;
+	mx = jd->msx * 8; my = jd->msy * 8;					/* MCU size (pixel) */
+	rx = (x + mx <= jd->width) ? mx : jd->width - x;	/* Output rectangular size (it may be clipped at right/bottom end) */
+	ry = (y + my <= jd->height) ? my : jd->height - y;
+	if (JD_USE_SCALE) {
+		rx >>= jd->scale; ry >>= jd->scale;
+		if (!rx || !ry) return JDR_OK;					/* Skip this MCU if all pixel is to be rounded off */
+		x >>= jd->scale; y >>= jd->scale;
+	}
+	rect.left = x; rect.right = x + rx - 1;				/* Rectangular area in the frame buffer */
+	rect.top = y; rect.bottom = y + ry - 1;
+
+	return outfunc(jd, 0, &rect) ? JDR_OK : JDR_INTR;
+}
+#endif
+
+
+
+
+#if JD_USE_INDEX
+/*-----------------------------------------------------------------------*/
+/* Save the decoder state of the MCU to the index                        */
+/*-----------------------------------------------------------------------*/
+
+static
+void save (
+	JDEC* jd,		/* Pointer to the decompressor object */
+	JSTATE* st,		/* Index entry of the MCU */
+	WORD rst,		/* Restart interval counters */
+	WORD rsc
+)
+{
+	st->ofs = jd->nread - jd->dctr;
+	st->wreg = jd->wreg; st->dbit = jd->dbit; st->marker = jd->marker;
+	st->dcv[0] = jd->dcv[0]; st->dcv[1] = jd->dcv[1]; st->dcv[2] = jd->dcv[2];
+	st->rst = rst; st->rsc = rsc;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Index entry to resume the MCU row left of the crop window             */
+/*-----------------------------------------------------------------------*/
+
+static
+JSTATE* resume_point (	/* Last saved decoder state of the row not right of the crop window, null if none */
+	JDEC* jd,	/* Pointer to the decompressor object */
+	UINT y,		/* MCU row (pixel) */
+	UINT n		/* Index entries per MCU row */
+)
+{
+	UINT i;
+	JSTATE *st;
+
+
+	st = &jd->index[y / (jd->msy * 8) * n];
+	for (i = jd->crop.left / (jd->msx * 8) / jd->istep + 1; i; i--) {
+		if (st[i - 1].ofs) return &st[i - 1];
+	}
+	return 0;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Resume the bit stream at a saved state ahead of the read position     */
+/*-----------------------------------------------------------------------*/
+
+static
+JRESULT restore (
+	JDEC* jd,			/* Pointer to the decompressor object */
+	const JSTATE* st	/* Saved state, not behind the current read position */
+)
+{
+	DWORD n;
+
+
+	n = st->ofs - (jd->nread - jd->dctr);	/* Number of bytes to skip */
+	if (n <= jd->dctr) {			/* The saved position is in the input buffer */
+		jd->dptr += n; jd->dctr -= n;
+	} else {						/* Skip the stream up to the saved position, the input buffer is re-filled from there */
+		n = st->ofs - jd->nread;
+		if (jd->infunc(jd, 0, n) != n) return JDR_INP;	/* Null pointer specifies to skip bytes of stream */
+		jd->nread += n; jd->dctr = 0;
+	}
+	jd->wreg = st->wreg; jd->dbit = st->dbit; jd->marker = st->marker;
+	jd->dcv[0] = st->dcv[0]; jd->dcv[1] = st->dcv[1]; jd->dcv[2] = st->dcv[2];
+
 	return JDR_OK;
 }
+#endif
 
 
 
@@ -778,12 +1194,15 @@ JRESULT jd_prepare (
 	jd->infunc = infunc;	/* Stream input function */
 	jd->device = dev;		/* I/O device identifier */
 	jd->nrst = 0;			/* No restart interval (default) */
+	jd->ycc = 0;			/* Output format JD_FORMAT (default) */
+	jd->index = 0;			/* No decoder state index (default) */
 
 	for (i = 0; i < 2; i++) {	/* Nulls pointers */
 		for (j = 0; j < 2; j++) {
 			jd->huffbits[i][j] = 0;
 			jd->huffcode[i][j] = 0;
 			jd->huffdata[i][j] = 0;
+			jd->hufflut[i][j] = 0;
 		}
 	}
 	for (i = 0; i < 4; i++) jd->qttbl[i] = 0;
@@ -812,6 +1231,8 @@ JRESULT jd_prepare (
 
 			jd->width = LDB_WORD(seg+3);		/* Image width in unit of pixel */
 			jd->height = LDB_WORD(seg+1);		/* Image height in unit of pixel */
+			jd->crop.left = 0; jd->crop.right = jd->width - 1;	/* Whole image (default) */
+			jd->crop.top = 0; jd->crop.bottom = jd->height - 1;
 			if (seg[5] != 3) return JDR_FMT3;	/* Err: Supports only Y/Cb/Cr format */
 
 			/* Check three image components */
@@ -887,9 +1308,16 @@ JRESULT jd_prepare (
 			if (!jd->workbuf) return JDR_MEM1;			/* Err: not enough memory */
 			jd->mcubuf = alloc_pool(jd, (n + 2) * 64);	/* Allocate MCU working buffer */
 			if (!jd->mcubuf) return JDR_MEM1;			/* Err: not enough memory */
+#if JD_HUFFLUT
+			create_huffman_lut(jd, 0, 1);				/* Fast lookup tables in the rest of the pool, */
+			create_huffman_lut(jd, 1, 1);				/* AC tables first as they decode most codes */
+			create_huffman_lut(jd, 0, 0);
+			create_huffman_lut(jd, 1, 0);
+#endif
 
 			/* Pre-load the JPEG data to extract it from the bit stream */
-			jd->dptr = seg; jd->dctr = 0; jd->dmsk = 0;	/* Prepare to read bit stream */
+			jd->dptr = seg; jd->dctr = 0;				/* Prepare to read bit stream */
+			jd->wreg = 0; jd->dbit = 0; jd->marker = 0;
 			if (ofs %= JD_SZBUF) {						/* Align read offset to JD_SZBUF */
 				jd->dctr = jd->infunc(jd, seg + ofs, JD_SZBUF - (UINT)ofs);
 				jd->dptr = seg + ofs - 1;
@@ -933,31 +1361,110 @@ JRESULT jd_decomp (
 	BYTE scale								/* Output de-scaling factor (0 to 3) */
 )
 {
-	UINT x, y, mx, my;
+	UINT x, y, mx, my, skip;
 	WORD rst, rsc;
 	JRESULT rc;
+#if JD_CONCEAL
+	UINT lost;
+	INT m;
+#endif
+#if JD_USE_INDEX
+	JSTATE *st;
+	UINT n;
+#endif
 
 
 	if (scale > (JD_USE_SCALE ? 3 : 0)) return JDR_PAR;
+	if (jd->ycc && (!JD_USE_YCC || scale == 3)) return JDR_PAR;	/* YCbCr output is not available at 1/8 scaling */
 	jd->scale = scale;
 
 	mx = jd->msx * 8; my = jd->msy * 8;			/* Size of the MCU (pixel) */
 
 	jd->dcv[2] = jd->dcv[1] = jd->dcv[0] = 0;	/* Initialize DC values */
 	rst = rsc = 0;
+	jd->nlost = 0;
+	jd->nread = jd->dctr;						/* Stream offset of the next input byte is nread - dctr */
+#if JD_CONCEAL
+	lost = 0;
+#endif
+#if JD_USE_INDEX
+	n = jd->index ? (jd->width + mx * jd->istep - 1) / (mx * jd->istep) : 0;	/* Index entries per MCU row */
+#endif
 
 	rc = JDR_OK;
+	skip = 0;
 	for (y = 0; y < jd->height; y += my) {		/* Vertical loop of MCUs */
-		for (x = 0; x < jd->width; x += mx) {	/* Horizontal loop of MCUs */
+#if JD_USE_CROP
+		if (y > jd->crop.bottom) break;			/* Below the crop window, the rest of the stream is not needed */
+#endif
+		x = 0;
+#if JD_USE_INDEX
+		st = n ? resume_point(jd, y, n) : 0;
+		if (st) {								/* Resume the row at the state saved by the last jd_decomp() */
+			rc = restore(jd, st);
+			if (rc != JDR_OK) return rc;
+			x = (UINT)(st - &jd->index[y / my * n]) * jd->istep * mx;
+			rst = st->rst; rsc = st->rsc;
+#if JD_CONCEAL
+			lost = 0;
+#endif
+		}
+#endif
+		for ( ; x < jd->width; x += mx) {	/* Horizontal loop of MCUs */
+#if JD_USE_CROP
+			skip = (x + mx <= jd->crop.left || x > jd->crop.right || y + my <= jd->crop.top);	/* MCU out of the crop window? */
+#endif
+#if JD_CONCEAL
+			if (lost) {							/* MCU skipped up to the resync point */
+				lost--;
+				rc = skip ? JDR_OK : mcu_conceal(jd, outfunc, x, y);
+				if (rc != JDR_OK) return rc;
+				continue;
+			}
+#if JD_USE_INDEX
+			if (n && (x / mx) % jd->istep == 0) save(jd, &jd->index[y / my * n + x / mx / jd->istep], rst, rsc);
+#endif
+			rc = JDR_OK;
+			if (jd->nrst && rst++ == jd->nrst) {	/* Process restart interval if enabled */
+				rc = restart(jd, rsc++);
+				rst = 1;
+			}
+			if (rc == JDR_OK) rc = skip ? mcu_skip(jd) : mcu_load(jd);	/* Load an MCU (decompress huffman coded stream and apply IDCT) */
+			if (rc == JDR_FMT1 || rc == JDR_INP) {	/* Data error, resync at the next RSTn and skip the MCUs up to it */
+				m = resync(jd);
+				if (jd->nrst && m >= 0) {
+					m = (m - rsc) & 7;				/* Number of whole restart intervals lost */
+					lost = jd->nrst - rst + m * jd->nrst;
+					rsc += m + 1;
+					rst = 0;
+				} else {
+					lost = ~0;						/* No resync point, skip the rest of the image */
+				}
+				rc = skip ? JDR_OK : mcu_conceal(jd, outfunc, x, y);
+				if (rc != JDR_OK) return rc;
+				continue;
+			}
+#else
+#if JD_USE_INDEX
+			if (n && (x / mx) % jd->istep == 0) save(jd, &jd->index[y / my * n + x / mx / jd->istep], rst, rsc);
+#endif
 			if (jd->nrst && rst++ == jd->nrst) {	/* Process restart interval if enabled */
 				rc = restart(jd, rsc++);
 				if (rc != JDR_OK) return rc;
 				rst = 1;
 			}
-			rc = mcu_load(jd);					/* Load an MCU (decompress huffman coded stream and apply IDCT) */
-			if (rc != JDR_OK) return rc;
-			rc = mcu_output(jd, outfunc, x, y);	/* Output the MCU (color space conversion, scaling and output) */
+			rc = skip ? mcu_skip(jd) : mcu_load(jd);	/* Load an MCU (decompress huffman coded stream and apply IDCT) */
+#endif
 			if (rc != JDR_OK) return rc;
+			if (!skip) {						/* In the crop window */
+				rc = mcu_output(jd, outfunc, x, y);	/* Output the MCU (color space conversion, scaling and output) */
+				if (rc != JDR_OK) return rc;
+			}
+#if JD_USE_INDEX
+			if (n && x <= jd->crop.right && x + mx > jd->crop.right) {	/* Last MCU of the crop window */
+				if (y + my > jd->crop.bottom || resume_point(jd, y + my, n)) break;	/* The next row resumes at its saved state */
+			}
+#endif
 		}
 	}
 
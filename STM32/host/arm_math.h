@@ -0,0 +1,25 @@
+/*************************************************************************
+ *
+ * SatCam - Camera Module for PSAT-2
+ * Copyright (c) 2015-2017 Ales Povalac <alpov@alpov.net>
+ * Dept. of Radio Electronics, Brno University of Technology
+ *
+ * This work is licensed under the terms of the MIT license
+ *
+ *************************************************************************/
+
+/* Host replacement of the CMSIS-DSP functions used by audio.c and the NCO benchmark */
+
+#ifndef _HOST_ARM_MATH_H_
+#define _HOST_ARM_MATH_H_
+
+#include <stdint.h>
+
+typedef int8_t q7_t;
+typedef int16_t q15_t;
+typedef int32_t q31_t;
+
+extern q15_t arm_sin_q15(q15_t x);
+extern q15_t arm_cos_q15(q15_t x);
+
+#endif /* _HOST_ARM_MATH_H_ */
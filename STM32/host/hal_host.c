@@ -0,0 +1,251 @@
+/*************************************************************************
+ *
+ * SatCam - Camera Module for PSAT-2
+ * Copyright (c) 2015-2017 Ales Povalac <alpov@alpov.net>
+ * Dept. of Radio Electronics, Brno University of Technology
+ *
+ * This work is licensed under the terms of the MIT license
+ *
+ *************************************************************************/
+
+#include <stdarg.h>
+#include <math.h>
+#include "cube.h"
+#include <arm_math.h>
+#include "audio.h"
+#include "comm.h"
+#include "eeprom.h"
+#include "m25p16.h"
+#include "hal_host.h"
+
+DAC_HandleTypeDef hdac;
+DMA_HandleTypeDef hdma_dac2;
+IWDG_HandleTypeDef hiwdg;
+static TIM_TypeDef tim6;
+TIM_HandleTypeDef htim6 = { .Instance = &tim6 };
+
+bool host_verbose = false;
+
+static FILE *wav_file;
+static uint32_t wav_samples;
+static uint32_t wav_rate;
+static uint8_t wav_bits = 8;
+
+static uint8_t *dma_buffer;
+static uint32_t dma_length;
+static uint8_t dma_width;       // bytes per sample, from DAC alignment
+static uint8_t dma_half;
+static bool dma_running;
+static uint32_t sample_period;  // us per sample, from TIM6 ARR
+static uint64_t played_us;      // audio played since start, time base for HAL_GetTick()
+static uint32_t idle_ticks;     // sleeps without running DMA, 1ms each
+
+static uint8_t *flash_image;
+static uint32_t flash_size;
+
+
+static void wav_put32(uint32_t v, FILE *f)
+{
+    for (uint8_t i = 0; i < 4; i++) fputc((v >> (8*i)) & 0xFF, f);
+}
+
+
+static void wav_put16(uint16_t v, FILE *f)
+{
+    for (uint8_t i = 0; i < 2; i++) fputc((v >> (8*i)) & 0xFF, f);
+}
+
+
+/* Mono PCM, 8-bit unsigned for DAC_ALIGN_8B_R samples, 16-bit signed for 12-bit samples */
+static void wav_header(FILE *f, uint32_t rate, uint8_t bits, uint32_t samples)
+{
+    uint8_t align = bits / 8;
+    fwrite("RIFF", 1, 4, f);
+    wav_put32(36 + samples * align, f);
+    fwrite("WAVEfmt ", 1, 8, f);
+    wav_put32(16, f);       // fmt chunk size
+    wav_put16(1, f);        // PCM
+    wav_put16(1, f);        // mono
+    wav_put32(rate, f);     // sample rate
+    wav_put32(rate * align, f); // byte rate
+    wav_put16(align, f);    // block align
+    wav_put16(bits, f);     // bits per sample
+    fwrite("data", 1, 4, f);
+    wav_put32(samples * align, f);
+}
+
+
+/* Rate and sample format are known after audio_start(), the header is completed in host_wav_close() */
+bool host_wav_open(const char *filename)
+{
+    wav_file = NULL;
+    wav_samples = 0;
+    wav_rate = 0;
+    if (filename == NULL) return true; // render without output, e.g. for timing checks
+    wav_file = fopen(filename, "wb");
+    if (wav_file == NULL) return false;
+    wav_header(wav_file, 0, 8, 0);
+    return true;
+}
+
+
+void host_wav_close(void)
+{
+    if (wav_file == NULL) return;
+    fseek(wav_file, 0, SEEK_SET);
+    wav_header(wav_file, wav_rate, wav_bits, wav_samples); // patch rate and chunk sizes
+    fclose(wav_file);
+    wav_file = NULL;
+}
+
+
+uint64_t host_played_us(void)
+{
+    return played_us;
+}
+
+
+bool host_flash_load(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) return false;
+    fseek(f, 0, SEEK_END);
+    flash_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    flash_image = malloc(flash_size);
+    bool ok = (flash_image != NULL && fread(flash_image, 1, flash_size, f) == flash_size);
+    fclose(f);
+    return ok;
+}
+
+
+HAL_StatusTypeDef HAL_DAC_Start_DMA(DAC_HandleTypeDef *hdac, uint32_t Channel, uint32_t *pData, uint32_t Length, uint32_t Alignment)
+{
+    dma_buffer = (uint8_t*)pData;
+    dma_length = Length;
+    dma_width = (Alignment == DAC_ALIGN_8B_R) ? 1 : 2;
+    dma_half = 0;
+    sample_period = htim6.Instance->ARR + 1; // 1MHz TIM6 counter clock
+    wav_rate = (1000000 + sample_period/2) / sample_period;
+    wav_bits = dma_width * 8;
+    dma_running = true;
+    hdma_dac2.State = HAL_DMA_STATE_BUSY;
+    return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_DAC_Stop_DMA(DAC_HandleTypeDef *hdac, uint32_t Channel)
+{
+    dma_running = false;
+    hdma_dac2.State = HAL_DMA_STATE_READY;
+    return HAL_OK;
+}
+
+
+/* Sleep until the next interrupt: the DMA plays one buffer half and raises its callback */
+void HAL_PWR_EnterSLEEPMode(uint32_t Regulator, uint8_t SLEEPEntry)
+{
+    if (!dma_running) {
+        idle_ticks++;
+        return;
+    }
+
+    uint32_t samples = dma_length / 2;
+    if (dma_width == 1) {
+        uint8_t *half = dma_buffer + dma_half * samples;
+        if (wav_file) fwrite(half, 1, samples, wav_file);
+    }
+    else {
+        uint16_t *half = (uint16_t*)dma_buffer + dma_half * samples;
+        for (uint32_t i = 0; wav_file && i < samples; i++) {
+            wav_put16((uint16_t)((half[i] - 2048) * 16), wav_file); // 12-bit unsigned to 16-bit signed
+        }
+    }
+    wav_samples += samples;
+    played_us += (uint64_t)samples * sample_period;
+
+    if (dma_half == 0) HAL_DACEx_ConvHalfCpltCallbackCh2(&hdac);
+    else HAL_DACEx_ConvCpltCallbackCh2(&hdac);
+    dma_half ^= 1;
+}
+
+
+uint32_t HAL_GetTick(void)
+{
+    return played_us / 1000 + idle_ticks;
+}
+
+
+q15_t arm_sin_q15(q15_t x)
+{
+    /* CMSIS algorithm: 512 entry table with linear interpolation, for the NCO benchmark of the former output path */
+    static q15_t table[513];
+    if (table[128] == 0) {
+        for (uint16_t i = 0; i < 513; i++) table[i] = (q15_t)round(32767.0 * sin(2.0 * M_PI * i / 512));
+    }
+    uint16_t index = (uint16_t)(x & 0x7FFF) >> 6;
+    q15_t fract = ((x & 0x7FFF) - (index << 6)) << 9;
+    q15_t y = ((q31_t)(0x8000 - fract) * table[index]) >> 16;
+    y = (((q31_t)y << 16) + (q31_t)fract * table[index + 1]) >> 16;
+    return y << 1;
+}
+
+
+q15_t arm_cos_q15(q15_t x)
+{
+    /* CMSIS maps 0..0x7FFF to 0..2pi, the result is within 1 LSB of the table interpolation */
+    double y = round(32767.0 * cos(2.0 * M_PI * (x & 0x7FFF) / 32768.0));
+    return (q15_t)y;
+}
+
+
+void syslog_event(LOG_EVENT event)
+{
+    if (host_verbose) fprintf(stderr, "syslog event %d\n", event);
+}
+
+
+void printf_debug(const char *format, ...)
+{
+    if (!host_verbose) return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+
+void flash_read(uint32_t addr, uint8_t *buffer, uint16_t length)
+{
+    /* erased flash (0xFF) outside the loaded image */
+    for (uint16_t i = 0; i < length; i++) {
+        buffer[i] = (addr + i < flash_size) ? flash_image[addr + i] : 0xFF;
+    }
+}
+
+
+static uint32_t flash_stream_addr;
+
+void flash_stream_open(uint32_t addr)
+{
+    flash_stream_addr = addr;
+}
+
+
+void flash_stream_read(uint8_t *buffer, uint16_t length)
+{
+    uint8_t skip[FLASH_STREAM_BLOCK];
+    while (length) {
+        uint16_t n = (length < FLASH_STREAM_BLOCK) ? length : FLASH_STREAM_BLOCK;
+        flash_read(flash_stream_addr, buffer ? buffer : skip, n);
+        flash_stream_addr += n;
+        if (buffer) buffer += n;
+        length -= n;
+    }
+}
+
+
+void flash_stream_close(void)
+{
+}
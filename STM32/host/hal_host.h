@@ -0,0 +1,11 @@
+#ifndef _HAL_HOST_H_
+#define _HAL_HOST_H_
+
+extern bool host_verbose;
+
+extern bool host_wav_open(const char *filename);
+extern void host_wav_close(void);
+extern uint64_t host_played_us(void);
+extern bool host_flash_load(const char *filename);
+
+#endif /* _HAL_HOST_H_ */
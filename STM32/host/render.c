@@ -0,0 +1,790 @@
+/*************************************************************************
+ *
+ * SatCam - Camera Module for PSAT-2
+ * Copyright (c) 2015-2017 Ales Povalac <alpov@alpov.net>
+ * Dept. of Radio Electronics, Brno University of Technology
+ *
+ * This work is licensed under the terms of the MIT license
+ *
+ *************************************************************************/
+
+/* Host renderer: SSTV, PSK and CW transmissions to WAV files, without the board */
+
+#include <time.h>
+#include <unistd.h>
+#include "cube.h"
+#include <arm_math.h>
+#include "audio.h"
+#include "comm.h"
+#include "m25p16.h"
+#include "sstv.h"
+#include "tjpgd.h"
+#include "hal_host.h"
+
+#define INCLUDE_YUV
+#include "yuv.h"
+
+#define INCLUDE_SINE
+#include "sine.h"
+
+#define VOX_US      (800000 + 400000)           // VOX start and stop tones
+#define VIS8_US     (300000 + 10000 + 300000 + 30000 + 8*30000 + 30000)
+#define VIS16_US    (300000 + 10000 + 300000 + 30000 + 16*30000 + 30000)
+
+#define XSTR(__s)   #__s
+#define STR(__s)    XSTR(__s)
+
+/* nominal SSTV image timing */
+static const struct {
+    uint8_t mode;
+    const char *name;
+    uint32_t vis_us;    // VIS code incl. starting sync
+    uint16_t lines;     // transmitted lines, or line pairs for modes sending two lines at once
+    uint32_t line_us;   // line period
+} sstv_spec[] = {
+    { 36, "Robot36", VIS8_US, 240, 150000 },
+    { 72, "Robot72", VIS8_US, 240, 300000 },
+    { 73, "MP73", VIS16_US, 128, 570000 },      // incl. 16 lines of black header
+    { 115, "MP115", VIS16_US, 128, 902000 },    // incl. 16 lines of black header
+    { 60, "Scottie1", VIS8_US + 9000, 256, 428220 },
+    { 56, "Scottie2", VIS8_US + 9000, 256, 277692 },
+    { 76, "ScottieDX", VIS8_US + 9000, 256, 1050300 },
+    { 44, "Martin1", VIS8_US, 256, 446446 },
+    { 40, "Martin2", VIS8_US, 256, 226798 },
+    { 99, "PD90", VIS8_US, 128, 703040 },       // incl. 16 lines of black header
+    { 95, "PD120", VIS8_US, 248, 508480 },      // 640x496 incl. 16 lines of black header
+    { 96, "PD180", VIS8_US, 248, 754240 },      // 640x496 incl. 16 lines of black header
+    { 2, "Robot8BW", VIS8_US, 120, 67000 },     // 160x120
+    { 6, "Robot12BW", VIS8_US, 120, 100000 },   // 160x120
+    { 10, "Robot24BW", VIS8_US, 240, 100000 },
+};
+
+/* luma/chroma kernel variants for cross-check */
+typedef void (*YUV_LUMA)(const uint8_t *rgb, uint8_t *luma, uint16_t n);
+typedef void (*YUV_CHROMA)(const uint8_t *rgb, const uint8_t *luma, uint8_t *chroma, uint8_t ofs, uint16_t n);
+static const struct {
+    const char *name;
+    YUV_LUMA luma;
+    YUV_CHROMA chroma;
+    YUV_CHROMA chroma_2lines;
+} yuv_variants[] = {
+    { "ref", yuv_luma_ref, yuv_chroma_ref, yuv_chroma_2lines_ref },
+#ifdef HOST_DSP_INTRINSICS
+    { "dsp", yuv_luma_dsp, yuv_chroma_dsp, yuv_chroma_2lines_dsp },
+#endif
+#ifdef __SSE2__
+    { "sse2", yuv_luma_sse2, yuv_chroma_sse2, yuv_chroma_2lines_sse2 },
+#endif
+#ifdef __ARM_NEON
+    { "neon", yuv_luma_neon, yuv_chroma_neon, yuv_chroma_2lines_neon },
+#endif
+};
+#define YUV_VARIANTS    (sizeof(yuv_variants)/sizeof(yuv_variants[0]))
+#define YUV_MAX_WIDTH   640
+
+static uint8_t jpeg[IMG_BUFFER_SIZE];
+static uint32_t jpeg_pos;
+static uint32_t jpeg_length; // size of the loaded image file
+static uint8_t strip[YUV_MAX_WIDTH*IMG_HEIGHT*3];
+static uint8_t frame[IMG_WIDTH*240*3]; // Robot36 image of the throughput benchmark
+static uint32_t yuv_strips, yuv_errors;
+static uint32_t bench_sum;
+static double yuv_time[YUV_VARIANTS];
+static struct timespec render_start;
+
+
+static double elapsed(struct timespec *start);
+
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: satcam-render [-v] [-f flash.bin] [-o overlay] [-r rate] [-z zoom:x:y] [-R cw|ccw] command ...\n"
+        "  sstv <mode> <jpeg|-|@N> <out.wav>   JPEG of any size, '-' flash thumbnails, '@N' flash image N\n"
+        "                                       mode 36/72 Robot, 73/115 MP, 60/56/76 Scottie 1/2/DX, 44/40 Martin 1/2,\n"
+        "                                       99/95/96 PD 90/120/180, 2/6/10 Robot 8/12/24 B/W\n"
+        "  psk <speed> <freq> <text> <out.wav>  PSK31-PSK1000 message\n"
+        "  cw <wpm> <freq> <text> <out.wav>     morse message\n"
+        "  fit <mode> <seconds>                 SSTV mode chosen for the remaining TX slot\n"
+        "  check [image.jpg]                    SSTV image duration of all modes against nominal timing at several rates\n"
+        "  yuv [image.jpg ...]                  cross-check and time luma/chroma kernels on random and image strips\n"
+        "  nco                                  SSTV tone generator ns/sample, arm_sin_q15() per sample against the sine LUT NCO\n"
+        "  throughput [image.jpg]               Robot36 image audio, former per-sample output path against block rendering\n"
+        "  bench image.jpg ...                  JPEG decode time, thumbnail, full size, 1/16 centre window and rotated\n"
+        "                                       Robot36 pass per strip with and without the decoder state index\n"
+        "  -v  debug and syslog messages\n"
+        "  -f  flash image for thumbnails and streamed images\n"
+        "  -o  large overlay text\n"
+        "  -r  sampling rate in Hz, default " STR(SAMPLE_FREQ) " for SSTV and " STR(PSK_SAMPLE_FREQ) " for PSK/CW\n"
+        "  -m  second message mixed to sstv, psk or cw: psk:<speed>:<freq>:<text> or cw:<wpm>:<freq>:<text>\n"
+        "  -z  sstv window of 1/zoom of the image size centred at x, y percent of the image\n"
+        "  -R  sstv image rotated by 90 degrees clockwise or counterclockwise, portrait modules\n"
+    );
+    exit(2);
+}
+
+
+static bool load_jpeg(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        perror(filename);
+        return false;
+    }
+    memset(jpeg, 0xFF, sizeof(jpeg));
+    size_t n = fread(jpeg, 1, sizeof(jpeg), f);
+    fclose(f);
+    jpeg_length = n;
+    if (n == sizeof(jpeg)) {
+        fprintf(stderr, "%s: image larger than %u bytes\n", filename, IMG_BUFFER_SIZE);
+        return false;
+    }
+    return true;
+}
+
+
+static void set_overlay(const char *large)
+{
+    sstv_set_overlay(OVERLAY_HEADER, CALLSIGN_SSTV_PSK " host render");
+    sstv_set_overlay(OVERLAY_IMG, "");
+    sstv_set_overlay(OVERLAY_LARGE, large ? large : "");
+    sstv_set_overlay(OVERLAY_FROM, CALLSIGN_SSTV_PSK);
+}
+
+
+/* Second message mixed to the main transmission: psk:<speed>:<freq>:<text> or cw:<wpm>:<freq>:<text> */
+static bool set_mix(const char *spec, int16_t volume)
+{
+    char type[4];
+    unsigned int speed, freq;
+    int n = 0;
+
+    if (spec == NULL) return true;
+    if (sscanf(spec, "%3[^:]:%u:%u:%n", type, &speed, &freq, &n) != 3 || n == 0) return false;
+    if (streq(type, "psk")) audio_mix_psk(1, speed, freq, spec + n, volume);
+    else if (streq(type, "cw")) audio_mix_morse(1, speed, freq, spec + n, volume);
+    else return false;
+    return true;
+}
+
+
+static void render_begin(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &render_start);
+}
+
+
+static void render_end(void)
+{
+    double wall = elapsed(&render_start);
+    double audio = host_played_us() * 1e-6;
+    fprintf(stderr, "%.2fs audio at %uHz rendered in %.3fs, %.0fx real time\n", audio, (unsigned int)audio_get_rate(), wall, wall > 0 ? audio / wall : 0);
+}
+
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+
+/* Robot36 workload of one strip in all variants, compared with the reference */
+static void yuv_check_strip(const uint8_t *rgb, uint16_t width, uint8_t lines)
+{
+    static uint8_t luma[YUV_VARIANTS][YUV_MAX_WIDTH*IMG_HEIGHT];
+    static uint8_t chroma[YUV_VARIANTS][3][YUV_MAX_WIDTH*IMG_HEIGHT];
+
+    for (uint8_t v = 0; v < YUV_VARIANTS; v++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        yuv_variants[v].luma(rgb, luma[v], width * lines);
+        for (uint8_t l = 0; l + 2 <= lines; l += 2) {
+            yuv_variants[v].chroma_2lines(rgb + l*width*3, luma[v] + l*width, chroma[v][0] + l*width, CHROMA_R_Y, width);
+            yuv_variants[v].chroma_2lines(rgb + l*width*3, luma[v] + l*width, chroma[v][0] + (l+1)*width, CHROMA_B_Y, width);
+        }
+        yuv_time[v] += elapsed(&start);
+        for (uint8_t l = 0; l < lines; l++) {
+            yuv_variants[v].chroma(rgb + l*width*3, luma[v] + l*width, chroma[v][1] + l*width, CHROMA_R_Y, width);
+            yuv_variants[v].chroma(rgb + l*width*3, luma[v] + l*width, chroma[v][2] + l*width, CHROMA_B_Y, width);
+        }
+        if (v == 0) continue;
+
+        bool ok = memcmp(luma[v], luma[0], width * lines) == 0;
+        for (uint8_t k = 0; k < 3; k++) ok = ok && memcmp(chroma[v][k], chroma[0][k], width * lines) == 0;
+        if (!ok) {
+            if (yuv_errors < 10) fprintf(stderr, "yuv: %s differs from ref, strip %u width %u\n", yuv_variants[v].name, (unsigned int)yuv_strips, width);
+            yuv_errors++;
+        }
+    }
+    yuv_strips++;
+}
+
+
+static UINT yuv_input(JDEC* jd, uint8_t* buff, UINT nd)
+{
+    if (jpeg_pos + nd > sizeof(jpeg)) nd = sizeof(jpeg) - jpeg_pos;
+    if (buff) memcpy(buff, &jpeg[jpeg_pos], nd);
+    jpeg_pos += nd;
+    return nd;
+}
+
+
+static UINT yuv_output(JDEC* jd, void* bitmap, JRECT* rect)
+{
+    uint8_t *src = bitmap;
+    uint16_t bws = 3 * (rect->right - rect->left + 1);
+    if (src == NULL) return 0; // data error concealed by the decoder
+    for (uint16_t y = rect->top; y <= rect->bottom; y++) {
+        memcpy(strip + 3 * ((y % IMG_HEIGHT) * jd->width + rect->left), src, bws);
+        src += bws;
+    }
+    if ((rect->bottom % IMG_HEIGHT) == (IMG_HEIGHT - 1) && rect->right == jd->width - 1) {
+        yuv_check_strip(strip, jd->width, IMG_HEIGHT);
+    }
+    return 1;
+}
+
+
+static int cmd_yuv(int argc, char *argv[])
+{
+    static uint8_t workspace[4096];
+    const uint16_t widths[] = { 320, 160, 640, 318, 323 }; // incl. widths with SIMD tails
+
+    /* random strips */
+    srand(1);
+    for (uint16_t i = 0; i < 1000; i++) {
+        uint16_t width = widths[i % (sizeof(widths)/sizeof(widths[0]))];
+        for (uint32_t k = 0; k < width*IMG_HEIGHT*3; k++) strip[k] = rand() & 0xFF;
+        if (i < 10) memset(strip, (i & 1) ? 0xFF : 0x00, width*IMG_HEIGHT*3); // saturated strips
+        yuv_check_strip(strip, width, IMG_HEIGHT);
+    }
+    printf("yuv: %u random strips, %u mismatches\n", (unsigned int)yuv_strips, (unsigned int)yuv_errors);
+
+    /* decoded strips of real images */
+    memset(yuv_time, 0, sizeof(yuv_time));
+    uint32_t random_strips = yuv_strips;
+    for (int i = 0; i < argc; i++) {
+        JDEC jdec;
+        if (!load_jpeg(argv[i])) return 1;
+        jpeg_pos = 0;
+        if (jd_prepare(&jdec, yuv_input, workspace, sizeof(workspace), NULL) != JDR_OK || jdec.width > YUV_MAX_WIDTH
+            || jd_decomp(&jdec, yuv_output, 0) != JDR_OK) {
+            fprintf(stderr, "%s: decoding failed\n", argv[i]);
+            return 1;
+        }
+    }
+    printf("yuv: %u image strips, %u mismatches total\n", (unsigned int)(yuv_strips - random_strips), (unsigned int)yuv_errors);
+    for (uint8_t v = 0; v < YUV_VARIANTS && yuv_strips > random_strips; v++) {
+        printf("yuv: %-5s %6.0f ns per strip (luma + 2 lines chroma)\n", yuv_variants[v].name, yuv_time[v] * 1e9 / (yuv_strips - random_strips));
+    }
+    return yuv_errors ? 1 : 0;
+}
+
+
+static UINT bench_output(JDEC* jd, void* bitmap, JRECT* rect)
+{
+    const uint8_t *p = bitmap;
+    uint32_t n = 3 * (rect->right - rect->left + 1) * (rect->bottom - rect->top + 1);
+    if (p == NULL) return 0; // data error concealed by the decoder
+    while (n--) bench_sum = bench_sum * 31 + *p++;
+    return 1;
+}
+
+
+/* Playback time of one strip of the mode in us, the time a rotated pass has to decode the next strip */
+static uint32_t strip_us(uint8_t mode)
+{
+    const SSTV_MODE *m = sstv_get_mode(mode);
+    uint32_t us = 0;
+
+    for (const SSTV_SEGMENT *seg = m->seq; seg->us; seg++) us += seg->us;
+    return us * IMG_HEIGHT / m->lines;
+}
+
+
+/* Decode time of camera images (best of runs), validation and thumbnail as in plan_task, full size with a checksum
+   of its output, the centre window of 1/4 width and height as zoomed by sstv -z 4:50:50, and the rotated Robot36
+   image as sent by sstv -R cw per strip pass, resumed from the decoder state index or decoded from the start */
+static int cmd_bench(int argc, char *argv[])
+{
+    static uint8_t workspace[IMG_WORKSPACE];
+    const int runs = 50;
+    double test_total = 0, thumb_total = 0, full_total = 0, window_total = 0, pass_total = 0, reparse_total = 0;
+
+    for (int i = 0; i < argc; i++) {
+        JDEC jdec;
+        struct timespec start;
+        bool ok = load_jpeg(argv[i]);
+
+        double test = 1e9, thumb = 1e9, full = 1e9, window = 1e9;
+        for (int r = 0; ok && r < runs; r++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            ok = jpeg_test(jpeg, jpeg_length);
+            double t = elapsed(&start);
+            if (t < test) test = t;
+        }
+
+        bool preview = ok; // no thumbnail of images other than 320 or 640 pixel wide
+        for (int r = 0; preview && r < runs; r++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            preview = jpeg_thumbnail(jpeg, NULL);
+            double t = elapsed(&start);
+            if (t < thumb) thumb = t;
+        }
+        if (!preview) thumb = 0;
+
+        for (int r = 0; ok && r < runs; r++) {
+            bench_sum = 0;
+            jpeg_pos = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            ok = jd_prepare(&jdec, yuv_input, workspace, sizeof(workspace), NULL) == JDR_OK && jd_decomp(&jdec, bench_output, 0) == JDR_OK;
+            double t = elapsed(&start);
+            if (t < full) full = t;
+        }
+        uint32_t sum = bench_sum;
+
+        for (int r = 0; ok && r < runs; r++) {
+            jpeg_pos = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            ok = jd_prepare(&jdec, yuv_input, workspace, sizeof(workspace), NULL) == JDR_OK;
+            jdec.crop.left = jdec.width * 3 / 8; jdec.crop.right = jdec.crop.left + jdec.width / 4 - 1;
+            jdec.crop.top = jdec.height * 3 / 8; jdec.crop.bottom = jdec.crop.top + jdec.height / 4 - 1;
+            ok = ok && jd_decomp(&jdec, bench_output, 0) == JDR_OK;
+            double t = elapsed(&start);
+            if (t < window) window = t;
+        }
+
+        double pass = 1e9, reparse = 1e9;
+        uint16_t passes = 0;
+        for (int r = 0; ok && r < 2 * runs; r++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            ok = jpeg_benchmark_rotate(jpeg, 36, r < runs, &passes) != 0;
+            double t = elapsed(&start) / passes;
+            if (r < runs && t < pass) pass = t;
+            if (r >= runs && t < reparse) reparse = t;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%s: decoding failed\n", argv[i]);
+            return 1;
+        }
+        printf("%-34s %4ux%-4u test %6.3fms  thumbnail %7.3fms  full %7.3fms  window %7.3fms  pass %6.3f/%6.3fms  sum %08x\n", argv[i],
+            jdec.width, jdec.height, test * 1e3, thumb * 1e3, full * 1e3, window * 1e3, pass * 1e3, reparse * 1e3, (unsigned int)sum);
+        test_total += test;
+        thumb_total += thumb;
+        full_total += full;
+        window_total += window;
+        pass_total += pass;
+        reparse_total += reparse;
+    }
+    if (argc) {
+        printf("%-44s test %6.3fms  thumbnail %7.3fms  full %7.3fms  window %7.3fms  pass %6.3f/%6.3fms\n", "average",
+            test_total * 1e3 / argc, thumb_total * 1e3 / argc, full_total * 1e3 / argc, window_total * 1e3 / argc,
+            pass_total * 1e3 / argc, reparse_total * 1e3 / argc);
+        printf("rotated pass (index/reparse) against Robot36 strip playback %ums: %.4f%%/%.4f%%\n", (unsigned int)(strip_us(36) / 1000),
+            pass_total * 1e8 / argc / strip_us(36), reparse_total * 1e8 / argc / strip_us(36));
+    }
+    return 0;
+}
+
+
+/* Per sample cost of the SSTV tone generator at 8-bit DAC resolution: the former audio_to_buffer() computing the
+   phase increment of each sample and calling arm_sin_q15(), against the NCO of audio.c with pixel increments
+   precomputed and the sine LUT; a random scanline of 1500-2300Hz, best of runs */
+static int cmd_nco(void)
+{
+    static uint8_t line[IMG_WIDTH], before[AUDIO_BUFFER_LEN], after[AUDIO_BUFFER_LEN];
+    static q31_t pixel_inc[256];
+    const uint16_t rate = SAMPLE_FREQ;
+    const q15_t ampl = AUDIO_VOLUME_SSTV;
+    const int runs = 200;
+    double t_before = 1e9, t_after = 1e9;
+    uint32_t diff = 0, diff_max = 0, samples = 0;
+    q31_t phi_before = 0, phi_after = 0;
+
+    srand(1);
+    for (uint16_t i = 0; i < IMG_WIDTH; i++) line[i] = rand() & 0xFF;
+    for (uint16_t v = 0; v < 256; v++) pixel_inc[v] = (q31_t)((1ULL << 31) / rate) * (1500 + (2300-1500) * v / 255);
+
+    for (int r = 0; r < runs; r++) {
+        struct timespec start;
+        uint16_t x = (r * AUDIO_BUFFER_LEN) % IMG_WIDTH;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint16_t i = 0, k = x; i < AUDIO_BUFFER_LEN; i++, k = (k + 1 < IMG_WIDTH) ? k + 1 : 0) {
+            uint16_t freq = 1500 + (2300-1500) * line[k] / 255;
+            phi_before += (q31_t)((1ULL << 31) / rate) * freq; // phase accumulator
+            phi_before &= 0x7fffffff;
+            int8_t y = (arm_sin_q15(phi_before >> 16) * ampl) >> (24-1); // sinus(phi) * amplitude, convert to q7_t
+            before[i] = y ^ 0x80; // bias to Vcc/2
+        }
+        double t = elapsed(&start);
+        if (t < t_before) t_before = t;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint16_t i = 0, k = x; i < AUDIO_BUFFER_LEN; i++, k = (k + 1 < IMG_WIDTH) ? k + 1 : 0) {
+            phi_after = (phi_after + pixel_inc[line[k]]) & 0x7fffffff; // audio_nco()
+            after[i] = ((SINE_TABLE[NCO_INDEX(phi_after)] * ampl) >> 23) + 0x80;
+        }
+        t = elapsed(&start);
+        if (t < t_after) t_after = t;
+
+        for (uint16_t i = 0; i < AUDIO_BUFFER_LEN; i++) {
+            uint32_t d = abs((int)before[i] - (int)after[i]);
+            if (d) diff++;
+            if (d > diff_max) diff_max = d;
+        }
+        samples += AUDIO_BUFFER_LEN;
+    }
+
+    printf("nco: arm_sin_q15() per sample %6.2f ns/sample\n", t_before * 1e9 / AUDIO_BUFFER_LEN);
+    printf("nco: sine LUT NCO             %6.2f ns/sample, %.1fx\n", t_after * 1e9 / AUDIO_BUFFER_LEN, t_before / t_after);
+    printf("nco: %u samples, %.1f%% differ, max %u LSB  %s\n", (unsigned int)samples, diff * 100.0 / samples,
+        (unsigned int)diff_max, (diff_max <= 1) ? "OK" : "FAIL");
+    return (diff_max <= 1) ? 0 : 1;
+}
+
+
+/* Former per-sample output path of audio.c: every sample is stored by sample_to_buffer(), which checks the DMA
+   state, the half buffer and the index wrap; the DMA is emulated as taking each half at once */
+#define PS_BUFFER_LEN 4096 // former audio buffer, also the length of the ramps
+static uint8_t ps_buffer[PS_BUFFER_LEN];
+static uint16_t ps_idx;
+static volatile uint8_t ps_current_buffer;
+static volatile bool ps_dma_ready;
+static q31_t ps_phi;
+static uint32_t ps_frac, ps_samples;
+
+
+static void ps_sample_to_buffer(uint8_t value)
+{
+    ps_buffer[ps_idx++] = value;
+    if (ps_dma_ready && ps_idx == PS_BUFFER_LEN/2) {
+        /* buffer filled to 1st half, DMA idle -> start audio output */
+        ps_dma_ready = false;
+        ps_current_buffer = 0;
+    }
+    else if (ps_idx == PS_BUFFER_LEN/2) {
+        /* 2nd half is played, the DMA is already in it */
+        ps_current_buffer = 0;
+        while (ps_current_buffer == 1) {}
+    }
+    else if (ps_idx == PS_BUFFER_LEN) {
+        /* 1st half is played, the DMA is already in it */
+        ps_current_buffer = 1;
+        while (ps_current_buffer == 0) {}
+        ps_idx = 0;
+        HAL_IWDG_Refresh(&hiwdg);
+    }
+}
+
+
+static void ps_audio_to_buffer(uint16_t freq, q15_t ampl)
+{
+    ps_phi += (q31_t)((1ULL << 31) / SAMPLE_FREQ) * freq; // phase accumulator
+    ps_phi &= 0x7fffffff;
+    int8_t y = (arm_sin_q15(ps_phi >> 16) * ampl) >> (24-1); // sinus(phi) * amplitude, convert to q7_t
+    y ^= 0x80; // bias to Vcc/2
+    ps_sample_to_buffer(y);
+}
+
+
+/* Segment duration to samples with the remainder carried, the same sample counts as audio_samples() */
+static uint32_t ps_sstv_samples(uint32_t us)
+{
+    const uint32_t period = AUDIO_TIM_CLOCK / SAMPLE_FREQ;
+    uint32_t t = us + ps_frac;
+    ps_frac = t % period;
+    ps_samples += t / period;
+    return t / period;
+}
+
+
+static void ps_sstv_tone(uint32_t us, uint16_t freq)
+{
+    uint32_t samples = ps_sstv_samples(us);
+    while (samples--) ps_audio_to_buffer(freq, AUDIO_VOLUME_SSTV);
+}
+
+
+static void ps_sstv_line(uint32_t us, uint16_t width, uint8_t *line)
+{
+    uint32_t t = ps_sstv_samples(us);
+    for (uint32_t i = 0; i < t; i++) {
+        int idx = i * width / t;
+        int freq = 1500 + (2300-1500) * line[idx] / 255; // convert uint8_t to 1500-2300Hz range
+        ps_audio_to_buffer(freq, AUDIO_VOLUME_SSTV);
+    }
+}
+
+
+/* Cosinus ramp of one buffer between 0V and Vcc/2 bias, as in the former audio_start() and audio_stop() */
+static void ps_ramp(q15_t offset)
+{
+    for (uint16_t i = 0; i < PS_BUFFER_LEN; i++) {
+        q15_t theta = i * (0x4000 / PS_BUFFER_LEN);
+        q15_t ramp = (arm_cos_q15(theta + offset) / 2) + 0x4000;
+        ps_sample_to_buffer(ramp >> 8);
+    }
+    ps_samples += PS_BUFFER_LEN;
+}
+
+
+/* Robot36 image of RGB888 rows through the former per-sample path, audio_sstv_scan() sequence */
+static void ps_sstv_image(const SSTV_MODE *mode, uint8_t *scanline, uint16_t rows)
+{
+    uint8_t luma[IMG_WIDTH_MAX*2];
+    uint8_t chroma[IMG_WIDTH_MAX];
+    uint16_t width = mode->width;
+
+    ps_idx = 0;
+    ps_phi = 0;
+    ps_frac = 0;
+    ps_samples = 0;
+    ps_dma_ready = true;
+    ps_ramp(0x4000);
+    for (uint16_t line = 0; line < rows; line += mode->lines) {
+        yuv_luma(scanline, luma, width * mode->lines);
+        for (const SSTV_SEGMENT *seg = mode->seq; seg->us; seg++) {
+            if (seg->scan == SSTV_TONE) ps_sstv_tone(seg->us, seg->freq);
+            else if (seg->scan == SSTV_LUMA) ps_sstv_line(seg->us, width, luma + seg->line*width);
+            else {
+                yuv_chroma_2lines(scanline, luma, chroma, (seg->scan == SSTV_R_Y) ? CHROMA_R_Y : CHROMA_B_Y, width);
+                ps_sstv_line(seg->us, width, chroma);
+            }
+        }
+        scanline += width*mode->lines*3;
+    }
+    ps_ramp(0);
+    for (uint16_t i = 0; i < PS_BUFFER_LEN; i++) ps_sample_to_buffer(0); // fill buffer with zero samples
+    ps_samples += PS_BUFFER_LEN;
+}
+
+
+static UINT frame_output(JDEC* jd, void* bitmap, JRECT* rect)
+{
+    uint8_t *src = bitmap;
+    uint16_t bws = 3 * (rect->right - rect->left + 1);
+    if (src == NULL) return 0; // data error concealed by the decoder
+    for (uint16_t y = rect->top; y <= rect->bottom && y < 240; y++) {
+        memcpy(frame + 3 * (y * IMG_WIDTH + rect->left), src, bws);
+        src += bws;
+    }
+    return 1;
+}
+
+
+/* Audio throughput of a full Robot36 image of 320x240 RGB888 rows, JPEG decoding excluded: the former per-sample
+   sample_to_buffer() path against the block rendering of audio.c fed by audio_sstv_scan() per strip, best of runs */
+static int cmd_throughput(const char *filename)
+{
+    static uint8_t workspace[4096];
+    const SSTV_MODE *mode = sstv_get_mode(36);
+    const int runs = 5;
+    double t_sample = 1e9, t_block = 1e9;
+    uint32_t block_samples = 0;
+    JDEC jdec;
+
+    if (!load_jpeg(filename)) return 1;
+    jpeg_pos = 0;
+    if (jd_prepare(&jdec, yuv_input, workspace, sizeof(workspace), NULL) != JDR_OK || jdec.width != IMG_WIDTH
+        || jdec.height < 240 || jd_decomp(&jdec, frame_output, 0) != JDR_OK) {
+        fprintf(stderr, "%s: 320x240 image needed\n", filename);
+        return 1;
+    }
+
+    host_wav_open(NULL);
+    audio_set_rate(SAMPLE_FREQ);
+    for (int r = 0; r < runs; r++) {
+        struct timespec start;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ps_sstv_image(mode, frame, 240);
+        double t = elapsed(&start);
+        if (t < t_sample) t_sample = t;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        audio_start();
+        for (uint16_t k = 0; k < 240; k += IMG_HEIGHT) audio_sstv_scan(mode, frame + k * IMG_WIDTH * 3, IMG_HEIGHT);
+        audio_stop();
+        t = elapsed(&start);
+        if (t < t_block) t_block = t;
+        block_samples = audio_get_queued();
+    }
+
+    printf("throughput: per-sample %9u samples %7.3fms  %6.2f ns/sample  %5.1f Msamples/s\n", (unsigned int)ps_samples,
+        t_sample * 1e3, t_sample * 1e9 / ps_samples, ps_samples * 1e-6 / t_sample);
+    printf("throughput: block      %9u samples %7.3fms  %6.2f ns/sample  %5.1f Msamples/s, %.1fx\n", (unsigned int)block_samples,
+        t_block * 1e3, t_block * 1e9 / block_samples, block_samples * 1e-6 / t_block,
+        (t_sample / ps_samples) / (t_block / block_samples));
+    return 0;
+}
+
+
+static int cmd_check(const char *filename)
+{
+    const uint16_t rates[] = { PSK_SAMPLE_FREQ, 16000, SAMPLE_FREQ, 24000 };
+    int fail = 0;
+
+    if (!load_jpeg(filename)) return 1;
+    host_wav_open(NULL);
+    for (uint8_t r = 0; r < sizeof(rates)/sizeof(rates[0]); r++) {
+        audio_set_rate(rates[r]);
+        for (uint8_t i = 0; i < sizeof(sstv_spec)/sizeof(sstv_spec[0]); i++) {
+            uint64_t us = VOX_US + sstv_spec[i].vis_us + (uint64_t)sstv_spec[i].lines * sstv_spec[i].line_us;
+            if (!sstv_play_jpeg(jpeg, sstv_spec[i].mode)) {
+                uint16_t width = sstv_get_mode(sstv_spec[i].mode)->width;
+                printf("%5uHz %-9s skipped, %u pixel wide mode\n", (unsigned int)audio_get_rate(), sstv_spec[i].name, width);
+                continue;
+            }
+            uint32_t period = htim6.Instance->ARR + 1; // us per sample
+            uint32_t expected = 2 * AUDIO_RAMP_LEN + AUDIO_BUFFER_LEN + us / period; // ramps and trailing zeros
+            int32_t diff = (int32_t)(audio_get_queued() - expected);
+            bool ok = (diff >= -1 && diff <= 1) && sstv_get_duration(sstv_spec[i].mode) == us / 1000;
+            printf("%5uHz %-9s %3u lines x %7.3fms  %9u samples, expected %9u  %+d  %s\n",
+                (unsigned int)audio_get_rate(), sstv_spec[i].name, sstv_spec[i].lines, sstv_spec[i].line_us / 1000.0,
+                (unsigned int)audio_get_queued(), (unsigned int)expected, (int)diff, ok ? "OK" : "FAIL"
+            );
+            if (!ok) fail = 1;
+        }
+    }
+    audio_set_rate(SAMPLE_FREQ);
+
+    /* structural validation: the image passes, each length cutting its data before EOI is rejected */
+    uint32_t end = jpeg_length;
+    while (end >= 2 && !(jpeg[end - 2] == 0xFF && jpeg[end - 1] == 0xD9)) end--;
+    bool ok = jpeg_test(jpeg, jpeg_length);
+    for (uint32_t len = 0; ok && len < end; len++) {
+        if (jpeg_test(jpeg, len)) ok = false;
+    }
+    printf("jpeg_test %u bytes, %u truncated lengths rejected  %s\n", (unsigned int)jpeg_length, (unsigned int)end, ok ? "OK" : "FAIL");
+    if (!ok) fail = 1;
+
+    return fail;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *overlay = NULL;
+    const char *mix = NULL;
+    uint16_t rate = 0;
+    unsigned int zoom[3] = { 0 };
+    uint8_t rotate = SSTV_ROTATE_NONE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vf:o:r:m:z:R:")) != -1) {
+        switch (opt) {
+            case 'v': host_verbose = true; break;
+            case 'f':
+                if (!host_flash_load(optarg)) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'o': overlay = optarg; break;
+            case 'r': rate = atoi(optarg); break;
+            case 'm': mix = optarg; break;
+            case 'z':
+                if (sscanf(optarg, "%u:%u:%u", &zoom[0], &zoom[1], &zoom[2]) != 3) usage();
+                break;
+            case 'R':
+                if (streq(optarg, "cw")) rotate = SSTV_ROTATE_CW;
+                else if (streq(optarg, "ccw")) rotate = SSTV_ROTATE_CCW;
+                else usage();
+                break;
+            default: usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 1) usage();
+
+    if (streq(argv[0], "sstv") && argc == 4) {
+        uint8_t *img = NULL;
+        int sector = -1;
+        if (argv[2][0] == '@') sector = atoi(&argv[2][1]);
+        else if (strcmp(argv[2], "-") != 0) {
+            if (!load_jpeg(argv[2])) return 1;
+            img = jpeg;
+        }
+        if (!host_wav_open(argv[3])) {
+            perror(argv[3]);
+            return 1;
+        }
+        audio_set_rate(rate ? rate : SAMPLE_FREQ);
+        set_overlay(overlay);
+        sstv_set_zoom(zoom[0], zoom[1], zoom[2]);
+        sstv_set_rotate(rotate);
+        if (!set_mix(mix, AUDIO_VOLUME_MIX)) usage();
+        render_begin();
+        bool ok;
+        if (sector >= 0) {
+            uint32_t length;
+            flash_read(ADDR_FLASHINFO(sector), (uint8_t*)&length, sizeof(length));
+            ok = sstv_play_flash(sector, length, atoi(argv[1]));
+        }
+        else ok = sstv_play_jpeg(img, atoi(argv[1]));
+        render_end();
+        if (ok && sstv_get_slack() != UINT16_MAX) fprintf(stderr, "worst audio slack at strip end %ums\n", sstv_get_slack() * 10);
+        host_wav_close();
+        return ok ? 0 : 1;
+    }
+    else if (streq(argv[0], "psk") && argc == 5) {
+        audio_set_rate(rate ? rate : PSK_SAMPLE_FREQ);
+        if (!host_wav_open(argv[4])) {
+            perror(argv[4]);
+            return 1;
+        }
+        if (!set_mix(mix, AUDIO_VOLUME_PSK)) usage();
+        render_begin();
+        audio_start();
+        audio_psk(atoi(argv[1]), atoi(argv[2]), argv[3]);
+        audio_stop();
+        render_end();
+        host_wav_close();
+        return 0;
+    }
+    else if (streq(argv[0], "cw") && argc == 5) {
+        audio_set_rate(rate ? rate : PSK_SAMPLE_FREQ);
+        if (!host_wav_open(argv[4])) {
+            perror(argv[4]);
+            return 1;
+        }
+        if (!set_mix(mix, AUDIO_VOLUME_MIX)) usage();
+        render_begin();
+        audio_start();
+        audio_morse(atoi(argv[1]), atoi(argv[2]), argv[3]);
+        audio_stop();
+        render_end();
+        host_wav_close();
+        return 0;
+    }
+    else if (streq(argv[0], "fit") && argc == 3) {
+        uint8_t mode = sstv_fit_mode(atoi(argv[1]), atoi(argv[2]) * 1000);
+        if (mode == 0) printf("no mode fits %ss slot\n", argv[2]);
+        else printf("%s, %.1fs\n", sstv_get_mode(mode)->name, sstv_get_duration(mode) / 1000.0);
+        return 0;
+    }
+    else if (streq(argv[0], "check") && argc <= 2) {
+        set_overlay(overlay);
+        return cmd_check(argc == 2 ? argv[1] : "../Inc/sstv_monoscope.jpg");
+    }
+    else if (streq(argv[0], "bench") && argc > 1) {
+        return cmd_bench(argc - 1, argv + 1);
+    }
+    else if (streq(argv[0], "throughput") && argc <= 2) {
+        return cmd_throughput(argc == 2 ? argv[1] : "../Inc/sstv_monoscope.jpg");
+    }
+    else if (streq(argv[0], "nco") && argc == 1) {
+        return cmd_nco();
+    }
+    else if (streq(argv[0], "yuv")) {
+        char *def[] = { "../Inc/sstv_monoscope.jpg" };
+        return (argc > 1) ? cmd_yuv(argc - 1, argv + 1) : cmd_yuv(1, def);
+    }
+    usage();
+    return 2;
+}
@@ -0,0 +1,82 @@
+/*************************************************************************
+ *
+ * SatCam - Camera Module for PSAT-2
+ * Copyright (c) 2015-2017 Ales Povalac <alpov@alpov.net>
+ * Dept. of Radio Electronics, Brno University of Technology
+ *
+ * This work is licensed under the terms of the MIT license
+ *
+ *************************************************************************/
+
+/* Host replacement of the STM32 HAL, just enough for audio.c, sstv.c and tjpgd.c.
+   DAC DMA is emulated by hal_host.c, played buffer halves go to the WAV sink. */
+
+#ifndef _HOST_HAL_H_
+#define _HOST_HAL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define __weak          __attribute__((weak))
+#define __DMB()         __asm__ volatile ("" ::: "memory")
+#define __WFI()         do {} while (0)
+
+/* Cortex-M4 SIMD instructions in C, for cross-checking the DSP kernels on the host */
+#define HOST_DSP_INTRINSICS
+
+static inline uint32_t __UXTB16(uint32_t x)
+{
+    return x & 0x00FF00FF;
+}
+
+static inline uint32_t __UHADD8(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+    for (int i = 0; i < 32; i += 8) r |= ((((a >> i) & 0xFF) + ((b >> i) & 0xFF)) >> 1) << i;
+    return r;
+}
+
+static inline uint32_t __SMLAD(uint32_t a, uint32_t b, uint32_t acc)
+{
+    return acc + (int16_t)a * (int16_t)b + (int16_t)(a >> 16) * (int16_t)(b >> 16);
+}
+
+#define __PKHTB(__a, __b, __sh) (((uint32_t)(__a) & 0xFFFF0000) | (((uint32_t)(__b) >> (__sh)) & 0x0000FFFF))
+
+typedef enum { HAL_OK, HAL_ERROR, HAL_BUSY, HAL_TIMEOUT } HAL_StatusTypeDef;
+typedef enum { HAL_DMA_STATE_RESET, HAL_DMA_STATE_READY, HAL_DMA_STATE_BUSY } HAL_DMA_StateTypeDef;
+
+typedef struct {
+    volatile uint32_t PSC;
+    volatile uint32_t ARR;
+} TIM_TypeDef;
+
+typedef struct { TIM_TypeDef *Instance; } TIM_HandleTypeDef;
+typedef struct { HAL_DMA_StateTypeDef State; } DMA_HandleTypeDef;
+typedef struct { int dummy; } DAC_HandleTypeDef, IWDG_HandleTypeDef, ADC_HandleTypeDef, CRC_HandleTypeDef,
+    DCMI_HandleTypeDef, I2C_HandleTypeDef, SPI_HandleTypeDef, UART_HandleTypeDef;
+
+#define DAC_CHANNEL_2           0x10
+#define DAC_ALIGN_12B_R         0x00
+#define DAC_ALIGN_8B_R          0x08
+#define PWR_MAINREGULATOR_ON    0
+#define PWR_SLEEPENTRY_WFI      1
+
+#define LED_R_GPIO_Port         NULL
+#define LED_R_Pin               0
+#define LED_G_GPIO_Port         NULL
+#define LED_G_Pin               0
+#define HAL_GPIO_WritePin(__port, __pin, __state) do {} while (0)
+
+static inline void HAL_IWDG_Refresh(IWDG_HandleTypeDef *hiwdg) {}
+static inline void HAL_TIM_Base_Start(TIM_HandleTypeDef *htim) {}
+static inline void HAL_TIM_Base_Stop(TIM_HandleTypeDef *htim) {}
+
+extern HAL_StatusTypeDef HAL_DAC_Start_DMA(DAC_HandleTypeDef *hdac, uint32_t Channel, uint32_t *pData, uint32_t Length, uint32_t Alignment);
+extern HAL_StatusTypeDef HAL_DAC_Stop_DMA(DAC_HandleTypeDef *hdac, uint32_t Channel);
+extern void HAL_DACEx_ConvCpltCallbackCh2(DAC_HandleTypeDef *hdac);
+extern void HAL_DACEx_ConvHalfCpltCallbackCh2(DAC_HandleTypeDef *hdac);
+extern void HAL_PWR_EnterSLEEPMode(uint32_t Regulator, uint8_t SLEEPEntry);
+extern uint32_t HAL_GetTick(void);
+
+#endif /* _HOST_HAL_H_ */